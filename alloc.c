@@ -0,0 +1,252 @@
+/******************************************************************************
+ * alloc.c
+ * ```````
+ * Where the bit arrays live
+ *
+ * A filter larger than the caches costs a miss per probe, and on 4 KiB
+ * pages it costs a TLB miss on top: a 1 GiB array is 262144 pages, far
+ * more than any TLB holds, so nearly every probe also walks the page
+ * tables. On 2 MiB pages the same array is 512 of them. How the array is
+ * allocated is therefore part of how fast the filter is, and the options
+ * of a struct bloom_alloc (see bloom_new_alloc()) control it:
+ *
+ *      align                   alignment of the array, 64 bytes at least
+ *      BLOOM_ALLOC_HUGETLB     explicit huge pages (MAP_HUGETLB), which
+ *                              have to be reserved by the administrator;
+ *                              transparent ones when there are none
+ *      BLOOM_ALLOC_THP         transparent huge pages (MADV_HUGEPAGE)
+ *      BLOOM_ALLOC_PREFAULT    fault every page in at allocation, rather
+ *                              than on the first inserts that touch them
+ *      BLOOM_ALLOC_NUMA        bind the array to NUMA node 'node'
+ *      BLOOM_ALLOC_NUMA_PREFER prefer node 'node', but take others when
+ *                              it is full
+ *      alloc, free, ctx        a user allocator, instead of all the above
+ *
+ * NOTES
+ * The page options are implemented with an anonymous mmap() of the
+ * array; without any, it comes from calloc(), which for large sizes is an
+ * mmap() too, and small filters are not worth a system call.
+ *
+ * One chunk holds the array and whatever goes with it (for a bloom_t,
+ * the header and its hash function table), with the array first, so that
+ * it starts on the alignment (or page) boundary.
+ *
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define HUGE_PAGE (2UL << 20)
+
+#define PAGE_FLAGS (BLOOM_ALLOC_HUGETLB | BLOOM_ALLOC_THP | BLOOM_ALLOC_PREFAULT \
+                  | BLOOM_ALLOC_NUMA | BLOOM_ALLOC_NUMA_PREFER)
+
+
+/******************************************************************************
+ * bloom_numa_nodes  Count the NUMA nodes of the machine.
+ * ````````````````
+ * Returns: the number of the highest online node plus one, or 1 when the
+ *          machine doesn't say.
+ *
+ ******************************************************************************/
+int bloom_numa_nodes(void)
+{
+        FILE *f;
+        int c, n, max;
+
+        if (!(f = fopen("/sys/devices/system/node/online", "r")))
+                return 1;
+
+        /* A list of ranges, e.g. "0-3,5"; the last number is the highest */
+        for (max=0, n=0; (c = fgetc(f)) != EOF; ) {
+                if (c >= '0' && c <= '9') {
+                        n = n*10 + (c - '0');
+                } else {
+                        max = n > max ? n : max;
+                        n   = 0;
+                }
+        }
+        max = n > max ? n : max;
+
+        fclose(f);
+
+        return max + 1;
+}
+
+
+/******************************************************************************
+ * chunk_kind  Decide how a chunk with these options is allocated.
+ * ``````````
+ * Returns: 'u'ser hook, 'p'ages (mmap), or 'c'alloc.
+ *
+ ******************************************************************************/
+static int chunk_kind(const struct bloom_alloc *opts)
+{
+        if (!opts)
+                return 'c';
+        if (opts->alloc)
+                return 'u';
+        if ((opts->flags & PAGE_FLAGS) || opts->align > 64)
+                return 'p';
+
+        return 'c';
+}
+
+
+/******************************************************************************
+ * pages_map  Map zeroed pages, huge ones if asked for and available.
+ * `````````
+ * @bytes : size wanted
+ * @opts  : options
+ * @size  : out, size actually mapped, for munmap()
+ * Returns: the start of the mapping, aligned as asked, or NULL.
+ *
+ * NOTES
+ * Transparent huge pages are only used for 2 MiB aligned ranges of a
+ * mapping, and mmap() only promises 4 KiB alignment, so for those (and
+ * for any alignment past a page) a larger range is mapped and its ends
+ * trimmed off.
+ *
+ ******************************************************************************/
+static void *pages_map(size_t bytes, const struct bloom_alloc *opts, size_t *size)
+{
+        size_t align, page, lead;
+        char *p;
+
+        page  = sysconf(_SC_PAGESIZE);
+        align = opts->align > page ? opts->align : page;
+
+        if (opts->flags & BLOOM_ALLOC_HUGETLB) {
+                *size = (bytes + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+                p = mmap(NULL, *size, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+                if (p != MAP_FAILED && ((uintptr_t)p & (align - 1)) == 0)
+                        return p;
+                if (p != MAP_FAILED)
+                        munmap(p, *size);
+        }
+
+        if (opts->flags & (BLOOM_ALLOC_HUGETLB | BLOOM_ALLOC_THP)) {
+                if (align < HUGE_PAGE)
+                        align = HUGE_PAGE;
+        }
+
+        bytes = (bytes + page - 1) & ~(page - 1);
+
+        p = mmap(NULL, bytes + align - page, PROT_READ|PROT_WRITE,
+                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+                return NULL;
+
+        /* Trim to [p + lead, p + lead + bytes) */
+        lead = (align - ((uintptr_t)p & (align - 1))) & (align - 1);
+        if (lead)
+                munmap(p, lead);
+        if (align - page - lead)
+                munmap(p + lead + bytes, align - page - lead);
+
+        p    += lead;
+        *size = bytes;
+
+        if (opts->flags & (BLOOM_ALLOC_HUGETLB | BLOOM_ALLOC_THP))
+                madvise(p, bytes, MADV_HUGEPAGE);       /* best effort */
+
+        return p;
+}
+
+
+/******************************************************************************
+ * bloom_chunk_alloc  Allocate a zeroed chunk to hold a bit array.
+ * `````````````````
+ * @bytes : size of the chunk, the array first
+ * @opts  : allocation options, or NULL for the defaults
+ * @chunk : out, what to hand to bloom_chunk_free()
+ * @size  : out, likewise
+ * Returns: the start of the array, aligned as asked, or NULL.
+ *
+ * NOTES
+ * The NUMA policy is set before anything touches the pages, so they are
+ * faulted in on the node; the prefault is done after it for the same
+ * reason. Binding is strict (the allocation fails, at fault time, if the
+ * node is out of memory), preferring is not.
+ *
+ ******************************************************************************/
+uint64_t *bloom_chunk_alloc(size_t bytes, const struct bloom_alloc *opts,
+                            void **chunk, size_t *size)
+{
+        unsigned long nodemask;
+        size_t align, n;
+        char *p;
+
+        align = opts && opts->align > 64 ? opts->align : 64;
+
+        switch (chunk_kind(opts)) {
+        case 'u':
+                if (!(p = opts->alloc(opts->ctx, bytes, align)))
+                        return NULL;
+                memset(p, 0, bytes);
+                *chunk = p;
+                *size  = bytes;
+                return (uint64_t *)p;
+
+        case 'c':
+                if (!(p = calloc(1, bytes + align - 1)))
+                        return NULL;
+                *chunk = p;
+                *size  = bytes + align - 1;
+                return (uint64_t *)(p + ((align - ((uintptr_t)p & (align - 1))) & (align - 1)));
+        }
+
+        if (!(p = pages_map(bytes, opts, size)))
+                return NULL;
+        *chunk = p;
+
+        if ((opts->flags & (BLOOM_ALLOC_NUMA | BLOOM_ALLOC_NUMA_PREFER))
+         && opts->node >= 0 && opts->node < 8*sizeof(nodemask)) {
+                nodemask = 1UL << opts->node;
+                syscall(SYS_mbind, p, *size,
+                        (opts->flags & BLOOM_ALLOC_NUMA) ? MPOL_BIND : MPOL_PREFERRED,
+                        &nodemask, 8*sizeof(nodemask), 0);      /* best effort */
+        }
+
+        if (opts->flags & BLOOM_ALLOC_PREFAULT) {
+                for (n=0; n<*size; n+=4096)
+                        ((volatile char *)p)[n] = 0;
+        }
+
+        return (uint64_t *)p;
+}
+
+
+/******************************************************************************
+ * bloom_chunk_free  Release a chunk from bloom_chunk_alloc().
+ * ````````````````
+ * @chunk : the chunk
+ * @size  : its size
+ * @opts  : the options it was allocated with
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_chunk_free(void *chunk, size_t size, const struct bloom_alloc *opts)
+{
+        switch (chunk_kind(opts)) {
+        case 'u':
+                if (opts->free)
+                        opts->free(opts->ctx, chunk, size);
+                break;
+        case 'p':
+                munmap(chunk, size);
+                break;
+        default:
+                free(chunk);
+        }
+}
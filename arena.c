@@ -0,0 +1,373 @@
+/******************************************************************************
+ * arena.c
+ * ```````
+ * Arenas of small Bloom filters
+ *
+ * A filter per session, per connection or per document means millions of
+ * filters of a few hundred bits each, made and dropped all the time. For
+ * those, the malloc() of every bloom_new() and the free() of every
+ * bloom_del() cost more than the filter is ever used for, and the heap
+ * ends up scattered with them.
+ *
+ * An arena hands out filters from large slabs instead, each one a bit
+ * array and its header placed one after the other, both on cache line
+ * boundaries, by moving a pointer. Filters in an arena are not freed one
+ * at a time: bloom_arena_reset() takes all of them back at once and keeps
+ * the memory for the next lot, and bloom_arena_del() returns it.
+ *
+ * The hash function table of a bloom_new_in() filter is not copied into
+ * each filter either. The arena keeps one copy of each distinct table it
+ * is handed, and every filter with those functions points at it.
+ *
+ * NOTES
+ * The slabs are allocated with bloom_chunk_alloc(), so the options of a
+ * struct bloom_alloc (huge pages, NUMA node, a user allocator) apply to
+ * them as they do to the array of a bloom_new_alloc() filter. A filter
+ * too large for a slab gets a slab of its own, still freed with the rest.
+ *
+ * CAVEAT
+ * An arena is not thread-safe: use one per thread, or lock around the
+ * bloom_new_in() calls. The filters themselves are as thread-safe as any
+ * other (see BLOOM_CONCURRENT).
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define ARENA_SLAB (1UL << 20)  /* default slab size */
+#define LINE(n)    (((n) + 63) & ~(size_t)63)
+
+
+struct arena_slab {
+        struct arena_slab *next;
+        void *chunk;            /* from bloom_chunk_alloc() */
+        size_t chunk_size;
+};
+
+#define SLAB_HEAD LINE(sizeof(struct arena_slab))
+
+struct arena_table {
+        struct arena_table *next;
+        size_t k;
+        hashfp_t fn[];
+};
+
+struct bloom_arena_t {
+        size_t slab;                    /* bytes per slab */
+        const struct bloom_alloc *opts; /* for the slabs */
+        struct arena_slab *slabs;       /* the one filling up first */
+        struct arena_slab *spare;       /* given back by a reset */
+        struct arena_slab *big;         /* one filter each */
+        size_t used;                    /* bytes of slabs taken */
+        size_t clean;                   /* slabs is still zero from here */
+        size_t bytes;                   /* held, in all */
+        struct arena_table *tables;
+};
+
+
+/******************************************************************************
+ * slab_new  Allocate a slab for an arena.
+ * ````````
+ * @arena : arena
+ * @bytes : size of the slab, header included
+ * Returns: the slab, zeroed, or NULL.
+ *
+ ******************************************************************************/
+static struct arena_slab *slab_new(struct bloom_arena_t *arena, size_t bytes)
+{
+        struct arena_slab *slab;
+        size_t size;
+        void *chunk;
+
+        if (!(slab = (struct arena_slab *)bloom_chunk_alloc(bytes, arena->opts, &chunk, &size)))
+                return NULL;
+
+        slab->chunk      = chunk;
+        slab->chunk_size = size;
+        arena->bytes    += size;
+
+        return slab;
+}
+
+
+static void slab_free_list(struct bloom_arena_t *arena, struct arena_slab *slab)
+{
+        struct arena_slab *next;
+
+        for (; slab; slab=next) {
+                next = slab->next;
+                arena->bytes -= slab->chunk_size;
+                bloom_chunk_free(slab->chunk, slab->chunk_size, arena->opts);
+        }
+}
+
+
+/******************************************************************************
+ * arena_take  Take zeroed, cache line aligned bytes from an arena.
+ * ``````````
+ * @arena : arena
+ * @bytes : bytes wanted, a multiple of 64
+ * Returns: the bytes, or NULL.
+ *
+ * NOTES
+ * Memory from a fresh slab is zero already; only what a reset gave back
+ * has to be cleared, and it is cleared as it is handed out again, not all
+ * at once by the reset.
+ *
+ ******************************************************************************/
+static void *arena_take(struct bloom_arena_t *arena, size_t bytes)
+{
+        struct arena_slab *slab;
+        char *p;
+
+        if (bytes > arena->slab - SLAB_HEAD) {
+                if (!(slab = slab_new(arena, SLAB_HEAD + bytes)))
+                        return NULL;
+                slab->next = arena->big;
+                arena->big = slab;
+                return (char *)slab + SLAB_HEAD;
+        }
+
+        if (!arena->slabs || arena->used + bytes > arena->slab) {
+                if ((slab = arena->spare)) {
+                        arena->spare = slab->next;
+                        arena->clean = arena->slab;
+                } else if ((slab = slab_new(arena, arena->slab))) {
+                        arena->clean = SLAB_HEAD;
+                } else {
+                        return NULL;
+                }
+                slab->next   = arena->slabs;
+                arena->slabs = slab;
+                arena->used  = SLAB_HEAD;
+        }
+
+        p = (char *)arena->slabs + arena->used;
+
+        if (arena->used < arena->clean)
+                memset(p, 0, bytes);
+
+        arena->used += bytes;
+
+        return p;
+}
+
+
+/******************************************************************************
+ * bloom_arena_new  Allocate and return a new, empty arena.
+ * ```````````````
+ * @slab  : bytes per slab, or 0 for 1 MiB
+ * @opts  : how to allocate the slabs (see alloc.c), or NULL for the
+ *          defaults
+ * Returns: An arena holding no memory yet, or NULL.
+ *
+ * CAVEAT
+ * As for bloom_new_alloc(), the arena keeps a pointer to 'opts', which
+ * must stay valid until bloom_arena_del().
+ *
+ ******************************************************************************/
+struct bloom_arena_t *bloom_arena_new(size_t slab, const struct bloom_alloc *opts)
+{
+        struct bloom_arena_t *arena;
+
+        if (!(arena = malloc(sizeof(struct bloom_arena_t))))
+                return NULL;
+
+        arena->slab   = slab ? LINE(slab) : ARENA_SLAB;
+        arena->opts   = opts;
+        arena->slabs  = NULL;
+        arena->spare  = NULL;
+        arena->big    = NULL;
+        arena->used   = 0;
+        arena->clean  = 0;
+        arena->bytes  = 0;
+        arena->tables = NULL;
+
+        /* Room for the slab header and at least something */
+        if (arena->slab < 2*SLAB_HEAD)
+                arena->slab = 2*SLAB_HEAD;
+
+        return arena;
+}
+
+
+/******************************************************************************
+ * bloom_arena_del  Delete an arena and every filter in it.
+ * ```````````````
+ * @arena : The condemned, and all its filters with it.
+ * Returns: nothing.
+ *
+ * NOTES
+ * There is no need to bloom_del() the filters first, unless they had
+ * memory added to them since (bloom_track_dirty(), bloom_stats_enable());
+ * bloom_del() on a filter in an arena frees only that.
+ *
+ ******************************************************************************/
+void bloom_arena_del(struct bloom_arena_t *arena)
+{
+        slab_free_list(arena, arena->slabs);
+        slab_free_list(arena, arena->spare);
+        slab_free_list(arena, arena->big);
+        free(arena);
+}
+
+
+/******************************************************************************
+ * bloom_arena_reset  Take back every filter of an arena, keeping its memory.
+ * `````````````````
+ * @arena : arena
+ * Returns: nothing.
+ *
+ * NOTES
+ * The slabs are kept for the next filters, to be cleared as they are
+ * made, so that an arena reset between batches of the same size neither
+ * allocates nor frees again; those of filters too big for a slab are
+ * freed. Every filter of the arena is gone afterwards, as after
+ * bloom_arena_del().
+ *
+ ******************************************************************************/
+void bloom_arena_reset(struct bloom_arena_t *arena)
+{
+        struct arena_slab *slab, *next;
+
+        slab_free_list(arena, arena->big);
+        arena->big = NULL;
+
+        /* The one filling up stays current; the rest are spares */
+        if (arena->slabs) {
+                for (slab=arena->slabs->next; slab; slab=next) {
+                        next         = slab->next;
+                        slab->next   = arena->spare;
+                        arena->spare = slab;
+                }
+                arena->slabs->next = NULL;
+        }
+
+        arena->clean  = arena->used > arena->clean ? arena->used : arena->clean;
+        arena->used   = SLAB_HEAD;
+        arena->tables = NULL;
+}
+
+
+/******************************************************************************
+ * bloom_arena_bytes  Tell how much memory an arena holds.
+ * `````````````````
+ * @arena : arena
+ * Returns: the bytes of all its slabs, used or not.
+ *
+ ******************************************************************************/
+size_t bloom_arena_bytes(const struct bloom_arena_t *arena)
+{
+        return arena->bytes;
+}
+
+
+/******************************************************************************
+ * bloom_new_k_in  Allocate a single-hash Bloom filter in an arena.
+ * ``````````````
+ * @arena : arena
+ * @size  : size of the bit array in the filter
+ * @nfuncs: the number of bit positions (k) set per key
+ * Returns: A bloom filter, as bloom_new_k(), or NULL (errno EINVAL for a
+ *          size of 0).
+ *
+ * NOTES
+ * The filter takes BLOOM_ARRAY_BYTES(size) plus two cache lines for the
+ * header: 192 bytes for one of 512 bits or less.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_new_k_in(struct bloom_arena_t *arena, size_t size, size_t num_hashes)
+{
+        struct bloom_t *bloom;
+        size_t bytes;
+        char *p;
+
+        if (size == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        bytes = BLOOM_ARRAY_BYTES(size);
+
+        if (!(p = arena_take(arena, bytes + LINE(sizeof(struct bloom_t)))))
+                return NULL;
+
+        bloom = bloom_init((struct bloom_t *)(p + bytes), (uint64_t *)p, size, num_hashes);
+        bloom->own = BLOOM_ARENA;
+
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_new_in  Allocate a Bloom filter in an arena.
+ * ````````````
+ * @arena : arena
+ * @size  : size of the bit array in the filter
+ * @nfuncs: the number of hash functions
+ * @...   : nfuncs hash functions of type hashfp_t
+ * Returns: A bloom filter, as bloom_new(), or NULL (errno EINVAL for a
+ *          size of 0).
+ *
+ * NOTES
+ * The functions are written into a new table at the end of the arena,
+ * which is given back if the arena already has one the same.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_new_in(struct bloom_arena_t *arena, size_t size, size_t num_hashes, ...)
+{
+        struct arena_table *table, *t;
+        struct bloom_t *bloom;
+        size_t bytes;
+        va_list hashes;
+        int n;
+
+        if (size == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        bytes = LINE(sizeof(struct arena_table) + num_hashes*sizeof(hashfp_t));
+
+        if (!(table = arena_take(arena, bytes)))
+                return NULL;
+
+        table->k = num_hashes;
+
+        va_start(hashes, num_hashes);
+
+                for (n=0; n<num_hashes; n++)
+                        table->fn[n] = va_arg(hashes, hashfp_t);
+
+        va_end(hashes);
+
+        for (t=arena->tables; t; t=t->next) {
+                if (t->k == num_hashes && memcmp(t->fn, table->fn, num_hashes*sizeof(hashfp_t)) == 0)
+                        break;
+        }
+
+        if (t) {
+                /* Give it back, as it was, if it is still at the end of the slab */
+                if ((char *)table + bytes == (char *)arena->slabs + arena->used) {
+                        memset(table, 0, bytes);
+                        arena->used -= bytes;
+                }
+                table = t;
+        } else {
+                table->next   = arena->tables;
+                arena->tables = table;
+        }
+
+        if (!(bloom = bloom_new_k_in(arena, size, num_hashes)))
+                return NULL;
+
+        bloom->hash = table->fn;
+
+        return bloom;
+}
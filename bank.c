@@ -0,0 +1,266 @@
+/******************************************************************************
+ * bank.c
+ * ``````
+ * Banks of Bloom filters with shared hashing
+ *
+ * To check a key against many filters (one per tenant, one per block
+ * list), a bloom_check() per filter hashes the key once per filter, and
+ * takes k cache misses per filter. A bank holds up to BLOOM_BANK_MAX
+ * filters with the same m, k and seed, so that the key is hashed once,
+ * and stores them bit-sliced: word i of the bank holds bit i of every
+ * filter, filter f in bit f. Then each of the k probes is one load, the
+ * AND of the k words is at once the answer of every filter, a bitmask,
+ * and the lookup can stop as soon as that is 0.
+ *
+ * The positions are those of a single-hash mode bloom_t of the same m, k
+ * and seed, so filters can be loaded into a bank from one and got back
+ * out as one, bit for bit (see bloom_bank_load(), bloom_bank_extract()).
+ *
+ * NOTES
+ * A bank takes 64 bits per position whatever the number of filters in
+ * it, so a bank of nfilters costs 64/nfilters times their total size.
+ * Banks of more than a handful of filters are what it is for.
+ *
+ * BLOOM_CONCURRENT in bank->flags makes adds atomic, as for a bloom_t.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define ROUND(size) (((size) + WORD_BIT - 1) / WORD_BIT)
+#define BANK_PROBES 512        /* probes in flight per group */
+
+
+/******************************************************************************
+ * bloom_bank_new  Allocate and return a new, empty filter bank.
+ * ``````````````
+ * @size      : size of the bit array of each filter
+ * @num_hashes: the number of bit positions (k) set per key
+ * @nfilters  : the number of filters, 1 to BLOOM_BANK_MAX
+ * Returns: An allocated filter bank, or NULL (errno EINVAL for a size of 0
+ *          or a bad number of filters).
+ *
+ ******************************************************************************/
+struct bloom_bank_t *bloom_bank_new(size_t size, size_t num_hashes, size_t nfilters)
+{
+        struct bloom_bank_t *bank;
+
+        if (size == 0 || nfilters < 1 || nfilters > BLOOM_BANK_MAX) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (!(bank = malloc(sizeof(struct bloom_bank_t))))
+                return NULL;
+
+        if (!(bank->a = calloc(size, sizeof(uint64_t)))) {
+                free(bank);
+                return NULL;
+        }
+
+        bank->m        = size;
+        bank->k        = num_hashes;
+        bank->mask     = (size & (size - 1)) ? 0 : size - 1;
+        bank->seed     = 0;
+        bank->flags    = 0;
+        bank->nfilters = nfilters;
+        bank->live     = nfilters == 64 ? ~0ULL : (1ULL << nfilters) - 1;
+
+        return bank;
+}
+
+
+/******************************************************************************
+ * bloom_bank_del  Delete a filter bank.
+ * ``````````````
+ * @bank  : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_bank_del(struct bloom_bank_t *bank)
+{
+        free(bank->a);
+        free(bank);
+}
+
+
+/******************************************************************************
+ * bloom_bank_add_buf  Add a key to one filter of a bank.
+ * ``````````````````
+ * @bank  : filter bank
+ * @f     : the filter, 0 to nfilters-1
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: 0, or -1 with errno set to EINVAL for a bad f.
+ *
+ ******************************************************************************/
+int bloom_bank_add_buf(struct bloom_bank_t *bank, size_t f, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+        int n;
+
+        if (f >= bank->nfilters) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        bloom_hash_pair(key, len, bank->seed, &h1, &h2);
+
+        for (n=0; n<bank->k; n++, h1+=h2)
+                bloom_setbit(bank->a, bloom_reduce64(h1, bank->m, bank->mask) * WORD_BIT + f,
+                             bank->flags);
+
+        return 0;
+}
+
+int bloom_bank_add(struct bloom_bank_t *bank, size_t f, const char *s)
+{
+        return bloom_bank_add_buf(bank, f, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_bank_check_buf  Find the filters of a bank a key may be in.
+ * ````````````````````
+ * @bank  : filter bank
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: a mask with bit f set if the key may be in filter f, and clear
+ *          if it is certainly not.
+ *
+ ******************************************************************************/
+uint64_t bloom_bank_check_buf(struct bloom_bank_t *bank, const void *key, size_t len)
+{
+        uint64_t h1, h2, hit;
+        int n;
+
+        bloom_hash_pair(key, len, bank->seed, &h1, &h2);
+
+        for (hit=bank->live, n=0; n<bank->k && hit; n++, h1+=h2)
+                hit &= __atomic_load_n(&bank->a[bloom_reduce64(h1, bank->m, bank->mask)],
+                                       __ATOMIC_RELAXED);
+
+        return hit;
+}
+
+uint64_t bloom_bank_check(struct bloom_bank_t *bank, const char *s)
+{
+        return bloom_bank_check_buf(bank, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_bank_check_many  Find the filters of a bank each of a batch may be in.
+ * `````````````````````
+ * @bank  : filter bank
+ * @keys  : array of n keys
+ * @lens  : array of n key lengths, or NULL if the keys are strings
+ * @n     : number of keys
+ * @out   : array of n masks (filled in), as bloom_bank_check_buf()
+ * Returns: nothing.
+ *
+ * NOTES
+ * As bloom_check_many(): every probe of a group of keys is prefetched
+ * before any is examined. The early exit is not given up for it, but in
+ * a bank of many filters it seldom comes, since the mask only drops to 0
+ * once every filter has missed.
+ *
+ ******************************************************************************/
+void bloom_bank_check_many(struct bloom_bank_t *bank, const void *const *keys,
+                           const size_t *lens, size_t n, uint64_t *out)
+{
+        uint64_t h1[BANK_PROBES], h2[BANK_PROBES], hit, g;
+        size_t i, j, nkeys;
+        int p;
+
+        nkeys = bank->k > 0 && bank->k < BANK_PROBES ? BANK_PROBES / bank->k : 1;
+
+        for (i=0; i<n; i+=nkeys) {
+                if (nkeys > n - i)
+                        nkeys = n - i;
+
+                /* Pass 1: hash everything and get the memory moving */
+                for (j=0; j<nkeys; j++) {
+                        bloom_hash_pair(keys[i+j], lens ? lens[i+j] : strlen(keys[i+j]),
+                                        bank->seed, &h1[j], &h2[j]);
+                        for (g=h1[j], p=0; p<bank->k; p++, g+=h2[j])
+                                __builtin_prefetch(&bank->a[bloom_reduce64(g, bank->m, bank->mask)], 0);
+                }
+
+                /* Pass 2: AND the words, which should now be in cache */
+                for (j=0; j<nkeys; j++) {
+                        for (hit=bank->live, g=h1[j], p=0; p<bank->k && hit; p++, g+=h2[j])
+                                hit &= __atomic_load_n(&bank->a[bloom_reduce64(g, bank->m, bank->mask)],
+                                                       __ATOMIC_RELAXED);
+                        out[i+j] = hit;
+                }
+        }
+}
+
+
+/******************************************************************************
+ * bloom_bank_load  Copy a Bloom filter into one filter of a bank.
+ * ```````````````
+ * @bank  : filter bank
+ * @f     : the filter, 0 to nfilters-1; its keys are replaced
+ * @bloom : Bloom filter, in single-hash mode, with the bank's m, k and
+ *          seed, and not partitioned
+ * Returns: 0, or -1 with errno set to EINVAL if the filter doesn't match.
+ *
+ ******************************************************************************/
+int bloom_bank_load(struct bloom_bank_t *bank, size_t f, const struct bloom_t *bloom)
+{
+        uint64_t bit = 1ULL << f, w;
+        size_t i, j;
+
+        if (f >= bank->nfilters || bloom->hash || bloom->hashlen || bloom->parts > 1
+         || bloom->m != bank->m || bloom->k != bank->k || bloom->seed != bank->seed) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        for (i=0; i<ROUND(bank->m); i++) {
+                w = bloom->a[i];
+                for (j=0; j<WORD_BIT && i*WORD_BIT+j < bank->m; j++)
+                        bank->a[i*WORD_BIT + j] = (bank->a[i*WORD_BIT + j] & ~bit)
+                                                | (((w >> j) & 1) << f);
+        }
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * bloom_bank_extract  Copy one filter of a bank out as a Bloom filter.
+ * ``````````````````
+ * @bank  : filter bank
+ * @f     : the filter, 0 to nfilters-1
+ * Returns: An allocated bloom filter in single-hash mode holding the keys
+ *          of filter f, or NULL (errno EINVAL for a bad f).
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_bank_extract(struct bloom_bank_t *bank, size_t f)
+{
+        struct bloom_t *bloom;
+        size_t i;
+
+        if (f >= bank->nfilters) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (!(bloom = bloom_new_k(bank->m, bank->k)))
+                return NULL;
+
+        bloom->seed = bank->seed;
+
+        for (i=0; i<bank->m; i++)
+                bloom->a[i / WORD_BIT] |= ((bank->a[i] >> f) & 1) << (i % WORD_BIT);
+
+        return bloom;
+}
@@ -0,0 +1,496 @@
+/******************************************************************************
+ * bench.c
+ * ```````
+ * Benchmark harness
+ *
+ * For every combination of the dimensions given on the command line,
+ * builds a filter, fills it to its design load, and measures:
+ *
+ *      insert throughput               keys added per second
+ *      lookup throughput               for keys that were added (hits),
+ *                                      and for keys that were not (misses)
+ *      latency                         p50, p90, p99 and p99.9 of single
+ *                                      calls, sampled, for each of the
+ *                                      inserts, hits and misses
+ *      false positive rate             measured on the misses, against
+ *                                      (1 - e^(-kn/m))^k
+ *
+ * A line of JSON per combination goes to stdout, a table to stderr.
+ *
+ * USAGE
+ *      bloom_bench [-s sizes] [-l key lengths] [-H hashes] [-t threads]
+ *                  [-b batch sizes] [-B bits per key] [-q queries]
+ *
+ * Lists are comma separated. Sizes are of the bit array in bytes, with
+ * an optional K, M or G suffix, from an L1-sized 16K to as many G as the
+ * machine holds. A hash is "wy" for single-hash mode (bloom_new_k()), or
+ * else a set of the *_len functions of hashes.h for bloom_new_len(),
+ * named and joined with '+' (see HASHES below), e.g. "djb2+sdbm+fnv";
+ * "legacy" is short for all of them but wy, the set test.c used to be
+ * built with. A set of j distinct functions gives a filter of at most
+ * k = j. A batch size of 1 means bloom_add_buf()/bloom_check_buf(),
+ * larger ones bloom_add_many()/bloom_check_many() on batches of that many
+ * keys.
+ *
+ * NOTES
+ * Keys are generated into a buffer CHUNK at a time outside of the timed
+ * sections, so that only the filter is measured. With more than one
+ * thread, inserts are BLOOM_CONCURRENT and throughput is total keys over
+ * wall time. Latency is timed around one call in every SAMPLE_EVERY.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bloom.h"
+#include "hashes.h"
+
+
+#define CHUNK        4096       /* keys generated at a time */
+#define SAMPLE_EVERY 61         /* calls per latency sample */
+#define MAX_LIST     32
+#define MAX_KEYLEN   4096
+#define MAX_THREADS  256
+
+
+static const struct {
+        const char *name;
+        hashlenfp_t fn;
+} HASHES[] = {
+        { "djb2",  djb2_hash_len },
+        { "sdbm",  sdbm_hash_len },
+        { "kr",    kr_hash_len   },
+        { "sax",   sax_hash_len  },
+        { "dek",   dek_hash_len  },
+        { "fnv",   fnv_hash_len  },
+        { "wy",    wy_hash_len   },
+};
+
+#define NHASHES (sizeof(HASHES) / sizeof(HASHES[0]))
+#define LEGACY  "djb2+sdbm+kr+sax+dek+fnv"
+
+
+struct config {
+        size_t bytes;
+        size_t keylen;
+        const char *hash;
+        int threads;
+        size_t batch;
+        double bpk;             /* bits per key */
+        size_t queries;
+};
+
+enum { OP_ADD, OP_HIT, OP_MISS };
+
+struct job {
+        struct bloom_t *bloom;
+        const struct config *cf;
+        int op;
+        size_t lo, hi;          /* key indices */
+        double secs;            /* time spent in the filter */
+        size_t positive;
+        double *lat;            /* latency samples, ns */
+        size_t nlat, maxlat;
+};
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/******************************************************************************
+ * make_keys  Generate keys [base, base + n) of one key space.
+ * `````````
+ * @buf   : room for n keys of cf->keylen bytes
+ * @space : 0 for the keys that get added, 1 for the ones that don't
+ * NOTES
+ * Key i of space s starts with the little-endian bytes of 2i + s, so the
+ * spaces never overlap (for keys of 8 bytes or more, or few enough keys),
+ * and the rest is filler: hashes see the full length.
+ *
+ ******************************************************************************/
+static void make_keys(char *buf, const void **keys, size_t *lens, size_t base,
+                      size_t n, size_t keylen, int space)
+{
+        uint64_t id;
+        size_t i, j;
+        char *p;
+
+        for (i=0; i<n; i++) {
+                p  = buf + i * keylen;
+                id = 2 * (base + i) + space;
+
+                for (j=0; j<keylen; j++)
+                        p[j] = j < 8 ? (char)(id >> (8 * j)) : (char)('a' + j % 26);
+
+                keys[i] = p;
+                lens[i] = keylen;
+        }
+}
+
+
+static void *run(void *arg)
+{
+        struct job *job = arg;
+        const struct config *cf = job->cf;
+        const void *keys[CHUNK];
+        size_t lens[CHUNK];
+        bool out[CHUNK];
+        size_t base, n, i, b, calls;
+        double t0, t1, s0;
+        char *buf;
+
+        if (!(buf = malloc(CHUNK * cf->keylen)))
+                return NULL;
+
+        for (calls=0, base=job->lo; base < job->hi; base += n) {
+                n = job->hi - base < CHUNK ? job->hi - base : CHUNK;
+                make_keys(buf, keys, lens, base, n, cf->keylen, job->op == OP_MISS);
+
+                t0 = now();
+
+                for (i=0; i<n; i+=b, calls++) {
+                        b = n - i < cf->batch ? n - i : cf->batch;
+
+                        if (calls % SAMPLE_EVERY == 0)
+                                s0 = now();
+
+                        if (job->op == OP_ADD) {
+                                if (b == 1)
+                                        bloom_add_buf(job->bloom, keys[i], lens[i]);
+                                else
+                                        bloom_add_many(job->bloom, keys + i, lens + i, b);
+                        } else {
+                                if (b == 1)
+                                        out[i] = bloom_check_buf(job->bloom, keys[i], lens[i]);
+                                else
+                                        bloom_check_many(job->bloom, keys + i, lens + i, b, out + i);
+                        }
+
+                        if (calls % SAMPLE_EVERY == 0 && job->nlat < job->maxlat)
+                                job->lat[job->nlat++] = (now() - s0) * 1e9;
+                }
+
+                t1 = now();
+
+                job->secs += t1 - t0;
+
+                if (job->op != OP_ADD) {
+                        for (i=0; i<n; i++)
+                                job->positive += out[i];
+                }
+        }
+
+        free(buf);
+
+        return NULL;
+}
+
+
+static int cmp_double(const void *a, const void *b)
+{
+        double x = *(const double *)a;
+        double y = *(const double *)b;
+
+        return (x > y) - (x < y);
+}
+
+
+/******************************************************************************
+ * phase  Run one operation over keys [0, n) on cf->threads threads.
+ * `````
+ * Returns: keys per second, over the time of the slowest thread in the
+ *          filter; fills in the positives and the latency
+ *          percentiles.
+ *
+ ******************************************************************************/
+static double phase(struct bloom_t *bloom, const struct config *cf, int op, size_t n,
+                    size_t *positive, double lat[4])
+{
+        struct job job[MAX_THREADS];
+        pthread_t tid[MAX_THREADS];
+        double wall, *all;
+        size_t per, nall, i;
+        int t;
+
+        per = (n + cf->threads - 1) / cf->threads;
+
+        for (t=0; t<cf->threads; t++) {
+                job[t].bloom    = bloom;
+                job[t].cf       = cf;
+                job[t].op       = op;
+                job[t].lo       = t * per < n ? t * per : n;
+                job[t].hi       = (t + 1) * per < n ? (t + 1) * per : n;
+                job[t].secs     = 0;
+                job[t].positive = 0;
+                job[t].nlat     = 0;
+                job[t].maxlat   = per / SAMPLE_EVERY + 1;
+                job[t].lat      = job[t].maxlat ? malloc(job[t].maxlat * sizeof(double)) : NULL;
+                if (job[t].maxlat && !job[t].lat)
+                        job[t].maxlat = 0;
+        }
+
+        for (t=1; t<cf->threads; t++) {
+                if (pthread_create(&tid[t], NULL, run, &job[t]) != 0) {
+                        perror("pthread_create");
+                        exit(1);
+                }
+        }
+        run(&job[0]);
+        for (t=1; t<cf->threads; t++)
+                pthread_join(tid[t], NULL);
+
+        /* Only the time in the filter counts; key generation is excluded */
+        for (wall=0, t=0; t<cf->threads; t++)
+                wall = job[t].secs > wall ? job[t].secs : wall;
+
+        for (nall=0, t=0; t<cf->threads; t++)
+                nall += job[t].nlat;
+
+        lat[0] = lat[1] = lat[2] = lat[3] = 0;
+
+        if ((all = malloc((nall ? nall : 1) * sizeof(double)))) {
+                for (nall=0, t=0; t<cf->threads; t++) {
+                        for (i=0; i<job[t].nlat; i++)
+                                all[nall++] = job[t].lat[i];
+                }
+                qsort(all, nall, sizeof(double), cmp_double);
+
+                lat[0] = nall ? all[(size_t)(nall * 0.50)] : 0;
+                lat[1] = nall ? all[(size_t)(nall * 0.90)] : 0;
+                lat[2] = nall ? all[(size_t)(nall * 0.99)] : 0;
+                lat[3] = nall ? all[(size_t)(nall * 0.999)] : 0;
+                free(all);
+        }
+
+        for (*positive=0, t=0; t<cf->threads; t++) {
+                *positive += job[t].positive;
+                free(job[t].lat);
+        }
+
+        return wall > 0 ? n / wall : 0;
+}
+
+
+/******************************************************************************
+ * hash_set  Look up the functions of a '+' separated set of hash names.
+ * ````````
+ * @spec  : the set, e.g. "djb2+fnv", or "legacy"
+ * @f     : the functions, in the order named (filled in)
+ * Returns: how many; exits on a name not in HASHES, one named twice, or
+ *          none.
+ *
+ ******************************************************************************/
+static size_t hash_set(const char *spec, hashlenfp_t f[NHASHES])
+{
+        char buf[256], *name;
+        size_t n, i, j;
+
+        snprintf(buf, sizeof(buf), "%s", strcmp(spec, "legacy") == 0 ? LEGACY : spec);
+
+        for (n=0, name=strtok(buf, "+"); name; name=strtok(NULL, "+")) {
+                for (i=0; i<NHASHES && strcmp(HASHES[i].name, name) != 0; i++)
+                        ;
+                if (i == NHASHES) {
+                        fprintf(stderr, "unknown hash '%s'\n", name);
+                        exit(1);
+                }
+                for (j=0; j<n; j++) {
+                        if (f[j] == HASHES[i].fn) {
+                                fprintf(stderr, "hash '%s' twice in '%s'\n", name, spec);
+                                exit(1);
+                        }
+                }
+                f[n++] = HASHES[i].fn;
+        }
+
+        if (n == 0) {
+                fprintf(stderr, "empty hash set '%s'\n", spec);
+                exit(1);
+        }
+
+        return n;
+}
+
+
+static struct bloom_t *make_filter(const struct config *cf, size_t *k)
+{
+        hashlenfp_t f[NHASHES];
+        size_t m, n;
+
+        m  = cf->bytes * 8;
+        *k = (size_t)round(cf->bpk * M_LN2);
+        if (*k < 1)
+                *k = 1;
+
+        if (strcmp(cf->hash, "wy") == 0)
+                return bloom_new_k(m, *k);
+
+        /* One function per position: no more than the set holds */
+        n = hash_set(cf->hash, f);
+        if (*k > n)
+                *k = n;
+
+        /* Extra arguments are ignored */
+        for (; n<NHASHES; n++)
+                f[n] = f[0];
+
+        return bloom_new_len(m, *k, f[0], f[1], f[2], f[3], f[4], f[5], f[6]);
+}
+
+
+static void bench(const struct config *cf)
+{
+        struct bloom_t *bloom;
+        double ins, hit, miss, il[4], hl[4], ml[4], fpr, theory, t0;
+        size_t k, n, q, fn, fp;
+
+        if (!(bloom = make_filter(cf, &k))) {
+                fprintf(stderr, "cannot allocate %zu bytes\n", cf->bytes);
+                return;
+        }
+        if (cf->threads > 1)
+                bloom->flags |= BLOOM_CONCURRENT;
+
+        n = (size_t)(bloom->m / cf->bpk);
+        q = cf->queries < n ? cf->queries : n;
+        if (q == 0)
+                q = 1;
+
+        t0   = now();
+        ins  = phase(bloom, cf, OP_ADD, n, &fn, il);
+        hit  = phase(bloom, cf, OP_HIT, q, &fn, hl);
+        miss = phase(bloom, cf, OP_MISS, q, &fp, ml);
+
+        fpr    = (double)fp / q;
+        theory = pow(1 - exp(-(double)k * n / bloom->m), (double)k);
+
+        printf("{\"bytes\": %zu, \"m\": %zu, \"k\": %zu, \"n\": %zu, \"key_len\": %zu, "
+               "\"hash\": \"%s\", \"kernel\": \"%s\", \"threads\": %d, \"batch\": %zu, "
+               "\"insert_keys_per_s\": %.0f, \"hit_keys_per_s\": %.0f, "
+               "\"miss_keys_per_s\": %.0f, "
+               "\"insert_latency_ns\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f}, "
+               "\"hit_latency_ns\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f}, "
+               "\"miss_latency_ns\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f}, "
+               "\"false_negatives\": %zu, \"fpr\": %.6f, \"fpr_theory\": %.6f}\n",
+               cf->bytes, bloom->m, k, n, cf->keylen, cf->hash, bloom_kernel(),
+               cf->threads, cf->batch, ins, hit, miss,
+               il[0], il[1], il[2], il[3], hl[0], hl[1], hl[2], hl[3],
+               ml[0], ml[1], ml[2], ml[3], q - fn, fpr, theory);
+        fflush(stdout);
+
+        fprintf(stderr, "%10zu %5zu %-12s %2zu %3d %5zu  %8.2f %8.2f %8.2f  %6.1f %6.1f  %6.1f %6.1f  %6.1f %6.1f  %.5f %.5f  %5.1fs\n",
+                cf->bytes, cf->keylen, cf->hash, k, cf->threads, cf->batch,
+                ins / 1e6, hit / 1e6, miss / 1e6, il[0], il[2], hl[0], hl[2], ml[0], ml[2],
+                fpr, theory, now() - t0);
+
+        bloom_del(bloom);
+}
+
+
+static size_t parse_size(const char *s)
+{
+        char *end;
+        size_t n;
+
+        n = strtoull(s, &end, 10);
+
+        switch (*end) {
+        case 'k': case 'K': return n << 10;
+        case 'm': case 'M': return n << 20;
+        case 'g': case 'G': return n << 30;
+        }
+
+        return n;
+}
+
+
+static int parse_list(char *s, const char *list[MAX_LIST])
+{
+        int n;
+
+        for (n=0; n<MAX_LIST && (list[n] = strtok(n ? NULL : s, ",")); n++)
+                ;
+
+        return n;
+}
+
+
+int main(int argc, char *argv[])
+{
+        char def_sizes[] = "16K,1M,64M", def_lens[] = "16,64", def_hashes[] = "wy,legacy";
+        char def_threads[] = "1", def_batch[] = "1,64";
+        const char *sizes[MAX_LIST], *lens[MAX_LIST], *hashes[MAX_LIST];
+        const char *threads[MAX_LIST], *batch[MAX_LIST];
+        int ns, nl, nh, nt, nb, a, b, c, d, e, opt;
+        char *s = def_sizes, *l = def_lens, *h = def_hashes, *t = def_threads, *bs = def_batch;
+        struct config cf = { .bpk = 10, .queries = 1000000 };
+
+        while ((opt = getopt(argc, argv, "s:l:H:t:b:B:q:")) != -1) {
+                switch (opt) {
+                case 's': s  = optarg; break;
+                case 'l': l  = optarg; break;
+                case 'H': h  = optarg; break;
+                case 't': t  = optarg; break;
+                case 'b': bs = optarg; break;
+                case 'B': cf.bpk = atof(optarg); break;
+                case 'q': cf.queries = parse_size(optarg); break;
+                default:
+                        fprintf(stderr, "usage: %s [-s sizes] [-l key lengths] [-H hashes] "
+                                "[-t threads] [-b batch sizes] [-B bits per key] [-q queries]\n",
+                                argv[0]);
+                        return 1;
+                }
+        }
+
+        ns = parse_list(s, sizes);
+        nl = parse_list(l, lens);
+        nh = parse_list(h, hashes);
+        nt = parse_list(t, threads);
+        nb = parse_list(bs, batch);
+
+        if (!(cf.bpk > 0)) {
+                fprintf(stderr, "bits per key must be positive\n");
+                return 1;
+        }
+
+        fprintf(stderr, "%10s %5s %-12s %2s %3s %5s  %8s %8s %8s  %13s  %13s  %13s  %-7s %-7s\n",
+                "bytes", "klen", "hash", "k", "thr", "batch", "ins M/s", "hit M/s", "miss M/s",
+                "ins p50/p99", "hit p50/p99", "miss p50/p99", "fpr", "theory");
+
+        for (a=0; a<ns; a++)
+        for (b=0; b<nl; b++)
+        for (c=0; c<nh; c++)
+        for (d=0; d<nt; d++)
+        for (e=0; e<nb; e++) {
+                cf.bytes   = parse_size(sizes[a]);
+                cf.keylen  = strtoul(lens[b], NULL, 10);
+                cf.hash    = hashes[c];
+                cf.threads = atoi(threads[d]);
+                cf.batch   = strtoul(batch[e], NULL, 10);
+
+                if (cf.bytes == 0 || cf.keylen == 0 || cf.keylen > MAX_KEYLEN
+                 || cf.threads < 1 || cf.threads > MAX_THREADS
+                 || cf.batch < 1 || cf.batch > CHUNK) {
+                        fprintf(stderr, "bad configuration, skipped\n");
+                        continue;
+                }
+
+                bench(&cf);
+        }
+
+        return 0;
+}
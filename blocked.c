@@ -0,0 +1,178 @@
+/******************************************************************************
+ * blocked.c
+ * `````````
+ * Cache-line blocked Bloom filters
+ *
+ * HISTORY
+ * The classic filter scatters its k probes over the whole bit array, so
+ * once the array is larger than the cache every query costs k misses. The
+ * blocked filter (Putze, Sanders and Singler, "Cache-, Hash- and
+ * Space-Efficient Bloom Filters") splits the array into blocks the size of
+ * one cache line. One hash picks the block, and all k bits of a key are
+ * set inside that block, so a query touches exactly one line of memory.
+ *
+ * NOTES
+ * Packing the bits of each key into a block makes the load on individual
+ * blocks uneven (some blocks receive more keys than the average), which
+ * raises the false positive rate a little over that of a classic filter
+ * with the same m and k. For the sizes where blocking is interesting at
+ * all, the difference is small compared to what is won in latency.
+ *
+ ******************************************************************************/
+
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define BLOCK_WORDS (BLOOM_BLOCK_BITS / 64)
+
+
+/******************************************************************************
+ * bloom_blocked_new  Allocate and return a new blocked Bloom filter.
+ * `````````````````
+ * @size  : size of the bit array in the filter (rounded up to whole blocks)
+ * @nfuncs: the number of bits set per key, all within one block
+ * Returns: An allocated blocked bloom filter
+ *
+ ******************************************************************************/
+struct bloom_blocked_t *bloom_blocked_new(size_t size, size_t num_hashes)
+{
+        struct bloom_blocked_t *bloom;
+        size_t nblocks;
+
+        nblocks = (size + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+        if (nblocks == 0)
+                nblocks = 1;
+
+        /* Allocate Bloom filter container */
+        if (!(bloom = malloc(sizeof(struct bloom_blocked_t))))
+                return NULL;
+
+        /* Allocate Bloom array, aligned so that no block straddles lines */
+        if (!(bloom->a = aligned_alloc(BLOOM_BLOCK_BITS/8, nblocks*BLOOM_BLOCK_BITS/8))) {
+                free(bloom);
+                return NULL;
+        }
+        memset(bloom->a, 0, nblocks*BLOOM_BLOCK_BITS/8);
+
+        bloom->nblocks = nblocks;
+        bloom->seed    = 0;
+        bloom->flags   = 0;
+        bloom->own     = 0;
+        bloom->m       = nblocks * BLOOM_BLOCK_BITS;
+        bloom->k       = num_hashes;
+
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_blocked_del  Delete a blocked Bloom filter.
+ * `````````````````
+ * @bloom : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_blocked_del(struct bloom_blocked_t *bloom)
+{
+        if (bloom->own & BLOOM_MAPPED)
+                bloom_file_unmap(bloom->a, bloom->m / 8);
+        else
+                free(bloom->a);
+        free(bloom);
+}
+
+
+/******************************************************************************
+ * bloom_blocked_add  Add a string to a blocked Bloom filter.
+ * `````````````````
+ * @bloom : blocked Bloom filter
+ * @s     : string to add
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_blocked_add(struct bloom_blocked_t *bloom, const char *s)
+{
+        bloom_blocked_add_buf(bloom, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_blocked_add_buf  Add a key of known length to a blocked filter.
+ * `````````````````````
+ * @bloom : blocked Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: nothing.
+ *
+ * NOTES
+ * h1 selects the block. The positions inside the block are derived from
+ * h2 (see bloom_block_bits()).
+ *
+ * With BLOOM_CONCURRENT set, each touched word of the block is updated
+ * with one atomic fetch-or; see bloom_add() in bloom.c for the guarantee.
+ *
+ ******************************************************************************/
+void bloom_blocked_add_buf(struct bloom_blocked_t *bloom, const void *key, size_t len)
+{
+        uint64_t mask[BLOCK_WORDS] = {0};
+        uint64_t h1, h2;
+        uint64_t *block;
+        int n;
+
+        bloom_hash_pair(key, len, bloom->seed, &h1, &h2);
+
+        block = bloom->a + bloom_reduce64(h1, bloom->nblocks, 0) * BLOCK_WORDS;
+        bloom_block_bits(h2, bloom->k, mask);
+
+        for (n=0; n<BLOCK_WORDS; n++) {
+                if (mask[n])
+                        bloom_setbits(&block[n], mask[n], bloom->flags);
+        }
+}
+
+
+/******************************************************************************
+ * bloom_blocked_check  Determine if a string is in a blocked Bloom filter.
+ * ```````````````````
+ * @bloom : blocked Bloom filter
+ * @s     : string to check
+ * Returns: false if string does not exist in the filter, otherwise true.
+ *
+ ******************************************************************************/
+bool bloom_blocked_check(struct bloom_blocked_t *bloom, const char *s)
+{
+        return bloom_blocked_check_buf(bloom, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_blocked_check_buf  Determine if a key of known length is present.
+ * ```````````````````````
+ * @bloom : blocked Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: false if the key does not exist in the filter, otherwise true.
+ *
+ * NOTES
+ * The k tests are all against the one block, which has (at most) cost us
+ * a single cache miss to bring in. Rather than branching on every bit, a
+ * mask is built for each word of the block and compared in one go, with
+ * SIMD where available (see simd.c).
+ *
+ ******************************************************************************/
+bool bloom_blocked_check_buf(struct bloom_blocked_t *bloom, const void *key, size_t len)
+{
+        uint64_t mask[BLOCK_WORDS] = {0};
+        uint64_t h1, h2;
+        uint64_t *block;
+
+        bloom_hash_pair(key, len, bloom->seed, &h1, &h2);
+
+        block = bloom->a + bloom_reduce64(h1, bloom->nblocks, 0) * BLOCK_WORDS;
+        bloom_block_bits(h2, bloom->k, mask);
+
+        return bloom_block_kernel(block, mask);
+}
@@ -106,16 +106,149 @@
  *
  ******************************************************************************/
 
-#include <limits.h>
+#include <errno.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "bloom.h"
+#include "internal.h"
 
 
-#define SETBIT(a,n) (a[n/CHAR_BIT] |= (1<<(n%CHAR_BIT)))
-#define GETBIT(a,n) (a[n/CHAR_BIT] &  (1<<(n%CHAR_BIT)))
-#define ROUND(size) ((size + CHAR_BIT - 1) / CHAR_BIT)
+#define SETBIT(bloom,n) bloom_set((bloom), (n))
+#define GETBIT(bloom,n) bloom_getbit((bloom)->a, (n))
+#define ROUND(size) (((size) + WORD_BIT - 1) / WORD_BIT)
+
+
+/******************************************************************************
+ * bloom_scratch_str  Make a NUL-terminated copy of a key.
+ * `````````````````
+ * @key   : bytes of the key
+ * @len   : length of the key in bytes
+ * Returns: a string to be released with bloom_scratch_free(), or NULL.
+ *
+ * NOTES
+ * Only bloom_new() filters need this, as their hashfp_t functions stop at
+ * the first '\0'. Keys are short as a rule, so one thread-local buffer
+ * covers nearly every call, and the heap is only used for the rest.
+ *
+ ******************************************************************************/
+#define SCRATCH_LEN 256
+
+static _Thread_local char scratch[SCRATCH_LEN];
+
+static char *bloom_scratch_str(const void *key, size_t len)
+{
+        char *s;
+
+        if (len < SCRATCH_LEN)
+                s = scratch;
+        else if (!(s = malloc(len + 1)))
+                return NULL;
+
+        memcpy(s, key, len);
+        s[len] = '\0';
+
+        return s;
+}
+
+static void bloom_scratch_free(char *s)
+{
+        if (s != scratch)
+                free(s);
+}
+
+
+/******************************************************************************
+ * bloom_init  Fill in the header of a Bloom filter over a given array.
+ * ``````````
+ * @bloom : the header
+ * @a     : the bit array, zeroed
+ * @size  : size of the bit array in the filter
+ * @nfuncs: the number of hash functions
+ * Returns: bloom, with no hash functions assigned and no chunk.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_init(struct bloom_t *bloom, uint64_t *a, size_t size,
+                           size_t num_hashes)
+{
+        bloom->a          = a;
+        bloom->chunk      = NULL;
+        bloom->chunk_size = 0;
+        bloom->alloc      = NULL;
+        bloom->hash       = NULL;
+        bloom->hashlen    = NULL;
+        bloom->flags      = 0;
+        bloom->own        = 0;
+        bloom->parts      = 1;
+        bloom->seed       = 0;
+        bloom->dirty      = NULL;
+        bloom->stats      = NULL;
+        bloom->touched    = NULL;
+
+        /* 
+         * Record the number of hash functions (k) and the number of bits
+         * in the Bloom array (m), and whether m is a power of 2.
+         */
+        bloom->k    = num_hashes;
+        bloom->m    = size;
+        bloom->mask = (size & (size - 1)) ? 0 : size - 1;
+
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_alloc  Allocate the parts of a Bloom filter common to every mode.
+ * ```````````
+ * @size  : size of the bit array in the filter
+ * @nfuncs: the number of hash functions
+ * @table : bytes to set aside for a hash function table, or 0
+ * @opts  : allocation options (see alloc.c), or NULL for the defaults
+ * @tablep: out, the table, if one was asked for
+ * Returns: An allocated bloom filter, with no hash functions assigned, or
+ *          NULL (errno EINVAL for a size of 0).
+ *
+ * NOTES
+ * The bit array, the struct and the table are one chunk, in that order,
+ * so that the array starts on a 64 byte (or larger) boundary and the
+ * struct has a cache line of its own right after it. One allocation
+ * instead of three, and one free.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_alloc(size_t size, size_t num_hashes, size_t table,
+                            const struct bloom_alloc *opts, void **tablep)
+{
+        struct bloom_t *bloom;
+        size_t bytes, chunk_size;
+        void *chunk;
+        uint64_t *a;
+
+        /* No bits to probe, and a mask of size-1 that would take them all */
+        if (size == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        /* The array, rounded up to whole lines, then the struct and table */
+        bytes = BLOOM_ARRAY_BYTES(size);
+
+        if (!(a = bloom_chunk_alloc(bytes + sizeof(struct bloom_t) + table, opts,
+                                    &chunk, &chunk_size)))
+                return NULL;
+
+        bloom = bloom_init((struct bloom_t *)((char *)a + bytes), a, size, num_hashes);
+
+        if (tablep)
+                *tablep = table ? bloom + 1 : NULL;
+
+        bloom->chunk      = chunk;
+        bloom->chunk_size = chunk_size;
+        bloom->alloc      = opts;
+
+        return bloom;
+}
 
 
 /******************************************************************************
@@ -123,34 +256,28 @@
  * `````````
  * @size  : size of the bit array in the filter
  * @nfuncs: the number of hash functions 
- * Returns: An allocated bloom filter 
+ * Returns: An allocated bloom filter, or NULL (errno EINVAL for a size
+ *          of 0).
  *
  * USAGE
- * For best results, make 'size' a power of 2.
+ * For best results, make 'size' a power of 2: the probe positions are
+ * then taken with a mask. Any other size works, and is reduced with a
+ * multiply and shift rather than a division (see bloom_reduce64()).
  *
  ******************************************************************************/
 struct bloom_t *bloom_new(size_t size, size_t num_hashes, ...)
 {
         struct bloom_t *bloom;
         va_list hashes;
+        void *table;
         int n;
 
-        /* Allocate Bloom filter container */
-        if (!(bloom = malloc(sizeof(struct bloom_t))))
+        /* Allocate Bloom filter container, array and hash function pointers */
+        if (!(bloom = bloom_alloc(size, num_hashes, num_hashes*sizeof(hashfp_t),
+                                  NULL, &table)))
                 return NULL;
 
-        /* Allocate Bloom array */
-        if (!(bloom->a = calloc(ROUND(size), sizeof(char)))) {
-                free(bloom);
-                return NULL;
-        }
-
-        /* Allocate Bloom filter hash function pointers */
-        if (!(bloom->hash = (hashfp_t*)malloc(num_hashes*sizeof(hashfp_t)))) {
-                free(bloom->a);
-                free(bloom);
-                return NULL;
-        }
+        bloom->hash = table;
 
         /* Assign hash functions to pointers in the Bloom filter */
         va_start(hashes, num_hashes);
@@ -160,12 +287,195 @@ struct bloom_t *bloom_new(size_t size, size_t num_hashes, ...)
 
         va_end(hashes);
 
-        /* 
-         * Record the number of hash functions (k) and the number of bytes
-         * in the Bloom array (m).
-         */
-        bloom->k = num_hashes;
-        bloom->m = size;
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_new_len  Allocate a Bloom filter over length-aware hash functions.
+ * `````````````
+ * @size  : size of the bit array in the filter
+ * @nfuncs: the number of hash functions
+ * @...   : nfuncs hash functions of type hashlenfp_t
+ * Returns: An allocated bloom filter, or NULL (errno EINVAL for a size
+ *          of 0).
+ *
+ * USAGE
+ * As bloom_new(), but the hash functions are handed the length of the key
+ * as well (see the *_len functions in hashes.h), so that bloom_add_buf()
+ * and bloom_check_buf() can take arbitrary bytes without copying.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_new_len(size_t size, size_t num_hashes, ...)
+{
+        struct bloom_t *bloom;
+        va_list hashes;
+        void *table;
+        int n;
+
+        if (!(bloom = bloom_alloc(size, num_hashes, num_hashes*sizeof(hashlenfp_t),
+                                  NULL, &table)))
+                return NULL;
+
+        bloom->hashlen = table;
+
+        va_start(hashes, num_hashes);
+
+                for (n=0; n<num_hashes; n++)
+                        bloom->hashlen[n] = va_arg(hashes, hashlenfp_t);
+
+        va_end(hashes);
+
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_new_k  Allocate a Bloom filter that runs in single-hash mode.
+ * ```````````
+ * @size  : size of the bit array in the filter
+ * @nfuncs: the number of bit positions (k) set per key
+ * Returns: An allocated bloom filter, or NULL (errno EINVAL for a size
+ *          of 0).
+ *
+ * NOTES
+ * Rather than calling k separate hash functions, each of which walks the
+ * whole key, the key is hashed exactly once with a strong 64-bit hash
+ * (wy_hash() from hashes.h) and the k positions are derived from it by
+ * double hashing (Kirsch and Mitzenmacher, "Less Hashing, Same
+ * Performance"):
+ *
+ *      g_i(x) = h1(x) + i*h2(x),   0 <= i < k
+ *
+ * which is known to keep the asymptotic false positive rate of k truly
+ * independent hash functions.
+ *
+ * The hash is seeded with bloom->seed, 0 unless set otherwise. A secret
+ * seed keeps an adversary from crafting keys that collide; it has to be
+ * set before the first key is added, and filters that are to be combined
+ * must share it.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_new_k(size_t size, size_t num_hashes)
+{
+        /* No hash function pointers; the mode is keyed on this. */
+        return bloom_alloc(size, num_hashes, 0, NULL, NULL);
+}
+
+
+/******************************************************************************
+ * bloom_new_alloc  Allocate a single-hash Bloom filter, as asked.
+ * ```````````````
+ * @size  : size of the bit array in the filter
+ * @nfuncs: the number of bit positions (k) set per key
+ * @opts  : where and how to allocate the bit array (see alloc.c)
+ * Returns: An allocated bloom filter, or NULL (errno EINVAL for a size
+ *          of 0).
+ *
+ * USAGE
+ * As bloom_new_k(). For a large filter queried at random, e.g.
+ *
+ *      static const struct bloom_alloc opts = {
+ *              .flags = BLOOM_ALLOC_THP | BLOOM_ALLOC_PREFAULT
+ *      };
+ *      bloom = bloom_new_alloc(8UL << 30, 7, &opts);
+ *
+ * has it on huge pages, all faulted in before the first insert.
+ *
+ * CAVEAT
+ * The filter keeps a pointer to 'opts', to free the array with; it must
+ * stay valid until bloom_del().
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_new_alloc(size_t size, size_t num_hashes,
+                                const struct bloom_alloc *opts)
+{
+        return bloom_alloc(size, num_hashes, 0, opts, NULL);
+}
+
+
+/******************************************************************************
+ * bloom_new_optimal  Allocate a Bloom filter sized for n keys at rate p.
+ * `````````````````
+ * @n     : the number of keys expected to be added
+ * @p     : the false positive rate wanted once they have been, 0 < p < 1
+ * Returns: An allocated bloom filter in single-hash mode, or NULL.
+ *
+ * NOTES
+ * Straight from the formulas at the top of this file:
+ *
+ *      m = -((n*ln(p)) / ((ln(2))^2)),     k = (m/n)ln(2)
+ *
+ * m is then rounded up. To the next power of 2 if that costs no more than
+ * 1/8th extra, so that probes get the mask fast path, otherwise only to
+ * the next cache line, the Lemire reduction being nearly as quick. k is
+ * kept at the value for the exact m: the extra bits can only make the
+ * rate a little better, and the extra probes they would call for (a lot,
+ * for tiny n) are not worth their cost.
+ *
+ ******************************************************************************/
+#define POW2_SLACK 8
+
+struct bloom_t *bloom_new_optimal(size_t n, double p)
+{
+        double m, k;
+        size_t size, pow2;
+
+        if (!(p > 0.0 && p < 1.0))
+                return NULL;
+        if (n == 0)
+                n = 1;
+
+        m = ceil(-((double)n * log(p)) / (M_LN2 * M_LN2));
+
+        size = ((size_t)m + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS * BLOOM_BLOCK_BITS;
+
+        for (pow2=BLOOM_BLOCK_BITS; pow2 < size; pow2 <<= 1)
+                ;
+        if (pow2 - size <= size / POW2_SLACK)
+                size = pow2;
+
+        k = round((m / n) * M_LN2);
+        if (k < 1)
+                k = 1;
+
+        return bloom_new_k(size, (size_t)k);
+}
+
+
+/******************************************************************************
+ * bloom_new_parts  Allocate a partitioned single-hash Bloom filter.
+ * ```````````````
+ * @size  : size of the bit array; a multiple of parts*BLOOM_BLOCK_BITS
+ * @nfuncs: the number of bit positions (k) set per key
+ * @parts : the number of partitions
+ * Returns: An allocated bloom filter, or NULL (errno EINVAL for no parts,
+ *          or parts of 0 bits).
+ *
+ * NOTES
+ * A partitioned filter first routes each key to one of 'parts' equal,
+ * cache-line aligned slices of the bit array (see bloom_part()), and
+ * probes only within that slice. This is the layout of a sharded filter
+ * (sharded.c) once its shards are laid end to end by bloom_sharded_merge().
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_new_parts(size_t size, size_t num_hashes, size_t parts)
+{
+        struct bloom_t *bloom;
+        size_t pm;
+
+        if (parts == 0 || size / parts == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (!(bloom = bloom_alloc(size, num_hashes, 0, NULL, NULL)))
+                return NULL;
+
+        pm = size / parts;
+
+        bloom->parts = parts;
+        bloom->mask  = (pm & (pm - 1)) ? 0 : pm - 1;
 
         return bloom;
 }
@@ -180,8 +490,27 @@ struct bloom_t *bloom_new(size_t size, size_t num_hashes, ...)
  ******************************************************************************/
 void bloom_del(struct bloom_t *bloom)
 {
-        free(bloom->a);
-        free(bloom->hash);
+        free(bloom->dirty);
+        free(bloom->stats);
+        free(bloom->touched);
+
+        /* The arena holds the rest, and hands it back in bulk */
+        if (bloom->own & BLOOM_ARENA)
+                return;
+
+        if (bloom->own & BLOOM_MAPPED)
+                bloom_file_unmap(bloom->a, ROUND(bloom->m) * sizeof(uint64_t));
+
+        /* The struct itself lives in the chunk, so this goes last */
+        if (bloom->chunk) {
+                bloom_chunk_free(bloom->chunk, bloom->chunk_size, bloom->alloc);
+                return;
+        }
+
+        if (!(bloom->own & BLOOM_MAPPED))
+                free(bloom->a);
+        free(bloom->hash);     /* at most one of these is non-NULL */
+        free(bloom->hashlen);
         free(bloom);
 }
 
@@ -196,16 +525,117 @@ void bloom_del(struct bloom_t *bloom)
  * CAVEAT 
  * Once a string has been added to the filter, it cannot be "removed"!
  *
+ * CONCURRENCY
+ * Bits are only ever set, never cleared, which makes sharing a filter
+ * between threads easy as long as no bit is lost. A plain '|=' on a
+ * word is a read-modify-write, and two threads setting different bits of
+ * one word at the same time can lose one of them. With BLOOM_CONCURRENT
+ * in bloom->flags the bits are instead set with an atomic fetch-or
+ * (skipped when the bit is already set, so that hot words are not
+ * bounced between caches for nothing), and lookups always read words
+ * with relaxed atomic loads. No lock is taken anywhere.
+ *
+ * The guarantee: once bloom_add() (or any of the add functions) has
+ * returned, a check of the same key by any thread that is ordered after
+ * that return -- the same thread, or one that learned of the add through
+ * a mutex, a queue, a release/acquire pair -- returns true. Checks racing
+ * with an add which has not returned yet may see some of its bits and
+ * not others, which can only ever make them answer false for that key.
+ *
  ******************************************************************************/
 void bloom_add(struct bloom_t *bloom, const char *s)
 {
         unsigned int hash;
         int n;
 
+        if (!bloom->hash) {
+                bloom_add_buf(bloom, s, strlen(s));
+                return;
+        }
+
         for (n=0; n<bloom->k; n++) {
                 hash = (unsigned int)bloom->hash[n](s);
-                SETBIT(bloom->a, (hash % bloom->m));
+                SETBIT(bloom, BLOOM_REDUCE32(bloom, hash));
         }
+
+        BLOOM_STATS_NOTE(bloom, 1, 0, 0, 0);
+}
+
+
+/******************************************************************************
+ * bloom_add_buf  Add an arbitrary key of known length to a Bloom filter.
+ * `````````````
+ * @bloom : Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: 0, or -1 with errno set to ENOMEM if the key was not added.
+ *
+ * NOTES
+ * For a string 's', bloom_add_buf(bloom, s, strlen(s)) is equivalent to
+ * bloom_add(bloom, s), and either may be paired with either check.
+ *
+ * CAVEAT
+ * The hash functions of a filter made by bloom_new() can only see up to
+ * the first '\0', so for such filters the key is first copied into a
+ * NUL-terminated scratch buffer, and keys with embedded NULs get
+ * truncated. Use bloom_new_len() or bloom_new_k() for binary keys.
+ * Keys of SCRATCH_LEN bytes or more are copied to the heap, and that is
+ * the only way this can fail; other filters always add the key.
+ *
+ ******************************************************************************/
+int bloom_add_buf(struct bloom_t *bloom, const void *key, size_t len)
+{
+        unsigned int hash;
+        uint64_t h1, h2;
+        char *s;
+        int n;
+
+        if (bloom->hash) {
+                if (!(s = bloom_scratch_str(key, len))) {
+                        errno = ENOMEM;
+                        return -1;
+                }
+                bloom_add(bloom, s);
+                bloom_scratch_free(s);
+                return 0;
+        }
+
+        if (bloom->hashlen) {
+                for (n=0; n<bloom->k; n++) {
+                        hash = bloom->hashlen[n](key, len);
+                        SETBIT(bloom, BLOOM_REDUCE32(bloom, hash));
+                }
+                BLOOM_STATS_NOTE(bloom, 1, 0, 0, 0);
+                return 0;
+        }
+
+        bloom_hash_pair(key, len, bloom->seed, &h1, &h2);
+        bloom_add_hashed(bloom, h1, h2);
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * bloom_add_hashed  Add an already hashed key to a single-hash filter.
+ * ````````````````
+ * @bloom : Bloom filter, in single-hash mode
+ * @h1    : first double hashing value of the key (see bloom_hash_pair())
+ * @h2    : second double hashing value of the key
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_add_hashed(struct bloom_t *bloom, uint64_t h1, uint64_t h2)
+{
+        size_t base, pm;
+        int n;
+
+        base = (bloom_part(bloom, h1, h2, &pm) - bloom->a) * WORD_BIT;
+
+        for (n=0; n<bloom->k; n++, h1+=h2)
+                SETBIT(bloom, base + bloom_reduce64(h1, pm, bloom->mask));
+
+        BLOOM_STATS_NOTE(bloom, 1, 0, 0, 0);
 }
 
 
@@ -221,10 +651,10 @@ void bloom_add(struct bloom_t *bloom, const char *s)
  * So this is the freakshow that bored programmers pay a nickel to get a
  * peek at, step right up. This is the way the membership test works.
  *
- * The string 's' is hashed once for each of the 'k' hash functions, as 
- * though we were planning to add it to the filter. Instead of adding it
- * however, we examine the bit that we *would* have set, and consider its
- * value.
+ * The string 's' is hashed once for each of the 'k' hash functions (or,
+ * in single-hash mode, once in total), as though we were planning to add
+ * it to the filter. Instead of adding it however, we examine the bit that
+ * we *would* have set, and consider its value.
  *
  * If the bit is 1 (set), the string we are hashing may be in the filter,
  * since it would have set this bit when it was originally hashed. However,
@@ -253,11 +683,273 @@ bool bloom_check(struct bloom_t *bloom, const char *s)
         unsigned int hash;
         int n;
 
+        if (!bloom->hash)
+                return bloom_check_buf(bloom, s, strlen(s));
+
         for (n=0; n<bloom->k; n++) {
                 hash = (unsigned int)bloom->hash[n](s);
-                if (!(GETBIT(bloom->a, (hash % bloom->m))))
+                if (!(GETBIT(bloom, BLOOM_REDUCE32(bloom, hash)))) {
+                        BLOOM_STATS_NOTE(bloom, 0, 1, 0, n + 1);
                         return false;
+                }
         }
+        BLOOM_STATS_NOTE(bloom, 0, 1, 1, bloom->k);
         return true; /* ? */
 }
 
+
+/******************************************************************************
+ * bloom_check_buf  Determine if a key of known length is in the filter.
+ * ```````````````
+ * @bloom : Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: false if the key does not exist in the filter, otherwise true.
+ *
+ * CAVEAT
+ * See bloom_add_buf(). Should the scratch copy for a bloom_new() filter
+ * fail to allocate, the answer is "maybe" (true), never a false negative.
+ *
+ ******************************************************************************/
+bool bloom_check_buf(struct bloom_t *bloom, const void *key, size_t len)
+{
+        unsigned int hash;
+        uint64_t h1, h2;
+        bool found;
+        char *s;
+        int n;
+
+        if (bloom->hash) {
+                if (!(s = bloom_scratch_str(key, len)))
+                        return true;
+                found = bloom_check(bloom, s);
+                bloom_scratch_free(s);
+                return found;
+        }
+
+        if (bloom->hashlen) {
+                for (n=0; n<bloom->k; n++) {
+                        hash = bloom->hashlen[n](key, len);
+                        if (!(GETBIT(bloom, BLOOM_REDUCE32(bloom, hash)))) {
+                                BLOOM_STATS_NOTE(bloom, 0, 1, 0, n + 1);
+                                return false;
+                        }
+                }
+                BLOOM_STATS_NOTE(bloom, 0, 1, 1, bloom->k);
+                return true;
+        }
+
+        bloom_hash_pair(key, len, bloom->seed, &h1, &h2);
+
+        return bloom_check_hashed(bloom, h1, h2);
+}
+
+
+/******************************************************************************
+ * bloom_check_hashed  Check an already hashed key against a single-hash filter.
+ * ``````````````````
+ * @bloom : Bloom filter, in single-hash mode
+ * @h1    : first double hashing value of the key (see bloom_hash_pair())
+ * @h2    : second double hashing value of the key
+ * Returns: false if the key does not exist in the filter, otherwise true.
+ *
+ * NOTES
+ * The probe kernels don't say how far they got, so a filter keeping
+ * statistics is checked with a plain loop that does.
+ *
+ ******************************************************************************/
+bool bloom_check_hashed(struct bloom_t *bloom, uint64_t h1, uint64_t h2)
+{
+        uint64_t *a;
+        size_t pm;
+#ifdef BLOOM_STATS
+        int n;
+#endif
+
+        a = bloom_part(bloom, h1, h2, &pm);
+
+#ifdef BLOOM_STATS
+        if (bloom->stats) {
+                for (n=0; n<bloom->k; n++, h1+=h2) {
+                        if (!bloom_getbit(a, bloom_reduce64(h1, pm, bloom->mask))) {
+                                BLOOM_STATS_NOTE(bloom, 0, 1, 0, n + 1);
+                                return false;
+                        }
+                }
+                BLOOM_STATS_NOTE(bloom, 0, 1, 1, bloom->k);
+                return true;
+        }
+#endif
+
+        return bloom_probe_kernel(a, pm, bloom->mask, bloom->k, h1, h2);
+}
+
+
+/******************************************************************************
+ * bloom_positions  Compute the k bit positions of a key.
+ * ```````````````
+ * @bloom : Bloom filter
+ * @key   : bytes of the key
+ * @len   : length of the key in bytes
+ * @pos   : array of at least k positions (filled in)
+ * Returns: false if a scratch copy could not be made, otherwise true.
+ *
+ ******************************************************************************/
+static bool bloom_positions(struct bloom_t *bloom, const void *key, size_t len,
+                            size_t *pos)
+{
+        uint64_t h1, h2;
+        uint64_t *a;
+        size_t pm;
+        char *s;
+        int n;
+
+        if (bloom->hash) {
+                if (!(s = bloom_scratch_str(key, len)))
+                        return false;
+                for (n=0; n<bloom->k; n++)
+                        pos[n] = BLOOM_REDUCE32(bloom, (unsigned int)bloom->hash[n](s));
+                bloom_scratch_free(s);
+                return true;
+        }
+
+        if (bloom->hashlen) {
+                for (n=0; n<bloom->k; n++)
+                        pos[n] = BLOOM_REDUCE32(bloom, bloom->hashlen[n](key, len));
+                return true;
+        }
+
+        bloom_hash_pair(key, len, bloom->seed, &h1, &h2);
+
+        a = bloom_part(bloom, h1, h2, &pm);
+        for (n=0; n<bloom->k; n++, h1+=h2)
+                pos[n] = (a - bloom->a)*WORD_BIT + bloom_reduce64(h1, pm, bloom->mask);
+
+        return true;
+}
+
+
+/******************************************************************************
+ * bloom_add_many  Add a batch of keys to a Bloom filter.
+ * ``````````````
+ * @bloom : Bloom filter
+ * @keys  : array of n keys
+ * @lens  : array of n key lengths, or NULL if the keys are strings
+ * @n     : number of keys
+ * Returns: 0, or -1 with errno set to ENOMEM if a key could not be copied
+ *          (see bloom_add_buf()). The other keys are added all the same.
+ *
+ * NOTES
+ * See bloom_check_many(); the same two-pass scheme applies to inserts.
+ *
+ ******************************************************************************/
+#define BATCH_PROBES 512
+#define KEYLEN(i) (lens ? lens[i] : strlen(keys[i]))
+
+int bloom_add_many(struct bloom_t *bloom, const void *const *keys,
+                   const size_t *lens, size_t n)
+{
+        size_t pos[BATCH_PROBES];
+        size_t i, j, np, nkeys;
+        int p, ret = 0;
+
+        if (bloom->k == 0 || bloom->k > BATCH_PROBES) {
+                for (i=0; i<n; i++)
+                        if (bloom_add_buf(bloom, keys[i], KEYLEN(i)) < 0)
+                                ret = -1;
+                return ret;
+        }
+
+        nkeys = BATCH_PROBES / bloom->k;
+
+        for (i=0; i<n; i+=nkeys) {
+                if (nkeys > n - i)
+                        nkeys = n - i;
+
+                /* Pass 1: hash everything and get the memory moving */
+                for (np=0, j=i; j<i+nkeys; j++) {
+                        if (!bloom_positions(bloom, keys[j], KEYLEN(j), &pos[np])) {
+                                errno = ENOMEM;
+                                ret = -1;
+                                continue;
+                        }
+                        for (p=0; p<bloom->k; p++, np++)
+                                __builtin_prefetch(&bloom->a[pos[np]/WORD_BIT], 1);
+                }
+
+                /* Pass 2: set the bits, which should now be in cache */
+                for (j=0; j<np; j++)
+                        SETBIT(bloom, pos[j]);
+
+                BLOOM_STATS_NOTE(bloom, np / bloom->k, 0, 0, 0);
+        }
+
+        return ret;
+}
+
+
+/******************************************************************************
+ * bloom_check_many  Determine which of a batch of keys are in the filter.
+ * ````````````````
+ * @bloom : Bloom filter
+ * @keys  : array of n keys
+ * @lens  : array of n key lengths, or NULL if the keys are strings
+ * @n     : number of keys
+ * @out   : array of n results (filled in), as bloom_check_buf()
+ * Returns: nothing.
+ *
+ * NOTES
+ * A single bloom_check() can't do much of anything while it waits on the
+ * cache miss for each probe, and a loop of them waits on every miss in
+ * turn. Here the keys are taken in groups: all of a group's positions are
+ * computed first and a prefetch is issued for each, so that the misses
+ * are all in flight at once, and only then are the bits examined. With
+ * enough probes outstanding the DRAM latency is mostly overlapped.
+ *
+ * The early exit on the first clear bit is traded for this; every probe
+ * of every key is fetched.
+ *
+ ******************************************************************************/
+void bloom_check_many(struct bloom_t *bloom, const void *const *keys,
+                      const size_t *lens, size_t n, bool *out)
+{
+        size_t pos[BATCH_PROBES];
+        size_t i, j, np, nkeys;
+        int p;
+
+        if (bloom->k == 0 || bloom->k > BATCH_PROBES) {
+                for (i=0; i<n; i++)
+                        out[i] = bloom_check_buf(bloom, keys[i], KEYLEN(i));
+                return;
+        }
+
+        nkeys = BATCH_PROBES / bloom->k;
+
+        for (i=0; i<n; i+=nkeys) {
+                if (nkeys > n - i)
+                        nkeys = n - i;
+
+                /* Pass 1: hash everything and get the memory moving */
+                for (j=0; j<nkeys; j++) {
+                        np = j * bloom->k;
+                        if (!(out[i+j] = !bloom_positions(bloom, keys[i+j], KEYLEN(i+j), &pos[np])))
+                                for (p=0; p<bloom->k; p++, np++)
+                                        __builtin_prefetch(&bloom->a[pos[np]/WORD_BIT], 0);
+                }
+
+                /* Pass 2: examine the bits, which should now be in cache */
+                for (j=0; j<nkeys; j++) {
+                        if (out[i+j])
+                                continue; /* no scratch copy: "maybe" */
+                        out[i+j] = true;
+                        for (np=j*bloom->k, p=0; p<bloom->k; p++, np++) {
+                                if (!(GETBIT(bloom, pos[np]))) {
+                                        out[i+j] = false;
+                                        break;
+                                }
+                        }
+                        /* p probes passed, and one more failed if it's false */
+                        BLOOM_STATS_NOTE(bloom, 0, 1, out[i+j], p + !out[i+j]);
+                }
+        }
+}
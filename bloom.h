@@ -6,17 +6,419 @@
 #include <stdint.h>
 
 typedef unsigned int (*hashfp_t)(const char *);
+typedef unsigned int (*hashlenfp_t)(const void *, size_t);
+
+/* Flags; set in bloom->flags before the filter is shared. */
+#define BLOOM_CONCURRENT 0x1    /* lock-free inserts from many threads */
+
+/* Ownership, in ->own: how the *_del() functions release the filter. Set
+ * by the library alone, so that callers may assign ->flags as they like. */
+#define BLOOM_MAPPED     0x100  /* bit array is a file mapping; don't touch */
+#define BLOOM_ARENA      0x200  /* lives in a bloom_arena_t; freed with it */
+
+/* Allocation of the bit array, see alloc.c */
+#define BLOOM_ALLOC_HUGETLB     0x1     /* MAP_HUGETLB, else as THP */
+#define BLOOM_ALLOC_THP         0x2     /* madvise(MADV_HUGEPAGE) */
+#define BLOOM_ALLOC_PREFAULT    0x4     /* touch every page up front */
+#define BLOOM_ALLOC_NUMA        0x8     /* bind to ->node */
+#define BLOOM_ALLOC_NUMA_PREFER 0x10    /* prefer ->node */
+
+struct bloom_alloc {
+        size_t align;           /* of the array; at least 64 */
+        unsigned int flags;     /* BLOOM_ALLOC_* */
+        int node;               /* NUMA node */
+        void *(*alloc)(void *ctx, size_t bytes, size_t align);
+        void  (*free) (void *ctx, void *p, size_t bytes);
+        void *ctx;              /* for alloc and free */
+};
 
 struct bloom_t {
         size_t m;
         size_t k;
-        unsigned char *a;
-        hashfp_t *hash;
+        size_t mask;            /* m/parts-1 if a power of 2, else 0 */
+        size_t parts;           /* partitions (see sharded.c), usually 1 */
+        uint64_t seed;          /* hash seed of the single-hash mode */
+        unsigned int flags;
+        unsigned int own;       /* BLOOM_MAPPED, BLOOM_ARENA; not for callers */
+        uint64_t *a;
+        uint64_t *dirty;        /* see bloom_track_dirty() */
+        hashfp_t *hash;         /* set by bloom_new() */
+        hashlenfp_t *hashlen;   /* set by bloom_new_len() */
+        void *chunk;            /* holding a, the header and hash table */
+        size_t chunk_size;
+        const struct bloom_alloc *alloc;
+        struct bloom_stats_block *stats;        /* see bloom_stats_enable() */
+        struct bloom_touched *touched;          /* see bloom_track_touched() */
+};                              /* neither hash: single-hash mode */
+
+struct bloom_t *bloom_new    (size_t size, size_t num_hashes, ...);
+struct bloom_t *bloom_new_len(size_t size, size_t num_hashes, ...);
+struct bloom_t *bloom_new_k  (size_t size, size_t num_hashes);
+struct bloom_t *bloom_new_optimal(size_t n, double p);
+struct bloom_t *bloom_new_alloc(size_t size, size_t num_hashes,
+                                const struct bloom_alloc *opts);
+void bloom_del      (struct bloom_t *bloom);
+void bloom_add      (struct bloom_t *bloom, const char *s);
+bool bloom_check    (struct bloom_t *bloom, const char *s);
+int  bloom_add_buf  (struct bloom_t *bloom, const void *key, size_t len);
+bool bloom_check_buf(struct bloom_t *bloom, const void *key, size_t len);
+int  bloom_add_many  (struct bloom_t *bloom, const void *const *keys,
+                      const size_t *lens, size_t n);
+void bloom_check_many(struct bloom_t *bloom, const void *const *keys,
+                      const size_t *lens, size_t n, bool *out);
+
+const char *bloom_kernel(void);
+
+
+/* Many small filters carved from shared slabs, freed in bulk; see arena.c */
+struct bloom_arena_t;
+
+struct bloom_arena_t *bloom_arena_new  (size_t slab, const struct bloom_alloc *opts);
+void            bloom_arena_del  (struct bloom_arena_t *arena);
+void            bloom_arena_reset(struct bloom_arena_t *arena);
+size_t          bloom_arena_bytes(const struct bloom_arena_t *arena);
+struct bloom_t *bloom_new_in     (struct bloom_arena_t *arena, size_t size, size_t num_hashes, ...);
+struct bloom_t *bloom_new_k_in   (struct bloom_arena_t *arena, size_t size, size_t num_hashes);
+
+
+/* Cache-line blocked filter: all k bits of a key live in one block. */
+#define BLOOM_BLOCK_BITS 512
+
+struct bloom_blocked_t {
+        size_t m;
+        size_t k;
+        size_t nblocks;
+        uint64_t seed;
+        unsigned int flags;
+        unsigned int own;       /* BLOOM_MAPPED; not for callers */
+        uint64_t *a;
+};
+
+struct bloom_blocked_t *bloom_blocked_new(size_t size, size_t num_hashes);
+void bloom_blocked_del      (struct bloom_blocked_t *bloom);
+void bloom_blocked_add      (struct bloom_blocked_t *bloom, const char *s);
+bool bloom_blocked_check    (struct bloom_blocked_t *bloom, const char *s);
+void bloom_blocked_add_buf  (struct bloom_blocked_t *bloom, const void *key, size_t len);
+bool bloom_blocked_check_buf(struct bloom_blocked_t *bloom, const void *key, size_t len);
+
+
+/* Counting filter: 4-bit counters instead of bits, so keys can be removed */
+struct bloom_counting_t {
+        size_t m;               /* number of counters */
+        size_t k;
+        size_t mask;            /* m-1 if a power of 2, else 0 */
+        uint64_t seed;
+        unsigned int flags;
+        uint64_t *a;            /* 16 counters per word */
+};
+
+struct bloom_counting_t *bloom_counting_new(size_t size, size_t num_hashes);
+void bloom_counting_del      (struct bloom_counting_t *bloom);
+void bloom_counting_add      (struct bloom_counting_t *bloom, const char *s);
+bool bloom_counting_check    (struct bloom_counting_t *bloom, const char *s);
+void bloom_counting_add_buf  (struct bloom_counting_t *bloom, const void *key, size_t len);
+bool bloom_counting_check_buf(struct bloom_counting_t *bloom, const void *key, size_t len);
+bool bloom_remove            (struct bloom_counting_t *bloom, const char *s);
+bool bloom_remove_buf        (struct bloom_counting_t *bloom, const void *key, size_t len);
+struct bloom_t *bloom_counting_flatten(struct bloom_counting_t *bloom);
+
+
+/* Scalable filter: a chain of growing stages, see scalable.c */
+struct bloom_scalable_t {
+        size_t nstages;
+        size_t cap;             /* room in stage[] */
+        size_t next;            /* capacity of the next stage, in keys */
+        double err;             /* error rate of the next stage */
+        size_t fill;            /* bits set in the newest stage */
+        size_t limit;           /* fill at which it is full */
+        uint64_t seed;
+        struct bloom_t **stage; /* oldest first */
+};
+
+struct bloom_scalable_t *bloom_scalable_new(size_t n, double p);
+void bloom_scalable_del      (struct bloom_scalable_t *sf);
+int  bloom_scalable_add      (struct bloom_scalable_t *sf, const char *s);
+bool bloom_scalable_check    (struct bloom_scalable_t *sf, const char *s);
+int  bloom_scalable_add_buf  (struct bloom_scalable_t *sf, const void *key, size_t len);
+bool bloom_scalable_check_buf(struct bloom_scalable_t *sf, const void *key, size_t len);
+
+
+/* Sliding window filter: a ring of generations, see window.c */
+#define BLOOM_WINDOW_MAX        15      /* generations */
+#define BLOOM_WINDOW_BACKGROUND 0x1     /* zero expired ones on a thread */
+
+struct bloom_window_t {
+        size_t m;               /* bits per generation */
+        size_t k;
+        size_t mask;            /* m-1 if a power of 2, else 0 */
+        uint64_t seed;
+        unsigned int flags;
+        size_t slots;           /* generations + 1 spare, interleaved */
+        size_t cur;             /* slot of the current generation */
+        size_t clearing;        /* spare slot still being zeroed, or -1 */
+        size_t cleared;         /* words of it done, without a thread */
+        void *worker;           /* the thread zeroing it, if any */
+        uint64_t live[BLOOM_WINDOW_MAX + 1];
+        uint64_t *a;
+};
+
+struct bloom_window_t *bloom_window_new(size_t size, size_t num_hashes, size_t gens,
+                                        unsigned int flags);
+void bloom_window_del      (struct bloom_window_t *win);
+int  bloom_window_rotate   (struct bloom_window_t *win);
+void bloom_window_add      (struct bloom_window_t *win, const char *s);
+bool bloom_window_check    (struct bloom_window_t *win, const char *s);
+void bloom_window_add_buf  (struct bloom_window_t *win, const void *key, size_t len);
+bool bloom_window_check_buf(struct bloom_window_t *win, const void *key, size_t len);
+
+
+/* Binary fuse filter: static, built once from all its keys, see fuse.c */
+struct bloom_fuse_t {
+        size_t n;               /* distinct keys */
+        uint64_t seed;
+        uint32_t seglen;        /* slots per segment, a power of 2 */
+        uint32_t seglen_count;  /* seglen * segcount */
+        size_t segcount;
+        size_t size;            /* slots (bytes) in fp */
+        uint8_t *fp;            /* 8-bit fingerprints */
+};
+
+struct bloom_fuse_t *bloom_fuse_build(const void *const *keys, const size_t *lens, size_t n);
+void bloom_fuse_del      (struct bloom_fuse_t *fuse);
+bool bloom_fuse_check    (const struct bloom_fuse_t *fuse, const char *s);
+bool bloom_fuse_check_buf(const struct bloom_fuse_t *fuse, const void *key, size_t len);
+
+
+/* One interface over the engines (classic, blocked, fuse), see engine.c */
+struct bloom_engine {
+        const char *name;
+        void  *(*build)(const void *const *keys, const size_t *lens, size_t n, double p);
+        int    (*add)  (void *filter, const void *key, size_t len);   /* NULL: static */
+        bool   (*check)(void *filter, const void *key, size_t len);
+        size_t (*bytes)(const void *filter);
+        void   (*del)  (void *filter);
+};
+
+struct bloom_filter {
+        const struct bloom_engine *engine;
+        void *impl;
+};
+
+extern const struct bloom_engine bloom_engine_classic;
+extern const struct bloom_engine bloom_engine_blocked;
+extern const struct bloom_engine bloom_engine_fuse;
+
+struct bloom_filter *bloom_filter_build(const struct bloom_engine *engine,
+                                        const void *const *keys, const size_t *lens,
+                                        size_t n, double p);
+void   bloom_filter_del  (struct bloom_filter *f);
+int    bloom_filter_add  (struct bloom_filter *f, const void *key, size_t len);
+bool   bloom_filter_check(struct bloom_filter *f, const void *key, size_t len);
+size_t bloom_filter_bytes(const struct bloom_filter *f);
+
+
+/* Sharded filter: keys are routed to one of nshards sub-filters. */
+struct bloom_sharded_t {
+        size_t m;
+        size_t k;
+        size_t nshards;
+        uint64_t seed;
+        struct bloom_t *shard;
+        struct bloom_alloc *opts;       /* placement of each shard */
+};
+
+struct bloom_sharded_t *bloom_sharded_new(size_t size, size_t num_hashes, size_t nshards);
+void   bloom_sharded_del      (struct bloom_sharded_t *sh);
+void   bloom_sharded_set_flags(struct bloom_sharded_t *sh, unsigned int flags);
+size_t bloom_sharded_shard    (struct bloom_sharded_t *sh, const void *key, size_t len);
+void   bloom_sharded_add      (struct bloom_sharded_t *sh, const char *s);
+bool   bloom_sharded_check    (struct bloom_sharded_t *sh, const char *s);
+void   bloom_sharded_add_buf  (struct bloom_sharded_t *sh, const void *key, size_t len);
+bool   bloom_sharded_check_buf(struct bloom_sharded_t *sh, const void *key, size_t len);
+struct bloom_t *bloom_sharded_merge(struct bloom_sharded_t *sh);
+
+
+/* Compressed filter, read-only; see compress.c */
+#define BLOOM_COMPRESSED_BLOCK 4096     /* bits per independently coded block */
+
+struct bloom_compressed_t {
+        size_t m;
+        size_t k;
+        size_t mask;
+        size_t parts;
+        uint64_t seed;
+        unsigned int flags;
+        unsigned int own;       /* BLOOM_MAPPED; not for callers */
+        size_t nblocks;
+        const uint64_t *index;  /* nblocks+1 bit offsets into data, with parameters */
+        const uint64_t *data;
+        uint64_t *payload;      /* index and data, as saved */
+        size_t bytes;
+};
+
+struct bloom_compressed_t *bloom_compress(const struct bloom_t *bloom);
+struct bloom_t *bloom_decompress(const struct bloom_compressed_t *c);
+void bloom_compressed_del      (struct bloom_compressed_t *c);
+bool bloom_compressed_check    (const struct bloom_compressed_t *c, const char *s);
+bool bloom_compressed_check_buf(const struct bloom_compressed_t *c, const void *key, size_t len);
+
+
+/* Stack of filters over key prefixes, for range queries; see range.c */
+struct bloom_range_t {
+        int bits;                       /* width of the keys */
+        int levels;
+        struct bloom_t *level[64];      /* level j: the keys >> j */
+};
+
+struct bloom_range_t *bloom_range_new(size_t n, double p, int bits, int levels);
+void bloom_range_del         (struct bloom_range_t *r);
+void bloom_range_add         (struct bloom_range_t *r, uint64_t key);
+bool bloom_range_check       (struct bloom_range_t *r, uint64_t key);
+bool bloom_range_check_range (struct bloom_range_t *r, uint64_t lo, uint64_t hi);
+void bloom_range_add_buf     (struct bloom_range_t *r, const void *key, size_t len);
+bool bloom_range_check_prefix(struct bloom_range_t *r, const void *prefix, size_t len);
+
+
+/* Blocked filter gating a table of fingerprints: exact answers; see hybrid.c */
+struct bloom_hybrid_t {
+        size_t nblocks;
+        size_t k;
+        size_t lines;           /* table lines after each block */
+        size_t count;           /* keys held */
+        size_t cap;             /* most keys it will take */
+        uint64_t seed;
+        uint64_t *a;            /* nblocks units of block, then lines */
+};
+
+struct bloom_hybrid_t *bloom_hybrid_new(size_t n, double p);
+void bloom_hybrid_del         (struct bloom_hybrid_t *h);
+int  bloom_hybrid_add         (struct bloom_hybrid_t *h, const char *s);
+int  bloom_hybrid_add_buf     (struct bloom_hybrid_t *h, const void *key, size_t len);
+bool bloom_hybrid_contains    (struct bloom_hybrid_t *h, const char *s);
+bool bloom_hybrid_contains_buf(struct bloom_hybrid_t *h, const void *key, size_t len);
+
+
+/* Bank of filters sharing m, k and seed, bit-sliced; see bank.c */
+#define BLOOM_BANK_MAX 64
+
+struct bloom_bank_t {
+        size_t m;
+        size_t k;
+        size_t mask;
+        uint64_t seed;
+        unsigned int flags;
+        size_t nfilters;
+        uint64_t live;          /* the bits of the nfilters filters */
+        uint64_t *a;            /* word i: bit i of every filter */
+};
+
+struct bloom_bank_t *bloom_bank_new(size_t size, size_t num_hashes, size_t nfilters);
+void     bloom_bank_del       (struct bloom_bank_t *bank);
+int      bloom_bank_add       (struct bloom_bank_t *bank, size_t f, const char *s);
+int      bloom_bank_add_buf   (struct bloom_bank_t *bank, size_t f, const void *key, size_t len);
+uint64_t bloom_bank_check     (struct bloom_bank_t *bank, const char *s);
+uint64_t bloom_bank_check_buf (struct bloom_bank_t *bank, const void *key, size_t len);
+void     bloom_bank_check_many(struct bloom_bank_t *bank, const void *const *keys,
+                               const size_t *lens, size_t n, uint64_t *out);
+int      bloom_bank_load      (struct bloom_bank_t *bank, size_t f, const struct bloom_t *bloom);
+struct bloom_t *bloom_bank_extract(struct bloom_bank_t *bank, size_t f);
+
+
+/* Building from files of keys, see build.c */
+#define BLOOM_BUILD_MERGE 0x1   /* per-thread filters, ORed at the end */
+
+int bloom_add_file(struct bloom_t *bloom, const char *path, int nthreads,
+                   unsigned int flags);
+struct bloom_t *bloom_build_from_file(const char *path, double p, int nthreads,
+                                      unsigned int flags);
+
+
+/* On-disk format, see file.c */
+#define BLOOM_FILE_MAGIC     "BLOOMFLT"
+#define BLOOM_FILE_VERSION   1
+#define BLOOM_FILE_HEADER    4096
+#define BLOOM_FILE_MAX_K     128        /* more probes than that: corrupt */
+
+#define BLOOM_HASH_WY        1          /* wy_hash(), double hashing */
+
+#define BLOOM_LAYOUT_CLASSIC 0          /* struct bloom_t, single-hash */
+#define BLOOM_LAYOUT_BLOCKED 1          /* struct bloom_blocked_t */
+#define BLOOM_LAYOUT_COMPRESSED 2       /* struct bloom_compressed_t */
+
+#define BLOOM_OPEN_VERIFY    0x1        /* check the bit array checksum */
+#define BLOOM_OPEN_WRITE     0x2        /* private, copy-on-write mapping */
+
+struct bloom_file_header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t hash;
+        uint64_t m;
+        uint64_t k;
+        uint64_t seed;
+        uint32_t layout;
+        uint32_t reserved;
+        uint64_t parts;
+        uint64_t bytes;
+        uint64_t sum;
+        uint64_t hsum;
+        uint8_t  pad[BLOOM_FILE_HEADER - 80];
+};
+
+int bloom_save(struct bloom_t *bloom, const char *path);
+struct bloom_t *bloom_open_mmap(const char *path, unsigned int flags);
+int bloom_blocked_save(struct bloom_blocked_t *bloom, const char *path);
+struct bloom_blocked_t *bloom_blocked_open_mmap(const char *path, unsigned int flags);
+int bloom_compressed_save(struct bloom_compressed_t *c, const char *path);
+struct bloom_compressed_t *bloom_compressed_open_mmap(const char *path, unsigned int flags);
+
+
+/* Streaming (de)serialization and deltas, see stream.c */
+#define BLOOM_DELTA_MAGIC    "BLOOMDLT"
+#define BLOOM_DIRTY_REGION   64         /* bytes of ->a per dirty map bit */
+
+typedef int (*bloom_write_fn)(void *ctx, const void *buf, size_t len);
+typedef int (*bloom_read_fn) (void *ctx, void *buf, size_t len);
+
+int bloom_write(struct bloom_t *bloom, bloom_write_fn fn, void *ctx);
+struct bloom_t *bloom_read(bloom_read_fn fn, void *ctx);
+int bloom_write_fd(struct bloom_t *bloom, int fd);
+struct bloom_t *bloom_read_fd(int fd);
+
+int bloom_track_dirty (struct bloom_t *bloom);
+int bloom_export_delta(struct bloom_t *bloom, bloom_write_fn fn, void *ctx);
+int bloom_apply_delta (struct bloom_t *bloom, bloom_read_fn fn, void *ctx);
+
+
+/* Clearing for reuse, see clear.c */
+int bloom_track_touched(struct bloom_t *bloom);
+void bloom_clear       (struct bloom_t *bloom);
+
+
+/* Set operations, see ops.c */
+int bloom_union    (struct bloom_t *dst, const struct bloom_t *src);
+int bloom_intersect(struct bloom_t *dst, const struct bloom_t *src);
+struct bloom_t *bloom_union_new    (const struct bloom_t *a, const struct bloom_t *b);
+struct bloom_t *bloom_intersect_new(const struct bloom_t *a, const struct bloom_t *b);
+size_t bloom_count_set_bits(const struct bloom_t *bloom);
+double bloom_estimate_count(const struct bloom_t *bloom);
+
+
+/* Statistics, see stats.c; the counters need -DBLOOM_STATS */
+struct bloom_stats {
+        uint64_t adds;
+        uint64_t checks;
+        uint64_t positives;     /* checks that answered true */
+        uint64_t probes;        /* bits examined by checks */
+        double probes_per_check;
+        double positive_rate;   /* positives / checks */
+        size_t bits_set;
+        double fill;            /* bits_set / m */
+        double fpr;             /* fill^k, for keys never added */
+        double keys;            /* estimated distinct keys added */
 };
 
-struct bloom_t *bloom_new(size_t size, size_t num_hashes, ...);
-void bloom_del  (struct bloom_t *bloom);
-void bloom_add  (struct bloom_t *bloom, const char *s);
-bool bloom_check(struct bloom_t *bloom, const char *s);
+int  bloom_stats_enable(struct bloom_t *bloom);
+void bloom_stats_reset (struct bloom_t *bloom);
+int  bloom_stats       (const struct bloom_t *bloom, struct bloom_stats *st);
 
 #endif
@@ -0,0 +1,490 @@
+/******************************************************************************
+ * bloom.hpp
+ * `````````
+ * Compile-time specialized Bloom filters, for C++
+ *
+ * bloom::filter<K, Hash, Layout, M> is the single-hash filter of bloom.c
+ * (or the blocked filter of blocked.c) with everything that is a runtime
+ * parameter there fixed at compile time instead:
+ *
+ *      K       the number of bit positions per key, so the probe loop
+ *              is unrolled
+ *      Hash    a hash functor, inlined rather than called through a
+ *              pointer; bloom::wyhash, the hash of the C library, by
+ *              default
+ *      Layout  bloom::classic or bloom::blocked
+ *      M       the size of the bit array, a power of 2, or 0 (the
+ *              default) to give it to the constructor; a compile-time
+ *              size turns the reduction of each probe into an and
+ *
+ * The bits are laid out exactly as the C filters lay them out, and save()
+ * and load() use the same file format (see file.c), so a filter built
+ * here can be opened with bloom_open_mmap() or bloom_blocked_open_mmap()
+ * and the other way around, as long as the hash is bloom::wyhash.
+ *
+ * USAGE
+ *      bloom::filter<7> f(1 << 24);
+ *      f.add("hello");
+ *      if (f.check("hello")) ...
+ *
+ *      bloom::filter<8, bloom::wyhash, bloom::blocked, 1 << 27> g;
+ *
+ * NOTES
+ * A Hash is any type with an operator()(const void *key, size_t len,
+ * uint64_t seed) returning a 64-bit hash, and a static constexpr uint32_t
+ * id naming it in files (BLOOM_HASH_*; the C library only opens files of
+ * BLOOM_HASH_WY). The second double hashing value is derived from the
+ * first just as bloom_hash_pair() does.
+ *
+ * Errors are reported as in the C library, -1 with errno set, except
+ * that running out of memory in a constructor throws std::bad_alloc.
+ *
+ * Needs C++17, for std::string_view. make hpp builds hpp.cpp, which
+ * checks that both ways of opening each other's files work.
+ *
+ ******************************************************************************/
+
+#ifndef _BLOOM_FILTER_HPP
+#define _BLOOM_FILTER_HPP
+
+#if __cplusplus < 201703L
+#error "bloom.hpp needs C++17 (-std=c++17)"
+#endif
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include "bloom.h"
+}
+#include "hashes.h"
+
+
+namespace bloom {
+
+
+/* The hash of the C library's single-hash mode */
+struct wyhash {
+        static constexpr uint32_t id = BLOOM_HASH_WY;
+
+        uint64_t operator()(const void *key, size_t len, uint64_t seed) const
+        {
+                return wy_hash(key, len, seed);
+        }
+};
+
+
+namespace detail {
+
+constexpr size_t WORD_BIT    = 64;
+constexpr size_t BLOCK_WORDS = BLOOM_BLOCK_BITS / WORD_BIT;
+
+/* As bloom_reduce64(), with a mask known at compile time if M is */
+template <size_t M>
+inline size_t reduce(uint64_t h, size_t m, size_t mask)
+{
+        if constexpr (M != 0)
+                return h & (M - 1);
+
+        if (mask)
+                return h & mask;
+
+        return (size_t)(((unsigned __int128)h * m) >> 64);
+}
+
+inline uint64_t lemire(uint64_t h, size_t n)
+{
+        return (uint64_t)(((unsigned __int128)h * n) >> 64);
+}
+
+/* As bloom_file_checksum() */
+inline uint64_t checksum(uint64_t sum, const void *p, size_t len, uint64_t off)
+{
+        const size_t chunk = 64 * 1024;
+        const unsigned char *c = (const unsigned char *)p;
+        size_t n;
+
+        for (; len > 0; c += n, len -= n, off += n) {
+                n   = len < chunk ? len : chunk;
+                sum = wy_mix(sum ^ wy_hash(c, n, off / chunk), 0x9e3779b97f4a7c15ULL);
+        }
+
+        return sum;
+}
+
+inline uint64_t header_sum(const struct bloom_file_header *h)
+{
+        return wy_hash(h, offsetof(struct bloom_file_header, hsum), 0);
+}
+
+inline bool io(ssize_t (*fn)(int, void *, size_t), int fd, void *p, size_t len)
+{
+        char *c = (char *)p;
+        ssize_t n;
+
+        while (len > 0) {
+                if ((n = fn(fd, c, len)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+                if (n == 0) {
+                        errno = EINVAL;         /* truncated */
+                        return false;
+                }
+                c   += n;
+                len -= n;
+        }
+
+        return true;
+}
+
+inline ssize_t write_fn(int fd, void *p, size_t len)
+{
+        return write(fd, p, len);
+}
+
+} /* namespace detail */
+
+
+/******************************************************************************
+ * classic  Bit positions of bloom.c: k probes anywhere in the array.
+ ******************************************************************************/
+struct classic {
+        static constexpr uint32_t id = BLOOM_LAYOUT_CLASSIC;
+
+        static constexpr size_t bits(size_t m)  { return m ? m : 1; }
+        static constexpr size_t parts(size_t)   { return 1; }
+
+        template <size_t K, size_t M>
+        static void add(uint64_t *a, size_t m, size_t mask, uint64_t h1, uint64_t h2)
+        {
+                for (size_t i=0; i<K; i++, h1+=h2) {
+                        size_t n = detail::reduce<M>(h1, m, mask);
+                        a[n / detail::WORD_BIT] |= 1ULL << (n % detail::WORD_BIT);
+                }
+        }
+
+        template <size_t K, size_t M>
+        static bool check(const uint64_t *a, size_t m, size_t mask, uint64_t h1, uint64_t h2)
+        {
+                for (size_t i=0; i<K; i++, h1+=h2) {
+                        size_t n = detail::reduce<M>(h1, m, mask);
+                        if (!((__atomic_load_n(&a[n / detail::WORD_BIT], __ATOMIC_RELAXED)
+                               >> (n % detail::WORD_BIT)) & 1))
+                                return false;
+                }
+                return true;
+        }
+};
+
+
+/******************************************************************************
+ * blocked  Bit positions of blocked.c: all k probes in one cache line.
+ ******************************************************************************/
+struct blocked {
+        static constexpr uint32_t id = BLOOM_LAYOUT_BLOCKED;
+
+        static constexpr size_t bits(size_t m)
+        {
+                return m ? (m + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS * BLOOM_BLOCK_BITS
+                         : BLOOM_BLOCK_BITS;
+        }
+        static constexpr size_t parts(size_t m) { return m / BLOOM_BLOCK_BITS; }
+
+        template <size_t K>
+        static void masks(uint64_t h2, uint64_t mask[detail::BLOCK_WORDS])
+        {
+                uint32_t pos  = (uint32_t)h2;
+                uint32_t step = (uint32_t)(h2 >> 32) | 1;
+
+                for (size_t i=0; i<detail::BLOCK_WORDS; i++)
+                        mask[i] = 0;
+                for (size_t i=0; i<K; i++, pos+=step)
+                        mask[(pos % BLOOM_BLOCK_BITS) / 64] |= 1ULL << (pos % 64);
+        }
+
+        template <size_t K, size_t M>
+        static void add(uint64_t *a, size_t m, size_t, uint64_t h1, uint64_t h2)
+        {
+                uint64_t mask[detail::BLOCK_WORDS];
+                uint64_t *block;
+
+                block = a + detail::lemire(h1, (M ? M : m) / BLOOM_BLOCK_BITS) * detail::BLOCK_WORDS;
+                masks<K>(h2, mask);
+
+                for (size_t i=0; i<detail::BLOCK_WORDS; i++)
+                        block[i] |= mask[i];
+        }
+
+        template <size_t K, size_t M>
+        static bool check(const uint64_t *a, size_t m, size_t, uint64_t h1, uint64_t h2)
+        {
+                uint64_t mask[detail::BLOCK_WORDS], miss = 0;
+                const uint64_t *block;
+
+                block = a + detail::lemire(h1, (M ? M : m) / BLOOM_BLOCK_BITS) * detail::BLOCK_WORDS;
+                masks<K>(h2, mask);
+
+                for (size_t i=0; i<detail::BLOCK_WORDS; i++)
+                        miss |= mask[i] & ~__atomic_load_n(&block[i], __ATOMIC_RELAXED);
+
+                return miss == 0;
+        }
+};
+
+
+/******************************************************************************
+ * filter  A Bloom filter specialized at compile time.
+ * ``````
+ * @K      : bit positions set per key
+ * @Hash   : hash functor
+ * @Layout : bloom::classic or bloom::blocked
+ * @M      : size of the bit array, a power of 2, or 0 to choose at run time
+ *
+ ******************************************************************************/
+template <size_t K, class Hash = wyhash, class Layout = classic, size_t M = 0>
+class filter {
+        static_assert(K > 0, "k must be at least 1");
+        static_assert(K <= BLOOM_FILE_MAX_K, "k must be at most BLOOM_FILE_MAX_K");
+        static_assert((M & (M - 1)) == 0, "a compile-time size must be a power of 2");
+        static_assert(M == 0 || M == Layout::bits(M), "the size must be whole blocks");
+
+public:
+        static constexpr size_t k = K;
+
+        /*
+         * @m    : size of the bit array (ignored, and may be left out, if
+         *         M is given); rounded up to whole blocks when blocked
+         * @seed : hash seed, as bloom->seed
+         */
+        explicit filter(size_t m = M, uint64_t seed = 0, Hash hash = Hash())
+                : m_(Layout::bits(M ? M : m)), seed_(seed), hash_(hash)
+        {
+                mask_  = (m_ & (m_ - 1)) ? 0 : m_ - 1;
+                words_ = (m_ + detail::WORD_BIT - 1) / detail::WORD_BIT;
+
+                if (!(a_ = (uint64_t *)aligned_alloc(64, (words_ * 8 + 63) & ~(size_t)63)))
+                        throw std::bad_alloc();
+                memset(a_, 0, words_ * 8);
+        }
+
+        filter(const filter &) = delete;
+        filter &operator=(const filter &) = delete;
+
+        filter(filter &&f) noexcept
+                : m_(f.m_), mask_(f.mask_), words_(f.words_), seed_(f.seed_),
+                  a_(f.a_), hash_(f.hash_)
+        {
+                f.a_ = nullptr;
+        }
+
+        filter &operator=(filter &&f) noexcept
+        {
+                if (this != &f) {
+                        free(a_);
+                        m_     = f.m_;
+                        mask_  = f.mask_;
+                        words_ = f.words_;
+                        seed_  = f.seed_;
+                        a_     = f.a_;
+                        hash_  = f.hash_;
+                        f.a_   = nullptr;
+                }
+                return *this;
+        }
+
+        ~filter()
+        {
+                free(a_);
+        }
+
+        void add(const void *key, size_t len)
+        {
+                uint64_t h1 = hash_(key, len, seed_);
+                Layout::template add<K, M>(a_, m_, mask_, h1, stride(h1));
+        }
+
+        void add(std::string_view s)
+        {
+                add(s.data(), s.size());
+        }
+
+        bool check(const void *key, size_t len) const
+        {
+                uint64_t h1 = hash_(key, len, seed_);
+                return Layout::template check<K, M>(a_, m_, mask_, h1, stride(h1));
+        }
+
+        bool check(std::string_view s) const
+        {
+                return check(s.data(), s.size());
+        }
+
+        size_t bits() const             { return m_; }
+        uint64_t seed() const           { return seed_; }
+        const uint64_t *data() const    { return a_; }
+        size_t bytes() const            { return words_ * sizeof(uint64_t); }
+
+        /*
+         * Write the filter to 'path' in the format of bloom_save(), by way
+         * of a temporary file renamed over it. Returns 0, or -1 with errno.
+         */
+        int save(const char *path) const
+        {
+                struct bloom_file_header h;
+                char tmp[4096];
+                int fd, err;
+
+                header(&h);
+
+                if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(tmp)) {
+                        errno = ENAMETOOLONG;
+                        return -1;
+                }
+
+                if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+                        return -1;
+
+                if (!detail::io(detail::write_fn, fd, &h, sizeof(h))
+                 || !detail::io(detail::write_fn, fd, a_, bytes())
+                 || fsync(fd) < 0) {
+                        err = errno;
+                        close(fd);
+                        unlink(tmp);
+                        errno = err;
+                        return -1;
+                }
+
+                close(fd);
+
+                if (rename(tmp, path) < 0) {
+                        err = errno;
+                        unlink(tmp);
+                        errno = err;
+                        return -1;
+                }
+
+                return 0;
+        }
+
+        /*
+         * Read a filter saved by save() or by the C library into this one,
+         * which must have the same k, hash, layout and size (if M was
+         * given). Returns 0, or -1 with errno set: EINVAL for a corrupt
+         * file, ENOTSUP for one that does not match.
+         */
+        int load(const char *path)
+        {
+                struct bloom_file_header h;
+                uint64_t *a;
+                int fd, err;
+
+                if ((fd = open(path, O_RDONLY)) < 0)
+                        return -1;
+
+                if (!detail::io(read, fd, &h, sizeof(h)) || !valid(&h)) {
+                        err = errno;
+                        close(fd);
+                        errno = err;
+                        return -1;
+                }
+
+                if (!(a = (uint64_t *)aligned_alloc(64, (h.bytes + 63) & ~(uint64_t)63))) {
+                        close(fd);
+                        errno = ENOMEM;
+                        return -1;
+                }
+
+                if (!detail::io(read, fd, a, h.bytes)) {
+                        err = errno;
+                        free(a);
+                        close(fd);
+                        errno = err;
+                        return -1;
+                }
+
+                if (detail::checksum(0, a, h.bytes, 0) != h.sum) {
+                        free(a);
+                        close(fd);
+                        errno = EINVAL;
+                        return -1;
+                }
+
+                close(fd);
+                free(a_);
+
+                a_     = a;
+                m_     = h.m;
+                mask_  = (m_ & (m_ - 1)) ? 0 : m_ - 1;
+                words_ = h.bytes / sizeof(uint64_t);
+                seed_  = h.seed;
+
+                return 0;
+        }
+
+private:
+        size_t m_;
+        size_t mask_;
+        size_t words_;
+        uint64_t seed_;
+        uint64_t *a_;
+        Hash hash_;
+
+        /* As bloom_hash_pair() */
+        static uint64_t stride(uint64_t h1)
+        {
+                return fmix64(h1 ^ 0x9e3779b97f4a7c15ULL) | 1;
+        }
+
+        void header(struct bloom_file_header *h) const
+        {
+                memset(h, 0, sizeof(*h));
+                memcpy(h->magic, BLOOM_FILE_MAGIC, sizeof(h->magic));
+
+                h->version = BLOOM_FILE_VERSION;
+                h->hash    = Hash::id;
+                h->m       = m_;
+                h->k       = K;
+                h->seed    = seed_;
+                h->layout  = Layout::id;
+                h->parts   = Layout::parts(m_);
+                h->bytes   = bytes();
+                h->sum     = detail::checksum(0, a_, h->bytes, 0);
+                h->hsum    = detail::header_sum(h);
+        }
+
+        static bool valid(const struct bloom_file_header *h)
+        {
+                if (memcmp(h->magic, BLOOM_FILE_MAGIC, sizeof(h->magic))
+                 || h->hsum != detail::header_sum(h)
+                 || h->k == 0 || h->k > BLOOM_FILE_MAX_K) {
+                        errno = EINVAL;
+                        return false;
+                }
+
+                if (h->version != BLOOM_FILE_VERSION || h->hash != Hash::id
+                 || h->layout != Layout::id || h->k != K || h->m == 0
+                 || h->m != Layout::bits(h->m) || (M && h->m != M)
+                 || h->parts != Layout::parts(h->m)
+                 || h->bytes != (h->m + detail::WORD_BIT - 1) / detail::WORD_BIT * sizeof(uint64_t)) {
+                        errno = ENOTSUP;
+                        return false;
+                }
+
+                return true;
+        }
+};
+
+
+} /* namespace bloom */
+
+#endif
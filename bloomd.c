@@ -0,0 +1,558 @@
+/******************************************************************************
+ * bloomd.c
+ * ````````
+ * Bloom filter query server
+ *
+ * Serves lookups in a filter file (see bloom_save()) over TCP. The filter
+ * is mapped with bloom_open_mmap(), so it is resident once, in the page
+ * cache, however many servers map it.
+ *
+ * PROTOCOL
+ * A client sends keys, one per line ('\n', or "\r\n"), and may send as
+ * many as it likes before reading. For each key the server answers one
+ * line, "1" if it may be in the filter and "0" if it is not, in order.
+ *
+ * With a small wrapper doing one recv(), one lookup and one send() per
+ * key, the system calls cost many times what the lookup does. Here every
+ * receive buffer full of pipelined keys becomes one bloom_check_many()
+ * call -- the misses of the whole batch overlapped -- and one send() of
+ * all the replies, so the per-key cost is the lookup plus a few bytes of
+ * copying.
+ *
+ * USAGE
+ *      bloomd [-a address] [-p port] [-t threads] [-e] [-V] filter.bloom
+ *
+ *      -a, -p  where to listen, default 127.0.0.1:7711
+ *      -t      event loop threads, default 1; each has its own listening
+ *              socket on the port (SO_REUSEPORT), so the kernel spreads
+ *              connections over them
+ *      -e      use epoll even when io_uring is available
+ *      -V      verify the checksum of the filter before serving it
+ *
+ * NOTES
+ * Each thread runs one event loop over all its connections: io_uring if
+ * the kernel has it (5.7 or later, for IORING_FEAT_FAST_POLL), epoll
+ * otherwise. io_uring is used through the raw system calls, so there is
+ * no dependency on liburing. A connection has one operation in flight at
+ * a time, a receive or a send: the replies to one buffer of keys are all
+ * sent before more keys are read, which is all the flow control a client
+ * that pipelines too far needs.
+ *
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "bloom.h"
+
+
+#define IN_BUF      16384       /* bytes of keys received at a time */
+#define OUT_BUF     (2 * IN_BUF)/* replies to a full buffer of 1 byte keys */
+#define RING_SIZE   1024        /* submission entries; also the limit on connections */
+#define MAX_EVENTS  256
+#define MAX_THREADS 64
+
+#define ACCEPT_TAG  1ULL        /* user_data of the accept; conns are aligned */
+
+
+struct conn {
+        int fd;
+        size_t have;            /* bytes in 'in' */
+        size_t outlen, outoff;  /* replies in 'out', and sent of them */
+        char in[IN_BUF];
+        char out[OUT_BUF];
+};
+
+struct worker {
+        struct bloom_t *bloom;
+        int listen;
+        int nconns;
+        const void *keys[IN_BUF];       /* scratch for one batch */
+        size_t lens[IN_BUF];
+        bool found[IN_BUF];
+};
+
+struct ring {
+        int fd;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        unsigned pending;       /* sqes queued but not submitted */
+        void *map;              /* the rings, for ring_free() */
+        size_t map_size, sqes_size;
+};
+
+
+static struct bloom_t *bloom;
+static struct sockaddr_in addr;
+static bool use_epoll;
+
+
+/******************************************************************************
+ * conn_process  Answer the complete lines received on a connection.
+ * ````````````
+ * @w     : worker, for its scratch arrays
+ * @c     : connection
+ * Returns: 0, or -1 if the buffer is full without a complete line (a key
+ *          longer than IN_BUF), and the connection should be dropped.
+ *
+ * NOTES
+ * The replies go into c->out; a partial line left at the end of the
+ * buffer is moved to its start, to be completed by the next receive.
+ *
+ ******************************************************************************/
+static int conn_process(struct worker *w, struct conn *c)
+{
+        char *p = c->in, *end = c->in + c->have, *nl;
+        size_t n, i, len;
+
+        for (n=0; p < end && (nl = memchr(p, '\n', end - p)); n++, p = nl + 1) {
+                len = nl - p;
+                if (len && p[len - 1] == '\r')
+                        len--;
+                w->keys[n] = p;
+                w->lens[n] = len;
+        }
+
+        if (n == 0 && c->have == IN_BUF)
+                return -1;
+
+        if (n)
+                bloom_check_many(w->bloom, w->keys, w->lens, n, w->found);
+
+        for (i=0; i<n; i++) {
+                c->out[2 * i]     = w->found[i] ? '1' : '0';
+                c->out[2 * i + 1] = '\n';
+        }
+        c->outlen = 2 * n;
+        c->outoff = 0;
+
+        c->have = end - p;
+        memmove(c->in, p, c->have);
+
+        return 0;
+}
+
+
+static struct conn *conn_new(struct worker *w, int fd)
+{
+        struct conn *c;
+        int one = 1;
+
+        if (w->nconns >= RING_SIZE - 1 || !(c = malloc(sizeof(struct conn)))) {
+                close(fd);
+                return NULL;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        c->fd     = fd;
+        c->have   = 0;
+        c->outlen = 0;
+        c->outoff = 0;
+        w->nconns++;
+
+        return c;
+}
+
+
+static void conn_del(struct worker *w, struct conn *c)
+{
+        close(c->fd);
+        free(c);
+        w->nconns--;
+}
+
+
+
+/******************************************************************************
+ * io_uring
+ * ````````
+ * Just enough of it to accept, receive and send on sockets: the rings
+ * are set up and mapped as the kernel's io_uring.h describes, without
+ * SQPOLL or registered buffers.
+ *
+ ******************************************************************************/
+static int ring_init(struct ring *r)
+{
+        struct io_uring_params p;
+        size_t sq_size, cq_size;
+        char *sq, *cq;
+
+        memset(&p, 0, sizeof(p));
+
+        if ((r->fd = syscall(SYS_io_uring_setup, RING_SIZE, &p)) < 0)
+                return -1;
+
+        if (!(p.features & IORING_FEAT_FAST_POLL) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+                close(r->fd);
+                errno = ENOSYS;
+                return -1;
+        }
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (cq_size > sq_size)
+                sq_size = cq_size;
+
+        sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  r->fd, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED) {
+                close(r->fd);
+                return -1;
+        }
+        cq = sq;
+
+        r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+        if (r->sqes == MAP_FAILED) {
+                munmap(sq, sq_size);
+                close(r->fd);
+                return -1;
+        }
+
+        r->sq_head  = (unsigned *)(sq + p.sq_off.head);
+        r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+        r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+        r->sq_array = (unsigned *)(sq + p.sq_off.array);
+        r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+        r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+        r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+        r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+        r->pending  = 0;
+
+        r->map       = sq;
+        r->map_size  = sq_size;
+        r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+        return 0;
+}
+
+static void ring_free(struct ring *r)
+{
+        munmap(r->sqes, r->sqes_size);
+        munmap(r->map, r->map_size);
+        close(r->fd);
+}
+
+
+/* Queue an operation; there is always room, one per connection at most */
+static void ring_queue(struct ring *r, int op, int fd, void *buf, size_t len, uint64_t tag)
+{
+        unsigned tail = *r->sq_tail, idx = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[idx];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = op;
+        sqe->fd        = fd;
+        sqe->addr      = (uintptr_t)buf;
+        sqe->len       = len;
+        sqe->user_data = tag;
+        if (op == IORING_OP_SEND)
+                sqe->msg_flags = MSG_NOSIGNAL;
+
+        r->sq_array[idx] = idx;
+        __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        r->pending++;
+}
+
+
+static void ring_recv(struct ring *r, struct conn *c)
+{
+        ring_queue(r, IORING_OP_RECV, c->fd, c->in + c->have, IN_BUF - c->have, (uintptr_t)c);
+}
+
+static void ring_send(struct ring *r, struct conn *c)
+{
+        ring_queue(r, IORING_OP_SEND, c->fd, c->out + c->outoff, c->outlen - c->outoff,
+                   (uintptr_t)c);
+}
+
+
+/******************************************************************************
+ * ring_loop  Serve connections with io_uring until the process dies.
+ * `````````
+ * NOTES
+ * A connection with replies pending (outoff < outlen) has a send in
+ * flight, otherwise a receive, so a completion says which it was.
+ *
+ ******************************************************************************/
+static void ring_loop(struct worker *w, struct ring *r)
+{
+        struct io_uring_cqe *cqe;
+        unsigned head, tail;
+        struct conn *c;
+        int res;
+
+        ring_queue(r, IORING_OP_ACCEPT, w->listen, NULL, 0, ACCEPT_TAG);
+
+        for (;;) {
+                if (syscall(SYS_io_uring_enter, r->fd, r->pending, 1,
+                            IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("io_uring_enter");
+                        return;
+                }
+                r->pending = 0;
+
+                head = *r->cq_head;
+                tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+                for (; head != tail; head++) {
+                        cqe = &r->cqes[head & *r->cq_mask];
+                        res = cqe->res;
+
+                        if (cqe->user_data == ACCEPT_TAG) {
+                                if (res >= 0 && (c = conn_new(w, res)))
+                                        ring_recv(r, c);
+                                ring_queue(r, IORING_OP_ACCEPT, w->listen, NULL, 0, ACCEPT_TAG);
+                                continue;
+                        }
+
+                        c = (struct conn *)(uintptr_t)cqe->user_data;
+
+                        if (c->outoff < c->outlen) {            /* a send */
+                                if (res <= 0) {
+                                        conn_del(w, c);
+                                        continue;
+                                }
+                                c->outoff += res;
+                        } else {                                /* a receive */
+                                if (res <= 0 || (c->have += res, conn_process(w, c) != 0)) {
+                                        conn_del(w, c);
+                                        continue;
+                                }
+                        }
+
+                        if (c->outoff < c->outlen)
+                                ring_send(r, c);
+                        else
+                                ring_recv(r, c);
+                }
+
+                __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        }
+}
+
+
+
+/******************************************************************************
+ * epoll_loop  Serve connections with epoll until the process dies.
+ * ``````````
+ * NOTES
+ * Sockets are non-blocking. A connection waits for EPOLLIN, or, while a
+ * send has been cut short, for EPOLLOUT instead.
+ *
+ ******************************************************************************/
+static int conn_send(struct conn *c)
+{
+        ssize_t n;
+
+        while (c->outoff < c->outlen) {
+                n = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+                if (n < 0)
+                        return errno == EAGAIN ? 0 : -1;
+                c->outoff += n;
+        }
+
+        return 0;
+}
+
+static void epoll_loop(struct worker *w)
+{
+        struct epoll_event ev[MAX_EVENTS], e;
+        int ep, n, i, fd;
+        struct conn *c;
+        ssize_t got;
+        bool sending;
+
+        if ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+                perror("epoll_create1");
+                return;
+        }
+
+        e.events   = EPOLLIN;
+        e.data.ptr = NULL;
+        epoll_ctl(ep, EPOLL_CTL_ADD, w->listen, &e);
+
+        for (;;) {
+                if ((n = epoll_wait(ep, ev, MAX_EVENTS, -1)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        perror("epoll_wait");
+                        return;
+                }
+
+                for (i=0; i<n; i++) {
+                        if (!(c = ev[i].data.ptr)) {
+                                while ((fd = accept4(w->listen, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+                                        if (!(c = conn_new(w, fd)))
+                                                continue;
+                                        e.events   = EPOLLIN;
+                                        e.data.ptr = c;
+                                        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &e);
+                                }
+                                continue;
+                        }
+
+                        sending = c->outoff < c->outlen;
+
+                        if (!sending) {
+                                got = recv(c->fd, c->in + c->have, IN_BUF - c->have, 0);
+                                if (got < 0 && errno == EAGAIN)
+                                        continue;
+                                if (got <= 0 || (c->have += got, conn_process(w, c) != 0)) {
+                                        conn_del(w, c);
+                                        continue;
+                                }
+                        }
+
+                        if (conn_send(c) != 0) {
+                                conn_del(w, c);
+                                continue;
+                        }
+
+                        /* Switch interest if the connection changed direction */
+                        if (sending != (c->outoff < c->outlen)) {
+                                e.events   = c->outoff < c->outlen ? EPOLLOUT : EPOLLIN;
+                                e.data.ptr = c;
+                                epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &e);
+                        }
+                }
+        }
+}
+
+
+static int listen_socket(bool nonblock)
+{
+        int fd, one = 1;
+
+        if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0), 0)) < 0)
+                return -1;
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0) {
+                close(fd);
+                return -1;
+        }
+
+        return fd;
+}
+
+
+static void *worker_run(void *arg)
+{
+        struct worker *w = arg;
+        struct ring r;
+
+        if (!use_epoll && ring_init(&r) == 0) {
+                if ((w->listen = listen_socket(false)) < 0) {
+                        perror("listen");
+                        exit(1);
+                }
+                ring_loop(w, &r);
+        } else {
+                if ((w->listen = listen_socket(true)) < 0) {
+                        perror("listen");
+                        exit(1);
+                }
+                epoll_loop(w);
+        }
+
+        exit(1);        /* the loops only return on fatal errors */
+}
+
+
+int main(int argc, char *argv[])
+{
+        const char *host = "127.0.0.1";
+        unsigned int flags = 0;
+        int nthreads = 1, port = 7711, opt, t;
+        struct worker *w;
+        pthread_t tid;
+        struct ring r;
+
+        while ((opt = getopt(argc, argv, "a:p:t:eV")) != -1) {
+                switch (opt) {
+                case 'a': host     = optarg; break;
+                case 'p': port     = atoi(optarg); break;
+                case 't': nthreads = atoi(optarg); break;
+                case 'e': use_epoll = true; break;
+                case 'V': flags    |= BLOOM_OPEN_VERIFY; break;
+                default:
+                        goto usage;
+                }
+        }
+
+        if (argc - optind != 1 || nthreads < 1 || nthreads > MAX_THREADS)
+                goto usage;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port   = htons(port);
+        if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+                fprintf(stderr, "bad address '%s'\n", host);
+                return 1;
+        }
+
+        if (!(bloom = bloom_open_mmap(argv[optind], flags))) {
+                fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+                return 1;
+        }
+
+        /* Find out which loop the workers will get, to say so */
+        if (!use_epoll) {
+                if (ring_init(&r) == 0)
+                        ring_free(&r);
+                else
+                        use_epoll = true;
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+
+        fprintf(stderr, "serving %s (m %zu, k %zu) on %s:%d, %d thread%s, %s\n",
+                argv[optind], bloom->m, bloom->k, host, port, nthreads,
+                nthreads == 1 ? "" : "s", use_epoll ? "epoll" : "io_uring");
+
+        for (t=0; t<nthreads; t++) {
+                if (!(w = malloc(sizeof(struct worker)))) {
+                        perror("malloc");
+                        return 1;
+                }
+                w->bloom  = bloom;
+                w->nconns = 0;
+
+                if (t == nthreads - 1)
+                        worker_run(w);
+                if (pthread_create(&tid, NULL, worker_run, w) != 0) {
+                        perror("pthread_create");
+                        return 1;
+                }
+        }
+
+        return 0;
+
+usage:
+        fprintf(stderr, "usage: %s [-a address] [-p port] [-t threads] [-e] [-V] filter.bloom\n",
+                argv[0]);
+        return 1;
+}
@@ -0,0 +1,380 @@
+/******************************************************************************
+ * build.c
+ * ```````
+ * Building Bloom filters from files of keys
+ *
+ * The keys of a big filter usually come from a dump: one key per line,
+ * gigabytes of them. Reading that with fgets() and adding line by line
+ * runs at the speed of one core, well below what a disk (or the page
+ * cache) delivers. Here the file is mapped, cut into one range per thread
+ * at line boundaries, and the threads add their lines in batches through
+ * bloom_add_many(), so that the cache misses of one batch overlap.
+ *
+ * The threads add either
+ *
+ *      concurrently            to the filter itself, with BLOOM_CONCURRENT
+ *                              atomic adds; no extra memory, but every bit
+ *                              set is an atomic read-modify-write, and a
+ *                              small filter has threads fighting over lines
+ *      to filters of their own (BLOOM_BUILD_MERGE), one copy of the array
+ *                              per thread but the first, ORed into the
+ *                              filter at the end (see bloom_union()); plain
+ *                              stores, which is better for filters that fit
+ *                              in cache and when memory is no object
+ *
+ * NOTES
+ * A line is the bytes up to a '\n', less a '\r' before it; empty lines
+ * are skipped, and nothing else is trimmed. The mapping is advised sequential,
+ * so the kernel reads ahead.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define BUILD_BATCH       256
+#define BUILD_MAX_THREADS 64
+
+
+struct build_job {
+        struct bloom_t *bloom;          /* to add to */
+        const char *from, *to;          /* whole lines */
+        size_t lines;                   /* counted, rather than added */
+        int err;                        /* errno of a failed add, or 0 */
+};
+
+
+/******************************************************************************
+ * build_line  Find the line at p.
+ * ``````````
+ * @p     : start of the line
+ * @end   : end of the range
+ * @len   : out, length of the key, without the line ending
+ * Returns: the start of the next line.
+ *
+ ******************************************************************************/
+static const char *build_line(const char *p, const char *end, size_t *len)
+{
+        const char *nl;
+
+        if (!(nl = memchr(p, '\n', end - p)))
+                nl = end;
+
+        *len = nl - p;
+        if (*len && p[*len - 1] == '\r')
+                (*len)--;
+
+        return nl < end ? nl + 1 : end;
+}
+
+
+static void *build_add(void *arg)
+{
+        struct build_job *job = arg;
+        const void *keys[BUILD_BATCH];
+        size_t lens[BUILD_BATCH];
+        const char *p, *next;
+        size_t n = 0;
+
+        for (job->err=0, p=job->from; p<job->to; p=next) {
+                next = build_line(p, job->to, &lens[n]);
+                if (lens[n] == 0)
+                        continue;
+                keys[n] = p;
+                if (++n == BUILD_BATCH) {
+                        if (bloom_add_many(job->bloom, keys, lens, n) < 0)
+                                job->err = errno;
+                        n = 0;
+                }
+        }
+
+        if (n && bloom_add_many(job->bloom, keys, lens, n) < 0)
+                job->err = errno;
+
+        return NULL;
+}
+
+
+static void *build_count(void *arg)
+{
+        struct build_job *job = arg;
+        const char *p;
+        size_t len;
+
+        for (job->lines=0, p=job->from; p<job->to; ) {
+                p = build_line(p, job->to, &len);
+                job->lines += len > 0;
+        }
+
+        return NULL;
+}
+
+
+/******************************************************************************
+ * build_split  Cut a mapped file into thread ranges of whole lines.
+ * ```````````
+ * @base  : the file
+ * @size  : its size
+ * @n     : number of ranges
+ * @job   : array of n jobs, from/to filled in
+ * Returns: nothing.
+ *
+ * NOTES
+ * Each cut is moved forward to just past the next '\n', so a range may be
+ * empty (a file with fewer lines than threads, or one huge line).
+ *
+ ******************************************************************************/
+static void build_split(const char *base, size_t size, int n, struct build_job *job)
+{
+        const char *end = base + size, *cut, *nl;
+        int t;
+
+        for (cut=base, t=0; t<n; t++) {
+                job[t].from = cut;
+
+                if (t == n - 1) {
+                        cut = end;
+                } else {
+                        cut = base + size / n * (t + 1);
+                        if (cut < job[t].from)
+                                cut = job[t].from;
+                        if (cut > base && cut < end && cut[-1] != '\n') {
+                                nl  = memchr(cut, '\n', end - cut);
+                                cut = nl ? nl + 1 : end;
+                        }
+                }
+
+                job[t].to = cut;
+        }
+}
+
+
+/* Run fn on each job, the caller taking the first and any that don't start */
+static void build_run(void *(*fn)(void *), struct build_job *job, int n)
+{
+        pthread_t tid[BUILD_MAX_THREADS];
+        bool started[BUILD_MAX_THREADS];
+        int t;
+
+        for (t=1; t<n; t++)
+                started[t] = pthread_create(&tid[t], NULL, fn, &job[t]) == 0;
+
+        fn(&job[0]);
+
+        for (t=1; t<n; t++) {
+                if (started[t])
+                        pthread_join(tid[t], NULL);
+                else
+                        fn(&job[t]);
+        }
+}
+
+
+static int build_threads(int nthreads)
+{
+        if (nthreads <= 0)
+                nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads > BUILD_MAX_THREADS)
+                nthreads = BUILD_MAX_THREADS;
+
+        return nthreads < 1 ? 1 : nthreads;
+}
+
+
+/******************************************************************************
+ * build_map  Map a file of keys for reading.
+ * `````````
+ * @path  : file
+ * @size  : out, its size
+ * Returns: the mapping, NULL for an empty file (size 0), or MAP_FAILED
+ *          with errno set.
+ *
+ ******************************************************************************/
+static char *build_map(const char *path, size_t *size)
+{
+        struct stat st;
+        char *base;
+        int fd, err;
+
+        if ((fd = open(path, O_RDONLY)) < 0)
+                return MAP_FAILED;
+
+        if (fstat(fd, &st) != 0) {
+                err = errno;
+                close(fd);
+                errno = err;
+                return MAP_FAILED;
+        }
+
+        if ((*size = st.st_size) == 0) {
+                close(fd);
+                return NULL;
+        }
+
+        base = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        err  = errno;
+        close(fd);
+        errno = err;
+
+        if (base != MAP_FAILED) {
+                madvise(base, *size, MADV_SEQUENTIAL);
+                madvise(base, *size, MADV_WILLNEED);
+        }
+
+        return base;
+}
+
+
+/******************************************************************************
+ * build_add_mapped  Add every line of a mapped file to a Bloom filter.
+ * ````````````````
+ * As bloom_add_file(), for a file already mapped.
+ *
+ ******************************************************************************/
+static int build_add_mapped(struct bloom_t *bloom, const char *base, size_t size,
+                            int nthreads, unsigned int flags)
+{
+        struct build_job job[BUILD_MAX_THREADS];
+        unsigned int saved;
+        int t, err;
+
+        for (t=0; t<nthreads; t++) {
+                job[t].bloom = bloom;
+                if (t && (flags & BLOOM_BUILD_MERGE) && !(job[t].bloom = bloom_clone(bloom)))
+                        break;
+        }
+        nthreads = t;
+
+        build_split(base, size, nthreads, job);
+
+        saved = bloom->flags;
+        if (nthreads > 1 && !(flags & BLOOM_BUILD_MERGE))
+                bloom->flags |= BLOOM_CONCURRENT;
+
+        build_run(build_add, job, nthreads);
+
+        bloom->flags = saved;
+
+        for (err=0, t=0; t<nthreads; t++) {
+                if (!err)
+                        err = job[t].err;
+                if (t && (flags & BLOOM_BUILD_MERGE)) {
+                        bloom_union(bloom, job[t].bloom);
+                        bloom_del(job[t].bloom);
+                }
+        }
+
+        if (err) {
+                errno = err;
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * bloom_add_file  Add every line of a file to a Bloom filter.
+ * ``````````````
+ * @bloom   : Bloom filter, in any mode
+ * @path    : file of keys, one per line
+ * @nthreads: threads to use, or 0 for one per online CPU
+ * @flags   : BLOOM_BUILD_MERGE to add into per-thread filters and merge
+ *            them, otherwise concurrently into 'bloom'
+ * Returns: 0 on success, otherwise -1 with errno set; ENOMEM if some line
+ *          could not be added (see bloom_add_buf()), the others all were.
+ *
+ * NOTES
+ * If a per-thread filter cannot be allocated, fewer threads are used.
+ * BLOOM_CONCURRENT is set on the filter for the duration of a concurrent
+ * build, and put back as it was afterwards.
+ *
+ * CAVEAT
+ * The filter must not be used by other threads during the build, unless
+ * it is already BLOOM_CONCURRENT and the build is not a merge.
+ *
+ ******************************************************************************/
+int bloom_add_file(struct bloom_t *bloom, const char *path, int nthreads, unsigned int flags)
+{
+        size_t size;
+        char *base;
+        int ret;
+
+        if ((base = build_map(path, &size)) == MAP_FAILED)
+                return -1;
+        if (!base)
+                return 0;
+
+        ret = build_add_mapped(bloom, base, size, build_threads(nthreads), flags);
+
+        munmap(base, size);
+
+        return ret;
+}
+
+
+/******************************************************************************
+ * bloom_build_from_file  Build a Bloom filter from a file of keys.
+ * `````````````````````
+ * @path    : file of keys, one per line
+ * @p       : the false positive rate wanted, 0 < p < 1
+ * @nthreads: threads to use, or 0 for one per online CPU
+ * @flags   : as bloom_add_file()
+ * Returns: An allocated bloom filter in single-hash mode, sized by
+ *          bloom_new_optimal() for the number of lines, or NULL with
+ *          errno set.
+ *
+ * NOTES
+ * The lines are counted in a first pass over the mapping, on the same
+ * threads, which also brings the file into the page cache for the second. Duplicate lines
+ * are counted twice, so a file with many gets a filter larger than it
+ * needs.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_build_from_file(const char *path, double p, int nthreads,
+                                      unsigned int flags)
+{
+        struct build_job job[BUILD_MAX_THREADS];
+        struct bloom_t *bloom;
+        size_t size, lines;
+        char *base;
+        int t;
+
+        if (!(p > 0.0 && p < 1.0)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if ((base = build_map(path, &size)) == MAP_FAILED)
+                return NULL;
+
+        nthreads = build_threads(nthreads);
+        lines    = 0;
+
+        if (base) {
+                build_split(base, size, nthreads, job);
+                build_run(build_count, job, nthreads);
+                for (t=0; t<nthreads; t++)
+                        lines += job[t].lines;
+        }
+
+        if ((bloom = bloom_new_optimal(lines, p)) && lines)
+                build_add_mapped(bloom, base, size, nthreads, flags);
+
+        if (base)
+                munmap(base, size);
+
+        if (!bloom)
+                errno = ENOMEM;
+
+        return bloom;
+}
@@ -0,0 +1,1172 @@
+/******************************************************************************
+ * check.c
+ * ```````
+ * Self-checking tests
+ *
+ * Each check builds some filters, runs keys through them, and asserts what
+ * must hold whatever the hashes do: no false negatives, round trips that
+ * give back the bits that went in, kernels and threads that agree with a
+ * plain loop. False positive rates are bench.c's business, not this
+ * file's.
+ *
+ * USAGE
+ *      make test
+ *
+ * runs it once per probe kernel (BLOOM_KERNEL=scalar, avx2, avx512; one
+ * the CPU can't run falls back to the best it can). Prints a line per
+ * failed assertion and exits 1 if there were any.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hashes.h"
+#include "bloom.h"
+#include "internal.h"
+
+
+#define NKEYS 5000
+#define KEYLEN 16
+
+static char keybuf[2 * NKEYS][KEYLEN];
+static const void *key[2 * NKEYS];      /* [0, NKEYS) added, the rest not */
+static size_t len[2 * NKEYS];
+
+static int failed;
+
+#define CHECK(cond) do {                                                \
+        if (!(cond)) {                                                  \
+                fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__,  \
+                        __func__, #cond);                               \
+                failed++;                                               \
+        }                                                               \
+} while (0)
+
+
+static void make_keys(void)
+{
+        int i;
+
+        for (i=0; i<2*NKEYS; i++) {
+                len[i] = snprintf(keybuf[i], KEYLEN, "%s%d", i < NKEYS ? "in" : "out", i);
+                key[i] = keybuf[i];
+        }
+}
+
+
+static bool same_bits(const struct bloom_t *a, const struct bloom_t *b)
+{
+        return a->m == b->m && a->k == b->k
+            && memcmp(a->a, b->a, (a->m + WORD_BIT - 1) / WORD_BIT * sizeof(uint64_t)) == 0;
+}
+
+static void fill(struct bloom_t *bloom, int lo, int hi)
+{
+        int i;
+
+        for (i=lo; i<hi; i++)
+                bloom_add_buf(bloom, key[i], len[i]);
+}
+
+static int count_missing(struct bloom_t *bloom, int lo, int hi)
+{
+        int i, n;
+
+        for (n=0, i=lo; i<hi; i++)
+                n += !bloom_check_buf(bloom, key[i], len[i]);
+
+        return n;
+}
+
+/* A file of its own under /tmp, closed; unlink() it when done */
+static bool temp_path(char *path)
+{
+        int fd;
+
+        strcpy(path, "/tmp/bloom_check_XXXXXX");
+        if ((fd = mkstemp(path)) < 0)
+                return false;
+        close(fd);
+
+        return true;
+}
+
+
+/******************************************************************************
+ * check_single_hash  bloom_new_k() and bloom_new() find every key added.
+ ******************************************************************************/
+static void check_single_hash(void)
+{
+        struct bloom_t *b;
+        int i, miss;
+
+        b = bloom_new_k(NKEYS * 10, 7);
+        for (i=0; i<NKEYS; i++)
+                bloom_add(b, key[i]);
+        for (miss=0, i=0; i<NKEYS; i++)
+                miss += !bloom_check(b, key[i]);
+        CHECK(miss == 0);
+        bloom_del(b);
+
+        /* A seed changes the bits, not the answers */
+        b = bloom_new_k(NKEYS * 10, 7);
+        b->seed = 0xdeadbeef;
+        for (i=0; i<NKEYS; i++)
+                bloom_add(b, key[i]);
+        for (miss=0, i=0; i<NKEYS; i++)
+                miss += !bloom_check(b, key[i]);
+        CHECK(miss == 0);
+        bloom_del(b);
+
+        b = bloom_new(NKEYS * 10, 3, djb2_hash, sdbm_hash, sax_hash);
+        for (i=0; i<NKEYS; i++)
+                bloom_add(b, key[i]);
+        for (miss=0, i=0; i<NKEYS; i++)
+                miss += !bloom_check(b, key[i]);
+        CHECK(miss == 0);
+        bloom_del(b);
+}
+
+
+/******************************************************************************
+ * check_blocked  The blocked filter finds every key added.
+ ******************************************************************************/
+static void check_blocked(void)
+{
+        struct bloom_blocked_t *bl;
+        int i, miss;
+
+        bl = bloom_blocked_new(NKEYS * 10, 7);
+        CHECK(bl->m % BLOOM_BLOCK_BITS == 0);
+        for (i=0; i<NKEYS; i++)
+                bloom_blocked_add_buf(bl, key[i], len[i]);
+        for (miss=0, i=0; i<NKEYS; i++)
+                miss += !bloom_blocked_check_buf(bl, key[i], len[i]);
+        CHECK(miss == 0);
+        bloom_blocked_del(bl);
+}
+
+
+/******************************************************************************
+ * check_buf  The _buf calls take any bytes, and agree with the string ones.
+ ******************************************************************************/
+static void check_buf(void)
+{
+        struct bloom_t *b[3];
+        char big[1000];
+        int f, i, miss;
+
+        b[0] = bloom_new(NKEYS * 10, 3, djb2_hash, sdbm_hash, sax_hash);
+        b[1] = bloom_new_len(NKEYS * 10, 3, djb2_hash_len, fnv_hash_len, wy_hash_len);
+        b[2] = bloom_new_k(NKEYS * 10, 7);
+
+        memset(big, 'x', sizeof(big));
+
+        for (f=0; f<3; f++) {
+                for (i=0; i<NKEYS; i++)
+                        CHECK(bloom_add_buf(b[f], key[i], len[i]) == 0);
+                for (miss=0, i=0; i<NKEYS; i++)
+                        miss += !bloom_check(b[f], key[i]);
+                CHECK(miss == 0);
+
+                for (miss=0, i=0; i<NKEYS; i++) {
+                        bloom_add(b[f], key[NKEYS + i]);
+                        miss += !bloom_check_buf(b[f], key[NKEYS + i], len[NKEYS + i]);
+                }
+                CHECK(miss == 0);
+
+                /* Past the scratch buffer of a bloom_new() filter */
+                CHECK(bloom_add_buf(b[f], big, sizeof(big)) == 0);
+                CHECK(bloom_check_buf(b[f], big, sizeof(big)));
+
+                bloom_del(b[f]);
+        }
+}
+
+
+/******************************************************************************
+ * check_many  The batched calls answer as the calls per key do.
+ ******************************************************************************/
+static void check_many(void)
+{
+        struct bloom_t *b[3], *one;
+        static bool out[2 * NKEYS];
+        int f, i, wrong;
+
+        b[0] = bloom_new(NKEYS * 10, 3, djb2_hash, sdbm_hash, sax_hash);
+        b[1] = bloom_new_len(NKEYS * 10, 3, djb2_hash_len, fnv_hash_len, wy_hash_len);
+        b[2] = bloom_new_k(NKEYS * 10, 7);
+
+        for (f=0; f<3; f++) {
+                one = bloom_clone(b[f]);
+                CHECK(one != NULL);
+                if (!one)
+                        continue;
+
+                /* Strings (lens NULL) for one half, lengths for the other */
+                CHECK(bloom_add_many(b[f], key, NULL, NKEYS / 2) == 0);
+                CHECK(bloom_add_many(b[f], key + NKEYS / 2, len + NKEYS / 2,
+                                     NKEYS - NKEYS / 2) == 0);
+                fill(one, 0, NKEYS);
+                CHECK(same_bits(b[f], one));
+
+                bloom_check_many(b[f], key, len, 2 * NKEYS, out);
+                for (wrong=0, i=0; i<2*NKEYS; i++)
+                        wrong += out[i] != bloom_check_buf(one, key[i], len[i]);
+                CHECK(wrong == 0);
+
+                bloom_check_many(b[f], key, NULL, NKEYS, out);
+                for (wrong=0, i=0; i<NKEYS; i++)
+                        wrong += !out[i];
+                CHECK(wrong == 0);
+
+                bloom_del(one);
+                bloom_del(b[f]);
+        }
+}
+
+
+/******************************************************************************
+ * check_sizes  Any size works, and a size of 0 is refused.
+ ******************************************************************************/
+static void check_sizes(void)
+{
+        struct bloom_arena_t *arena;
+        size_t sizes[] = { 1, 63, 64, 65, 1000, 4096, 20011 };
+        struct bloom_t *b;
+        int s;
+
+        for (s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+                b = bloom_new_k(sizes[s], 3);
+                CHECK(b != NULL);
+                if (!b)
+                        continue;
+                CHECK(b->mask == ((sizes[s] & (sizes[s] - 1)) ? 0 : sizes[s] - 1));
+                fill(b, 0, 50);
+                CHECK(count_missing(b, 0, 50) == 0);
+                CHECK(bloom_count_set_bits(b) <= sizes[s]);
+                bloom_del(b);
+        }
+
+        errno = 0;
+        CHECK(bloom_new_k(0, 3) == NULL && errno == EINVAL);
+        errno = 0;
+        CHECK(bloom_new(0, 1, djb2_hash) == NULL && errno == EINVAL);
+        errno = 0;
+        CHECK(bloom_new_len(0, 1, djb2_hash_len) == NULL && errno == EINVAL);
+        errno = 0;
+        CHECK(bloom_new_parts(0, 3, 4) == NULL && errno == EINVAL);
+        errno = 0;
+        CHECK(bloom_new_parts(4096, 3, 0) == NULL && errno == EINVAL);
+        errno = 0;
+        CHECK(bloom_bank_new(0, 3, 2) == NULL && errno == EINVAL);
+
+        arena = bloom_arena_new(0, NULL);
+        errno = 0;
+        CHECK(bloom_new_k_in(arena, 0, 3) == NULL && errno == EINVAL);
+        bloom_arena_del(arena);
+}
+
+
+/******************************************************************************
+ * check_kernels  The kernel in use answers as the plain loops do.
+ ******************************************************************************/
+static void check_kernels(void)
+{
+        uint64_t h1, h2, g, mask[BLOOM_BLOCK_BITS / WORD_BIT], *block;
+        struct bloom_blocked_t *bl;
+        struct bloom_t *b;
+        int i, n, wrong;
+        bool ref;
+        size_t w;
+
+        /* Lightly filled, so that misses get through a few probes */
+        b  = bloom_new_k(20011, 7);     /* not a power of 2 */
+        bl = bloom_blocked_new(NKEYS * 8, 7);
+        fill(b, 0, 1000);
+        for (i=0; i<1000; i++)
+                bloom_blocked_add_buf(bl, key[i], len[i]);
+
+        for (wrong=0, i=0; i<2*NKEYS; i++) {
+                bloom_hash_pair(key[i], len[i], b->seed, &h1, &h2);
+                for (ref=true, g=h1, n=0; n<b->k && ref; n++, g+=h2)
+                        ref = bloom_getbit(b->a, bloom_reduce64(g, b->m, b->mask));
+                wrong += bloom_check_buf(b, key[i], len[i]) != ref;
+        }
+        CHECK(wrong == 0);
+
+        for (wrong=0, i=0; i<2*NKEYS; i++) {
+                bloom_hash_pair(key[i], len[i], bl->seed, &h1, &h2);
+                block = bl->a + bloom_reduce64(h1, bl->nblocks, 0) * (BLOOM_BLOCK_BITS / WORD_BIT);
+                memset(mask, 0, sizeof(mask));
+                bloom_block_bits(h2, bl->k, mask);
+                for (ref=true, w=0; w<BLOOM_BLOCK_BITS/WORD_BIT; w++)
+                        ref = ref && (mask[w] & ~block[w]) == 0;
+                wrong += bloom_blocked_check_buf(bl, key[i], len[i]) != ref;
+        }
+        CHECK(wrong == 0);
+
+        bloom_del(b);
+        bloom_blocked_del(bl);
+}
+
+
+/******************************************************************************
+ * check_concurrent  Adds from many threads set the bits one thread would.
+ ******************************************************************************/
+#define ADD_THREADS 4
+
+struct add_job {
+        struct bloom_t *bloom;
+        int lo, hi;
+};
+
+static void *add_range(void *arg)
+{
+        struct add_job *job = arg;
+
+        fill(job->bloom, job->lo, job->hi);
+
+        return NULL;
+}
+
+static void check_concurrent(void)
+{
+        struct add_job job[ADD_THREADS];
+        pthread_t tid[ADD_THREADS];
+        struct bloom_t *b, *one;
+        int t;
+
+        /* Small, so that the threads keep hitting the same words */
+        b   = bloom_new_k(4096, 7);
+        one = bloom_new_k(4096, 7);
+        b->flags |= BLOOM_CONCURRENT;
+
+        for (t=0; t<ADD_THREADS; t++) {
+                job[t].bloom = b;
+                job[t].lo    = t * 2 * NKEYS / ADD_THREADS;
+                job[t].hi    = (t + 1) * 2 * NKEYS / ADD_THREADS;
+                CHECK(pthread_create(&tid[t], NULL, add_range, &job[t]) == 0);
+        }
+        for (t=0; t<ADD_THREADS; t++)
+                pthread_join(tid[t], NULL);
+
+        fill(one, 0, 2 * NKEYS);
+        CHECK(same_bits(b, one));
+        CHECK(count_missing(b, 0, 2 * NKEYS) == 0);
+
+        bloom_del(one);
+        bloom_del(b);
+}
+
+
+/******************************************************************************
+ * check_sharded  Sharded and partitioned filters find every key added.
+ ******************************************************************************/
+static void check_sharded(void)
+{
+        struct bloom_sharded_t *sh;
+        struct bloom_t *b;
+        int i, miss;
+
+        b = bloom_new_parts(NKEYS * 16, 7, 8);
+        fill(b, 0, NKEYS);
+        CHECK(count_missing(b, 0, NKEYS) == 0);
+        bloom_del(b);
+
+        sh = bloom_sharded_new(NKEYS * 16, 7, 4);
+        for (i=0; i<NKEYS; i++)
+                bloom_sharded_add_buf(sh, key[i], len[i]);
+        for (miss=0, i=0; i<NKEYS; i++)
+                miss += !bloom_sharded_check_buf(sh, key[i], len[i]);
+        CHECK(miss == 0);
+
+        CHECK((b = bloom_sharded_merge(sh)) != NULL);
+        if (b) {
+                CHECK(count_missing(b, 0, NKEYS) == 0);
+                bloom_del(b);
+        }
+        bloom_sharded_del(sh);
+
+        errno = 0;
+        CHECK(bloom_sharded_new(0, 7, 4) == NULL && errno == EINVAL);
+}
+
+
+/******************************************************************************
+ * check_optimal  bloom_new_optimal() sizes for n and p, and refuses bad p.
+ ******************************************************************************/
+static void check_optimal(void)
+{
+        struct bloom_t *b;
+
+        b = bloom_new_optimal(NKEYS, 0.01);
+        CHECK(b->m >= NKEYS * 9 && b->k == 7);
+        fill(b, 0, NKEYS);
+        CHECK(count_missing(b, 0, NKEYS) == 0);
+        bloom_del(b);
+
+        CHECK(bloom_new_optimal(NKEYS, 0) == NULL);
+        CHECK(bloom_new_optimal(NKEYS, 1) == NULL);
+}
+
+
+/******************************************************************************
+ * check_file  bloom_save()/bloom_open_mmap(), and bad headers refused.
+ ******************************************************************************/
+static void check_file(void)
+{
+        struct bloom_blocked_t *bl, *obl;
+        struct bloom_t *b, *o;
+        char path[32];
+        int i, miss;
+
+        if (!temp_path(path)) {
+                CHECK(!"mkstemp");
+                return;
+        }
+
+        b = bloom_new_k(NKEYS * 10, 7);
+        b->seed = 12345;
+        fill(b, 0, NKEYS);
+
+        CHECK(bloom_save(b, path) == 0);
+        CHECK((o = bloom_open_mmap(path, BLOOM_OPEN_VERIFY)) != NULL);
+        if (o) {
+                CHECK(same_bits(b, o) && o->seed == b->seed);
+                CHECK(count_missing(o, 0, NKEYS) == 0);
+                bloom_del(o);
+        }
+
+        /* A copy-on-write mapping takes adds and leaves the file be */
+        CHECK((o = bloom_open_mmap(path, BLOOM_OPEN_WRITE)) != NULL);
+        if (o) {
+                fill(o, NKEYS, 2*NKEYS);
+                CHECK(count_missing(o, 0, 2*NKEYS) == 0);
+                bloom_del(o);
+        }
+        CHECK((o = bloom_open_mmap(path, BLOOM_OPEN_VERIFY)) != NULL);
+        if (o) {
+                CHECK(same_bits(b, o));
+                bloom_del(o);
+        }
+
+        /* Flags set by the caller don't change how it is released */
+        CHECK((o = bloom_open_mmap(path, 0)) != NULL);
+        if (o) {
+                o->flags = BLOOM_CONCURRENT;
+                CHECK(count_missing(o, 0, NKEYS) == 0);
+                bloom_del(o);
+        }
+
+        /* No k, or an absurd one: refused, not an answer of always true */
+        b->k = 0;
+        CHECK(bloom_save(b, path) == 0);
+        errno = 0;
+        CHECK(bloom_open_mmap(path, 0) == NULL && errno == EINVAL);
+        b->k = BLOOM_FILE_MAX_K + 1;
+        CHECK(bloom_save(b, path) == 0);
+        errno = 0;
+        CHECK(bloom_open_mmap(path, 0) == NULL && errno == EINVAL);
+        b->k = 7;
+
+        /* Blocked */
+        bl = bloom_blocked_new(NKEYS * 10, 7);
+        for (i=0; i<NKEYS; i++)
+                bloom_blocked_add_buf(bl, key[i], len[i]);
+        CHECK(bloom_blocked_save(bl, path) == 0);
+        CHECK((obl = bloom_blocked_open_mmap(path, BLOOM_OPEN_VERIFY)) != NULL);
+        if (obl) {
+                for (miss=0, i=0; i<NKEYS; i++)
+                        miss += !bloom_blocked_check_buf(obl, key[i], len[i]);
+                CHECK(miss == 0);
+                bloom_blocked_del(obl);
+        }
+        bloom_blocked_del(bl);
+
+        unlink(path);
+        bloom_del(b);
+}
+
+
+/******************************************************************************
+ * Memory streams for bloom_write(), bloom_read() and the deltas
+ ******************************************************************************/
+struct membuf {
+        char *p;
+        size_t len, cap, off;
+};
+
+static int mem_write(void *ctx, const void *buf, size_t n)
+{
+        struct membuf *b = ctx;
+
+        if (b->len + n > b->cap) {
+                b->cap = (b->len + n) * 2;
+                if (!(b->p = realloc(b->p, b->cap)))
+                        return -1;
+        }
+        memcpy(b->p + b->len, buf, n);
+        b->len += n;
+
+        return 0;
+}
+
+static int mem_read(void *ctx, void *buf, size_t n)
+{
+        struct membuf *b = ctx;
+
+        if (b->off + n > b->len) {
+                errno = EIO;
+                return -1;
+        }
+        memcpy(buf, b->p + b->off, n);
+        b->off += n;
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * check_stream  bloom_write()/bloom_read(), and a replica kept by deltas.
+ ******************************************************************************/
+static void check_stream(void)
+{
+        struct membuf buf = {0};
+        struct bloom_t *b, *r;
+
+        b = bloom_new_k(NKEYS * 10, 7);
+        b->seed = 12345;
+        CHECK(bloom_track_dirty(b) == 0);
+        fill(b, 0, 100);
+
+        CHECK(bloom_write(b, mem_write, &buf) == 0);
+        CHECK((r = bloom_read(mem_read, &buf)) != NULL);
+        if (!r) {
+                bloom_del(b);
+                free(buf.p);
+                return;
+        }
+        CHECK(same_bits(b, r) && r->seed == b->seed);
+
+        fill(b, 100, NKEYS);
+        buf.len = buf.off = 0;
+        CHECK(bloom_export_delta(b, mem_write, &buf) == 0);
+        CHECK(bloom_apply_delta(r, mem_read, &buf) == 0);
+        CHECK(same_bits(b, r));
+
+        /* Nothing changed: an empty delta */
+        buf.len = buf.off = 0;
+        CHECK(bloom_export_delta(b, mem_write, &buf) == 0);
+        CHECK(bloom_apply_delta(r, mem_read, &buf) == 0);
+        CHECK(same_bits(b, r));
+
+        /* Truncated: an error, not a filter */
+        buf.len = buf.off = 0;
+        CHECK(bloom_write(b, mem_write, &buf) == 0);
+        buf.len /= 2;
+        CHECK(bloom_read(mem_read, &buf) == NULL);
+
+        free(buf.p);
+        bloom_del(r);
+        bloom_del(b);
+}
+
+
+/******************************************************************************
+ * check_ops  Set operations, on one thread and on several, give the bits
+ * of a plain loop over the words.
+ ******************************************************************************/
+static void check_ops(void)
+{
+        size_t words, w, bits;
+        struct bloom_t *a, *b, *u, *x;
+        double one;
+        int wrong;
+
+        /* Large enough for 3 threads: a whole number of lines each, and 2 over */
+        words = (1UL << 20) + 10;
+
+        a = bloom_new_k(words * WORD_BIT, 7);
+        b = bloom_new_k(words * WORD_BIT, 7);
+        fill(a, 0, NKEYS);
+        fill(b, NKEYS / 2, 2 * NKEYS);
+        a->a[words - 1] = 0xff00ff00ff00ff00ULL;
+        b->a[words - 1] = 0x0ff00ff00ff00ff0ULL;
+
+        bloom_ops_threads = 1;
+        one = bloom_estimate_count(a);
+
+        bloom_ops_threads = 3;
+        u = bloom_union_new(a, b);
+        x = bloom_intersect_new(a, b);
+        CHECK(u && x);
+        if (!u || !x)
+                goto out;
+
+        for (bits=0, wrong=0, w=0; w<words; w++) {
+                wrong += u->a[w] != (a->a[w] | b->a[w]);
+                wrong += x->a[w] != (a->a[w] & b->a[w]);
+                bits  += __builtin_popcountll(a->a[w]);
+        }
+        CHECK(wrong == 0);
+        CHECK(bloom_count_set_bits(a) == bits);
+        CHECK(bloom_estimate_count(a) == one);
+        CHECK(count_missing(u, 0, 2 * NKEYS) == 0);
+
+        CHECK(bloom_union(a, b) == 0);
+        CHECK(same_bits(a, u));
+        CHECK(bloom_intersect(a, x) == 0);
+        CHECK(same_bits(a, x));
+
+out:
+        bloom_ops_threads = 0;
+        if (u)
+                bloom_del(u);
+        if (x)
+                bloom_del(x);
+        bloom_del(a);
+        bloom_del(b);
+}
+
+
+/******************************************************************************
+ * check_counting  Keys stay until removed, and removals touch no others.
+ ******************************************************************************/
+static void check_counting(void)
+{
+        struct bloom_counting_t *c;
+        struct bloom_t *flat;
+        int i, miss;
+
+        c = bloom_counting_new(NKEYS * 10, 7);
+        for (i=0; i<NKEYS; i++)
+                bloom_counting_add_buf(c, key[i], len[i]);
+        for (i=0; i<NKEYS/2; i++)
+                CHECK(bloom_remove_buf(c, key[i], len[i]));
+        for (miss=0, i=NKEYS/2; i<NKEYS; i++)
+                miss += !bloom_counting_check_buf(c, key[i], len[i]);
+        CHECK(miss == 0);
+
+        CHECK((flat = bloom_counting_flatten(c)) != NULL);
+        if (flat) {
+                CHECK(count_missing(flat, NKEYS/2, NKEYS) == 0);
+                bloom_del(flat);
+        }
+        bloom_counting_del(c);
+
+        errno = 0;
+        CHECK(bloom_counting_new(0, 7) == NULL && errno == EINVAL);
+}
+
+
+/******************************************************************************
+ * check_engines  The fuse filter and every engine find every key built in.
+ ******************************************************************************/
+static void check_engines(void)
+{
+        const struct bloom_engine *engines[] = {
+                &bloom_engine_classic, &bloom_engine_blocked, &bloom_engine_fuse,
+        };
+        struct bloom_fuse_t *fuse;
+        struct bloom_filter *f;
+        int e, i, miss;
+
+        CHECK((fuse = bloom_fuse_build(key, len, NKEYS)) != NULL);
+        if (fuse) {
+                for (miss=0, i=0; i<NKEYS; i++)
+                        miss += !bloom_fuse_check_buf(fuse, key[i], len[i]);
+                CHECK(miss == 0);
+                bloom_fuse_del(fuse);
+        }
+
+        for (e=0; e<sizeof(engines)/sizeof(engines[0]); e++) {
+                CHECK((f = bloom_filter_build(engines[e], key, len, NKEYS, 0.01)) != NULL);
+                if (!f)
+                        continue;
+                for (miss=0, i=0; i<NKEYS; i++)
+                        miss += !bloom_filter_check(f, key[i], len[i]);
+                CHECK(miss == 0);
+
+                /* A static engine refuses adds */
+                if (engines[e]->add)
+                        CHECK(bloom_filter_add(f, key[NKEYS], len[NKEYS]) == 0);
+                else
+                        CHECK(bloom_filter_add(f, key[NKEYS], len[NKEYS]) == -1);
+                bloom_filter_del(f);
+        }
+}
+
+
+/******************************************************************************
+ * check_scalable  A scalable filter grown well past its first stage.
+ ******************************************************************************/
+static void check_scalable(void)
+{
+        struct bloom_scalable_t *sf;
+        int i, miss;
+
+        sf = bloom_scalable_new(NKEYS / 20, 0.01);
+        for (i=0; i<NKEYS; i++)
+                CHECK(bloom_scalable_add_buf(sf, key[i], len[i]) == 0);
+        for (miss=0, i=0; i<NKEYS; i++)
+                miss += !bloom_scalable_check_buf(sf, key[i], len[i]);
+        CHECK(miss == 0);
+        CHECK(sf->nstages > 1);
+        bloom_scalable_del(sf);
+}
+
+
+/******************************************************************************
+ * check_window  Keys live through gens-1 rotations, and not through gens.
+ ******************************************************************************/
+static void check_window(void)
+{
+        struct bloom_window_t *win;
+        int i, miss;
+
+        win = bloom_window_new(NKEYS * 10, 7, 4, 0);
+        for (i=0; i<NKEYS; i++)
+                bloom_window_add_buf(win, key[i], len[i]);
+        for (i=0; i<3; i++)
+                CHECK(bloom_window_rotate(win) == 0);
+        for (miss=0, i=0; i<NKEYS; i++)
+                miss += !bloom_window_check_buf(win, key[i], len[i]);
+        CHECK(miss == 0);
+
+        CHECK(bloom_window_rotate(win) == 0);
+        for (miss=0, i=0; i<NKEYS; i++)
+                miss += !bloom_window_check_buf(win, key[i], len[i]);
+        CHECK(miss == NKEYS);
+        bloom_window_del(win);
+}
+
+
+/******************************************************************************
+ * check_alloc  bloom_new_alloc() puts the array where it is told to.
+ ******************************************************************************/
+struct counts {
+        int allocs, frees;
+};
+
+static void *count_alloc(void *ctx, size_t bytes, size_t align)
+{
+        ((struct counts *)ctx)->allocs++;
+
+        return aligned_alloc(align, (bytes + align - 1) / align * align);
+}
+
+static void count_free(void *ctx, void *p, size_t bytes)
+{
+        ((struct counts *)ctx)->frees++;
+        free(p);
+}
+
+static void check_alloc(void)
+{
+        struct counts n = {0};
+        const struct bloom_alloc user = {
+                .align = 4096, .alloc = count_alloc, .free = count_free, .ctx = &n,
+        };
+        const struct bloom_alloc thp = {
+                .flags = BLOOM_ALLOC_THP | BLOOM_ALLOC_PREFAULT,
+        };
+        struct bloom_t *b;
+
+        CHECK((b = bloom_new_alloc(NKEYS * 10, 7, &user)) != NULL);
+        if (b) {
+                CHECK(((uintptr_t)b->a & 4095) == 0);
+                fill(b, 0, NKEYS);
+                CHECK(count_missing(b, 0, NKEYS) == 0);
+                bloom_del(b);
+        }
+        CHECK(n.allocs == 1 && n.frees == 1);
+
+        CHECK((b = bloom_new_alloc(1 << 24, 7, &thp)) != NULL);
+        if (b) {
+                CHECK(((uintptr_t)b->a & 63) == 0);
+                fill(b, 0, NKEYS);
+                CHECK(count_missing(b, 0, NKEYS) == 0);
+                bloom_del(b);
+        }
+}
+
+
+/******************************************************************************
+ * check_stats  The fill is counted, and the counters count, if built in.
+ ******************************************************************************/
+static void check_stats(void)
+{
+        struct bloom_stats st;
+        struct bloom_t *b;
+        int r;
+
+        b = bloom_new_k(NKEYS * 10, 7);
+        r = bloom_stats_enable(b);
+#ifdef BLOOM_STATS
+        CHECK(r == 0);
+#else
+        CHECK(r == -1 && errno == ENOTSUP);
+#endif
+
+        fill(b, 0, NKEYS);
+        count_missing(b, 0, 2 * NKEYS);
+
+        r = bloom_stats(b, &st);
+        CHECK(st.bits_set == bloom_count_set_bits(b));
+        CHECK(st.keys > NKEYS * 0.95 && st.keys < NKEYS * 1.05);
+#ifdef BLOOM_STATS
+        CHECK(r == 0);
+        CHECK(st.adds == NKEYS && st.checks == 2 * NKEYS);
+        CHECK(st.positives >= NKEYS && st.probes >= st.checks);
+
+        bloom_stats_reset(b);
+        CHECK(bloom_stats(b, &st) == 0 && st.adds == 0 && st.checks == 0);
+#else
+        CHECK(r == -1 && st.adds == 0 && st.checks == 0);
+#endif
+
+        bloom_del(b);
+}
+
+
+/******************************************************************************
+ * check_build  Builds from a file, on one thread or many, are the same.
+ ******************************************************************************/
+#define BUILD_KEYS 200000
+
+static void check_build(void)
+{
+        struct bloom_t *one, *conc, *merge, *b, *bn;
+        char path[32], line[32];
+        size_t m;
+        FILE *f;
+        int i, n;
+
+        if (!temp_path(path) || !(f = fopen(path, "w"))) {
+                CHECK(!"key file");
+                return;
+        }
+        for (i=0; i<BUILD_KEYS; i++)
+                fprintf(f, "line%d\n", i);
+        fclose(f);
+
+        /* The merge takes the threaded union (see check_ops()) */
+        m = ((1UL << 20) + 10) * WORD_BIT;
+        bloom_ops_threads = 3;
+
+        one   = bloom_new_k(m, 7);
+        conc  = bloom_new_k(m, 7);
+        merge = bloom_new_k(m, 7);
+
+        CHECK(bloom_add_file(one,   path, 1, 0) == 0);
+        CHECK(bloom_add_file(conc,  path, 3, 0) == 0);
+        CHECK(bloom_add_file(merge, path, 3, BLOOM_BUILD_MERGE) == 0);
+        CHECK(same_bits(one, conc));
+        CHECK(same_bits(one, merge));
+
+        for (n=0, i=0; i<BUILD_KEYS; i++) {
+                snprintf(line, sizeof(line), "line%d", i);
+                n += !bloom_check(merge, line);
+        }
+        CHECK(n == 0);
+
+        b  = bloom_build_from_file(path, 0.01, 1, 0);
+        bn = bloom_build_from_file(path, 0.01, 3, BLOOM_BUILD_MERGE);
+        CHECK(b && bn && same_bits(b, bn));
+        if (b)
+                bloom_del(b);
+        if (bn)
+                bloom_del(bn);
+
+        bloom_ops_threads = 0;
+        bloom_del(one);
+        bloom_del(conc);
+        bloom_del(merge);
+        unlink(path);
+}
+
+
+/******************************************************************************
+ * check_compress  bloom_compress() answers as the filter, and gives it back.
+ ******************************************************************************/
+static void check_compress(void)
+{
+        struct bloom_compressed_t *c, *o;
+        struct bloom_t *b, *d;
+        char path[32];
+        int i, wrong;
+
+        /* Sparse, so most blocks are coded; one dense part kept raw */
+        b = bloom_new_k(1 << 20, 3);
+        fill(b, 0, NKEYS);
+        memset(b->a, 0xff, 64 * sizeof(uint64_t));
+
+        CHECK((c = bloom_compress(b)) != NULL);
+        if (!c) {
+                bloom_del(b);
+                return;
+        }
+        CHECK(c->bytes < (1 << 20) / 8);
+
+        for (wrong=0, i=0; i<2*NKEYS; i++)
+                wrong += bloom_compressed_check_buf(c, key[i], len[i])
+                      != bloom_check_buf(b, key[i], len[i]);
+        CHECK(wrong == 0);
+
+        CHECK((d = bloom_decompress(c)) != NULL);
+        if (d) {
+                CHECK(same_bits(b, d));
+                bloom_del(d);
+        }
+
+        CHECK(temp_path(path));
+        CHECK(bloom_compressed_save(c, path) == 0);
+        CHECK((o = bloom_compressed_open_mmap(path, BLOOM_OPEN_VERIFY)) != NULL);
+        if (o) {
+                CHECK((d = bloom_decompress(o)) != NULL);
+                if (d) {
+                        CHECK(same_bits(b, d));
+                        bloom_del(d);
+                }
+                bloom_compressed_del(o);
+        }
+        unlink(path);
+
+        bloom_compressed_del(c);
+        bloom_del(b);
+}
+
+
+/******************************************************************************
+ * check_bank  Filters loaded into a bank come back out as they went in.
+ ******************************************************************************/
+static void check_bank(void)
+{
+        struct bloom_t *b[3], *x;
+        struct bloom_bank_t *bank;
+        uint64_t want, got;
+        int f, i, wrong;
+
+        bank = bloom_bank_new(NKEYS * 10, 7, 3);
+
+        for (f=0; f<3; f++) {
+                b[f] = bloom_new_k(NKEYS * 10, 7);
+                fill(b[f], f * NKEYS / 3, (f + 1) * NKEYS / 3);
+                CHECK(bloom_bank_load(bank, f, b[f]) == 0);
+        }
+        errno = 0;
+        CHECK(bloom_bank_add_buf(bank, 3, key[0], len[0]) == -1 && errno == EINVAL);
+
+        for (wrong=0, i=0; i<2*NKEYS; i++) {
+                for (want=0, f=0; f<3; f++)
+                        want |= (uint64_t)bloom_check_buf(b[f], key[i], len[i]) << f;
+                got    = bloom_bank_check_buf(bank, key[i], len[i]);
+                wrong += got != want;
+        }
+        CHECK(wrong == 0);
+
+        for (f=0; f<3; f++) {
+                CHECK((x = bloom_bank_extract(bank, f)) != NULL);
+                if (x) {
+                        CHECK(same_bits(b[f], x));
+                        bloom_del(x);
+                }
+                bloom_del(b[f]);
+        }
+
+        bloom_bank_del(bank);
+}
+
+
+/******************************************************************************
+ * check_arena  A reset arena hands out empty filters from the same memory.
+ ******************************************************************************/
+static void check_arena(void)
+{
+        struct bloom_arena_t *arena;
+        struct bloom_t *b;
+        size_t bytes;
+        int round, i, dirty;
+
+        arena = bloom_arena_new(64 * 1024, NULL);
+
+        for (bytes=0, round=0; round<3; round++) {
+                for (dirty=0, i=0; i<200; i++) {
+                        CHECK((b = bloom_new_k_in(arena, 1024, 3)) != NULL);
+                        if (!b)
+                                break;
+                        dirty += bloom_count_set_bits(b) != 0;
+                        fill(b, i, i + 20);
+                        CHECK(count_missing(b, i, i + 20) == 0);
+                }
+                CHECK(dirty == 0);
+
+                if (round == 0)
+                        bytes = bloom_arena_bytes(arena);
+                CHECK(bloom_arena_bytes(arena) == bytes);
+
+                bloom_arena_reset(arena);
+        }
+
+        /* Flags set by the caller don't make bloom_del() free it */
+        CHECK((b = bloom_new_in(arena, 1024, 2, djb2_hash, sdbm_hash)) != NULL);
+        if (b) {
+                b->flags = BLOOM_CONCURRENT;
+                bloom_add(b, "key");
+                CHECK(bloom_check(b, "key"));
+                bloom_del(b);
+        }
+
+        bloom_arena_del(arena);
+}
+
+
+/******************************************************************************
+ * check_clear  A cleared filter is empty, and a replica sees the clear.
+ ******************************************************************************/
+static void check_clear(void)
+{
+        struct membuf buf = {0};
+        struct bloom_t *b, *r;
+        int i;
+
+        /* Few keys, so the clear goes by block; then many, so it doesn't */
+        b = bloom_new_k(NKEYS * 64, 7);
+        CHECK(bloom_track_touched(b) == 0);
+        for (i=0; i<2; i++) {
+                fill(b, 0, i ? 2 * NKEYS : 20);
+                bloom_clear(b);
+                CHECK(bloom_count_set_bits(b) == 0);
+        }
+        bloom_del(b);
+
+        b = bloom_new_k(NKEYS * 10, 7);
+        CHECK(bloom_track_dirty(b) == 0);
+        CHECK(bloom_track_touched(b) == 0);
+        fill(b, 0, NKEYS);
+
+        CHECK(bloom_write(b, mem_write, &buf) == 0);
+        CHECK((r = bloom_read(mem_read, &buf)) != NULL);
+        if (!r) {
+                bloom_del(b);
+                free(buf.p);
+                return;
+        }
+
+        bloom_clear(b);
+        fill(b, NKEYS, NKEYS + 10);
+        buf.len = buf.off = 0;
+        CHECK(bloom_export_delta(b, mem_write, &buf) == 0);
+        CHECK(bloom_apply_delta(r, mem_read, &buf) == 0);
+        CHECK(same_bits(b, r));
+        CHECK(count_missing(r, NKEYS, NKEYS + 10) == 0);
+
+        free(buf.p);
+        bloom_del(r);
+        bloom_del(b);
+}
+
+
+/******************************************************************************
+ * check_hybrid  Exact: every key added is there, and no other.
+ ******************************************************************************/
+static void check_hybrid(void)
+{
+        struct bloom_hybrid_t *h;
+        int i, wrong;
+
+        errno = 0;
+        CHECK(bloom_hybrid_new(NKEYS, 1.5) == NULL && errno == EINVAL);
+
+        h = bloom_hybrid_new(NKEYS, 0.01);
+        for (i=0; i<NKEYS; i++)
+                CHECK(bloom_hybrid_add_buf(h, key[i], len[i]) == 0);
+        CHECK(h->count == NKEYS);
+
+        for (wrong=0, i=0; i<2*NKEYS; i++)
+                wrong += bloom_hybrid_contains_buf(h, key[i], len[i]) != (i < NKEYS);
+        CHECK(wrong == 0);
+
+        bloom_hybrid_del(h);
+}
+
+
+/******************************************************************************
+ * check_range  Every range holding a key says so.
+ ******************************************************************************/
+static void check_range(void)
+{
+        struct bloom_range_t *r;
+        uint64_t k;
+        int i, miss;
+
+        r = bloom_range_new(NKEYS, 0.01, 32, 32);
+
+        for (i=0; i<NKEYS; i++)
+                bloom_range_add(r, (uint64_t)i * 7919 + 1);
+
+        for (miss=0, i=0; i<NKEYS; i++) {
+                k     = (uint64_t)i * 7919 + 1;
+                miss += !bloom_range_check(r, k);
+                miss += !bloom_range_check_range(r, k, k);
+                miss += !bloom_range_check_range(r, k > 100 ? k - 100 : 0, k + 3);
+                miss += !bloom_range_check_range(r, k & ~0xfffULL, k | 0xfff);
+        }
+        CHECK(miss == 0);
+        CHECK(!bloom_range_check_range(r, 10, 9));
+        bloom_range_del(r);
+
+        /* Byte keys and their prefixes */
+        r = bloom_range_new(NKEYS, 0.01, 64, 64);
+        for (i=0; i<NKEYS; i++)
+                bloom_range_add_buf(r, key[i], len[i]);
+        for (miss=0, i=0; i<NKEYS; i++) {
+                miss += !bloom_range_check_prefix(r, key[i], 1);
+                miss += !bloom_range_check_prefix(r, key[i], 3);
+                miss += !bloom_range_check_prefix(r, key[i], len[i]);
+        }
+        CHECK(miss == 0);
+        bloom_range_del(r);
+}
+
+
+int main(void)
+{
+        make_keys();
+
+        check_single_hash();
+        check_blocked();
+        check_buf();
+        check_many();
+        check_sizes();
+        check_kernels();
+        check_concurrent();
+        check_sharded();
+        check_optimal();
+        check_file();
+        check_stream();
+        check_ops();
+        check_counting();
+        check_engines();
+        check_scalable();
+        check_window();
+        check_alloc();
+        check_stats();
+        check_build();
+        check_compress();
+        check_bank();
+        check_arena();
+        check_clear();
+        check_hybrid();
+        check_range();
+
+        printf("%s: %s kernel, %d failed\n", failed ? "FAIL" : "ok", bloom_kernel(), failed);
+
+        return failed ? 1 : 0;
+}
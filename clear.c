@@ -0,0 +1,141 @@
+/******************************************************************************
+ * clear.c
+ * ```````
+ * Clearing Bloom filters for reuse
+ *
+ * A scratch filter, one per request, is sized for the worst request but
+ * mostly gets a handful of keys. Emptying it for the next one with a
+ * memset() of the whole array costs the same whatever was added, and for
+ * a filter of a few megabytes that is more than the request itself.
+ *
+ * After bloom_track_touched(), adds note each block (a cache line) of the
+ * array that gets its first bit, and bloom_clear() zeroes only those: the
+ * cost of a clear is the number of blocks touched, not the size of the
+ * filter. The blocks noted are on a list of up to about an eighth of the
+ * blocks of the filter; once more have been touched than that, the clear
+ * is a memset() of the whole array, which streams through memory faster
+ * than the scattered lines could be cleared one by one.
+ *
+ * NOTES
+ * The other way of doing it, a generation stamp per block that makes a
+ * clear a single increment, would put a load and a compare of the stamp
+ * into every probe of every lookup: the scalar and SIMD kernels, and
+ * mapped filters which have no stamps. A touched list costs the adds
+ * alone, and only for the first bit of a block.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define ROUND(size) (((size) + WORD_BIT - 1) / WORD_BIT)
+#define BLOCK_WORDS (TOUCH_BLOCK_BITS / WORD_BIT)
+#define TOUCH_SPARSE 8          /* list room: 1/TOUCH_SPARSE of the blocks */
+#define TOUCH_MIN    64         /* ...but no less than this */
+
+
+/******************************************************************************
+ * bloom_track_touched  Start noting which blocks of a filter get bits.
+ * ```````````````````
+ * @bloom : Bloom filter
+ * Returns: 0, or -1 with errno set.
+ *
+ * NOTES
+ * Call before the filter is shared between threads. If the filter has
+ * bits set already, whose blocks are not known, the next clear is a whole
+ * one, and only those after it are by block.
+ *
+ ******************************************************************************/
+int bloom_track_touched(struct bloom_t *bloom)
+{
+        struct bloom_touched *t;
+        size_t blocks, cap, mapw, n, words;
+
+        if (bloom->touched)
+                return 0;
+
+        blocks = (bloom->m + TOUCH_BLOCK_BITS - 1) / TOUCH_BLOCK_BITS;
+        cap    = blocks <= TOUCH_MIN ? blocks : blocks / TOUCH_SPARSE;
+        cap    = cap < TOUCH_MIN && blocks > TOUCH_MIN ? TOUCH_MIN : cap;
+        mapw   = ROUND(blocks);
+
+        /* The struct, the list, then the map, in one allocation */
+        if (!(t = calloc(1, sizeof(struct bloom_touched) + cap*sizeof(size_t)
+                            + mapw*sizeof(uint64_t)))) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        t->cap   = cap;
+        t->count = 0;
+        t->map   = (uint64_t *)&t->list[cap];
+
+        for (n=0, words=ROUND(bloom->m); n<words; n++) {
+                if (bloom->a[n]) {
+                        t->count = cap + 1;
+                        break;
+                }
+        }
+
+        bloom->touched = t;
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * bloom_clear  Empty a Bloom filter.
+ * ```````````
+ * @bloom : Bloom filter
+ * Returns: nothing.
+ *
+ * NOTES
+ * Without bloom_track_touched() the whole array is zeroed. With it, only
+ * the blocks touched since the last clear are, unless there were too many
+ * to keep on the list. Either way, the blocks zeroed are marked cleared
+ * in the dirty map of a filter that has one, and the next delta sends
+ * them as replace ranges, so that a receiver zeroes them too.
+ *
+ * CAVEAT
+ * Not to be called while other threads add to or check the filter: they
+ * would see it half cleared, and bits they set during the clear may be
+ * lost or missing from the list. Nor alongside bloom_export_delta(), which
+ * could send a cleared region as an ordinary one.
+ *
+ ******************************************************************************/
+void bloom_clear(struct bloom_t *bloom)
+{
+        struct bloom_touched *t = bloom->touched;
+        size_t words, from, to, i;
+
+        words = ROUND(bloom->m);
+
+        if (!t || t->count > t->cap) {
+                memset(bloom->a, 0, words * sizeof(uint64_t));
+                if (bloom->dirty && words)
+                        bloom_mark_cleared(bloom, 0, words);
+                if (t) {
+                        memset(t->map, 0, ROUND((bloom->m + TOUCH_BLOCK_BITS - 1)
+                                                / TOUCH_BLOCK_BITS) * sizeof(uint64_t));
+                        t->count = 0;
+                }
+                return;
+        }
+
+        for (i=0; i<t->count; i++) {
+                from = t->list[i] * BLOCK_WORDS;
+                to   = from + BLOCK_WORDS < words ? from + BLOCK_WORDS : words;
+
+                memset(&bloom->a[from], 0, (to - from) * sizeof(uint64_t));
+                if (bloom->dirty)
+                        bloom_mark_cleared(bloom, from, to);
+
+                t->map[t->list[i] / WORD_BIT] = 0;
+        }
+
+        t->count = 0;
+}
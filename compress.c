@@ -0,0 +1,457 @@
+/******************************************************************************
+ * compress.c
+ * ``````````
+ * Compressed Bloom filters
+ *
+ * A filter filled to its design load has half its bits set, and there is
+ * nothing to compress: its bits are as random as bits get. But a filter
+ * sized for growth, or built for a key set smaller than planned, is
+ * mostly zeros, and shipping or storing the raw array wastes most of it.
+ *
+ * Here the array is cut into blocks of BLOOM_COMPRESSED_BLOCK bits and
+ * each block coded on its own. The set bits of a block are coded as the
+ * gaps between them, with a Golomb-Rice code whose parameter is picked
+ * for the block's density; a block for which that comes out no smaller
+ * than the block itself is kept raw. An index gives the offset of every
+ * block's code (and its parameter), so that a lookup decodes only the
+ * blocks its k probes land in, and of those only up to the probed bit:
+ *
+ *      index[b]   = offset of block b in data, in bits | parameter << 56
+ *      index[b+1] = where block b ends
+ *
+ * A saved compressed filter (bloom_compressed_save()) is the same bytes,
+ * so one opened with bloom_compressed_open_mmap() answers lookups in
+ * place, and only the pages of the index and of the blocks actually
+ * probed are ever read from disk.
+ *
+ * NOTES
+ * At a fill f, a Rice code spends about log2(1/f) + 1.5 bits per set bit,
+ * so a block compresses when f is below roughly 1/5. At f = 1% that is
+ * about 8 bits per set bit, 12 to 1 over the raw block, less the index's
+ * 64 bits per block.
+ *
+ * A lookup in a coded block is a scan of up to a block's worth of gaps,
+ * so it is slower than a lookup in the raw array, much as a cold filter
+ * can afford. To work on a filter, bloom_decompress() it.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define ROUND(size) (((size) + WORD_BIT - 1) / WORD_BIT)
+
+#define BLOCK_WORDS (BLOOM_COMPRESSED_BLOCK / WORD_BIT)
+#define OFF_MASK    ((1ULL << 56) - 1)
+#define RAW         0xff        /* parameter of a block kept raw */
+#define MAX_PARAM   16
+
+/* Payload: block bits, nblocks, index[nblocks+1], data, one word of slack */
+#define HEAD_WORDS  2
+
+
+
+/******************************************************************************
+ * Bit streams
+ * ```````````
+ * Bits are numbered from the least significant bit of word 0 up. A read
+ * takes the 64 bits from an offset, which may straddle two words; the
+ * stream always has a word of slack at the end for that.
+ *
+ ******************************************************************************/
+static inline uint64_t peek(const uint64_t *d, uint64_t off)
+{
+        uint64_t i = off / WORD_BIT, s = off % WORD_BIT;
+
+        return s ? d[i] >> s | d[i + 1] << (WORD_BIT - s) : d[i];
+}
+
+static inline void put(uint64_t *d, uint64_t *off, uint64_t bits, int n)
+{
+        uint64_t i = *off / WORD_BIT, s = *off % WORD_BIT;
+
+        if (n == 0)
+                return;
+
+        d[i] |= bits << s;
+        if (s + n > WORD_BIT)
+                d[i + 1] |= bits >> (WORD_BIT - s);
+
+        *off += n;
+}
+
+/* q one bits and a zero; the stream is zeroed, so only the ones are written */
+static inline void put_unary(uint64_t *d, uint64_t *off, uint64_t q)
+{
+        for (; q >= 32; q -= 32)
+                put(d, off, 0xffffffffULL, 32);
+        put(d, off, (1ULL << q) - 1, q + 1);
+}
+
+/* ...which stops at end, so that a corrupt stream is not read past it */
+static inline uint64_t get_unary(const uint64_t *d, uint64_t *off, uint64_t end)
+{
+        uint64_t w, q = 0;
+        int t;
+
+        for (;;) {
+                w = ~peek(d, *off);
+                t = w ? __builtin_ctzll(w) : WORD_BIT;
+                q    += t;
+                *off += t;
+                if (t < WORD_BIT || *off >= end)
+                        break;
+        }
+        (*off)++;
+
+        return q;
+}
+
+
+/******************************************************************************
+ * block_param  Pick the Rice parameter of a block, or decide on raw.
+ * ```````````
+ * @w     : the block's words
+ * @nw    : how many (the last block may be short)
+ * @cost  : out, bits the block will take
+ * Returns: the parameter, or RAW.
+ *
+ * NOTES
+ * The parameter near log2 of the mean gap is optimal for geometric gaps;
+ * the one either side of it is tried as well, since the bits of one block
+ * are a small sample.
+ *
+ ******************************************************************************/
+static int block_param(const uint64_t *w, size_t nw, uint64_t *cost)
+{
+        uint64_t c[MAX_PARAM + 1], prev, pos, gap, bits, count;
+        int r, best, lo;
+        size_t i;
+
+        for (count=0, i=0; i<nw; i++)
+                count += __builtin_popcountll(w[i]);
+
+        if (count == 0) {
+                *cost = 0;
+                return 0;
+        }
+
+        for (lo=0; lo < MAX_PARAM && (nw * WORD_BIT / count) >> (lo + 1) > 1; lo++)
+                ;
+        lo = lo > 0 ? lo - 1 : 0;
+
+        memset(c, 0, sizeof(c));
+
+        for (prev=-1, i=0; i<nw; i++) {
+                for (bits=w[i]; bits; bits &= bits - 1) {
+                        pos  = i * WORD_BIT + __builtin_ctzll(bits);
+                        gap  = pos - prev - 1;
+                        prev = pos;
+                        for (r=lo; r<=lo+2 && r<=MAX_PARAM; r++)
+                                c[r] += (gap >> r) + 1 + r;
+                }
+        }
+
+        for (best=lo, r=lo+1; r<=lo+2 && r<=MAX_PARAM; r++) {
+                if (c[r] < c[best])
+                        best = r;
+        }
+
+        if (c[best] >= nw * WORD_BIT) {
+                *cost = nw * WORD_BIT;
+                return RAW;
+        }
+
+        *cost = c[best];
+
+        return best;
+}
+
+
+static void block_encode(uint64_t *d, uint64_t *off, const uint64_t *w, size_t nw, int r)
+{
+        uint64_t prev, pos, gap, bits;
+        size_t i;
+
+        if (r == RAW) {
+                for (i=0; i<nw; i++)
+                        put(d, off, w[i], WORD_BIT);
+                return;
+        }
+
+        for (prev=-1, i=0; i<nw; i++) {
+                for (bits=w[i]; bits; bits &= bits - 1) {
+                        pos  = i * WORD_BIT + __builtin_ctzll(bits);
+                        gap  = pos - prev - 1;
+                        prev = pos;
+                        put_unary(d, off, gap >> r);
+                        put(d, off, gap & ((1ULL << r) - 1), r);
+                }
+        }
+}
+
+
+/******************************************************************************
+ * bloom_compress  Make a compressed copy of a Bloom filter.
+ * ``````````````
+ * @bloom : Bloom filter, in single-hash mode
+ * Returns: An allocated compressed filter answering as 'bloom' does, or
+ *          NULL, with errno set to EINVAL if the filter is not in
+ *          single-hash mode.
+ *
+ * NOTES
+ * Coding is two passes over the array: one to pick the parameters and
+ * size the output, one to write it.
+ *
+ ******************************************************************************/
+struct bloom_compressed_t *bloom_compress(const struct bloom_t *bloom)
+{
+        struct bloom_compressed_t *c;
+        uint64_t *payload, *index, *data, off, cost;
+        size_t words, nblocks, b, nw;
+        unsigned char *param;
+
+        if (bloom->hash || bloom->hashlen) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        words   = ROUND(bloom->m);
+        nblocks = (words + BLOCK_WORDS - 1) / BLOCK_WORDS;
+
+        if (!(param = malloc(nblocks)))
+                return NULL;
+
+        for (off=0, b=0; b<nblocks; b++) {
+                nw       = words - b * BLOCK_WORDS < BLOCK_WORDS ? words - b * BLOCK_WORDS : BLOCK_WORDS;
+                param[b] = block_param(bloom->a + b * BLOCK_WORDS, nw, &cost);
+                off     += cost;
+        }
+
+        /* The head, the index, the data and a word of slack */
+        words = HEAD_WORDS + nblocks + 1 + ROUND(off) + 1;
+
+        if (!(c = malloc(sizeof(struct bloom_compressed_t)))
+         || !(payload = calloc(words, sizeof(uint64_t)))) {
+                free(c);
+                free(param);
+                return NULL;
+        }
+
+        payload[0] = BLOOM_COMPRESSED_BLOCK;
+        payload[1] = nblocks;
+        index      = payload + HEAD_WORDS;
+        data       = index + nblocks + 1;
+
+        for (off=0, b=0; b<nblocks; b++) {
+                nw       = ROUND(bloom->m) - b * BLOCK_WORDS;
+                nw       = nw < BLOCK_WORDS ? nw : BLOCK_WORDS;
+                index[b] = off | (uint64_t)param[b] << 56;
+                block_encode(data, &off, bloom->a + b * BLOCK_WORDS, nw, param[b]);
+        }
+        index[nblocks] = off;
+
+        free(param);
+
+        c->m       = bloom->m;
+        c->k       = bloom->k;
+        c->mask    = bloom->mask;
+        c->parts   = bloom->parts;
+        c->seed    = bloom->seed;
+        c->flags   = 0;
+        c->own     = 0;
+        c->nblocks = nblocks;
+        c->index   = index;
+        c->data    = data;
+        c->payload = payload;
+        c->bytes   = words * sizeof(uint64_t);
+
+        return c;
+}
+
+
+/******************************************************************************
+ * bloom_compressed_del  Delete a compressed Bloom filter.
+ * ````````````````````
+ * @c     : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_compressed_del(struct bloom_compressed_t *c)
+{
+        if (c->own & BLOOM_MAPPED)
+                bloom_file_unmap(c->payload, c->bytes);
+        else
+                free(c->payload);
+        free(c);
+}
+
+
+/******************************************************************************
+ * bloom_compressed_valid  Check the index of a compressed filter.
+ * ``````````````````````
+ * @c     : compressed filter, its data 'index[nblocks]' bits long
+ * Returns: true if every block starts where the one before it ends or
+ *          after, has a parameter the coder could have picked, and, if it
+ *          is raw, is as long as the block; otherwise false.
+ *
+ * NOTES
+ * One pass over the index, for bloom_compressed_open_mmap(). With it, the
+ * reads of a lookup stay inside the data whatever the blocks hold: the
+ * decoding of a block never runs past its end.
+ *
+ ******************************************************************************/
+bool bloom_compressed_valid(const struct bloom_compressed_t *c)
+{
+        uint64_t off, end;
+        size_t b, nw;
+        int r;
+
+        if (c->index[c->nblocks] >> 56)
+                return false;
+
+        for (b=0; b<c->nblocks; b++) {
+                nw  = ROUND(c->m) - b * BLOCK_WORDS;
+                nw  = nw < BLOCK_WORDS ? nw : BLOCK_WORDS;
+                off = c->index[b] & OFF_MASK;
+                end = c->index[b + 1] & OFF_MASK;
+                r   = c->index[b] >> 56;
+
+                if (off > end || (r > MAX_PARAM && r != RAW)
+                 || (r == RAW && end - off != nw * WORD_BIT))
+                        return false;
+        }
+
+        return true;
+}
+
+
+/******************************************************************************
+ * compressed_getbit  Read bit n of a compressed filter.
+ * `````````````````
+ * NOTES
+ * Decodes the gaps of n's block only until they pass n: the early exit
+ * of a lookup inside the block.
+ *
+ ******************************************************************************/
+static bool compressed_getbit(const struct bloom_compressed_t *c, size_t n)
+{
+        uint64_t e, off, end, pos, q;
+        size_t b, bit;
+        int r;
+
+        b   = n / BLOOM_COMPRESSED_BLOCK;
+        bit = n % BLOOM_COMPRESSED_BLOCK;
+        e   = c->index[b];
+        off = e & OFF_MASK;
+        end = c->index[b + 1] & OFF_MASK;
+        r   = e >> 56;
+
+        if (r == RAW)
+                return (peek(c->data, off + bit) & 1);
+
+        for (pos=-1; off < end; ) {
+                q    = get_unary(c->data, &off, end);
+                if (off + r > end)
+                        break;
+                pos += 1 + ((q << r) | (peek(c->data, off) & ((1ULL << r) - 1)));
+                off += r;
+                if (pos >= bit)
+                        return pos == bit;
+        }
+
+        return false;
+}
+
+
+/******************************************************************************
+ * bloom_compressed_check_buf  Determine if a key is in a compressed filter.
+ * ``````````````````````````
+ * @c     : compressed filter
+ * @key   : bytes of the key
+ * @len   : length of the key in bytes
+ * Returns: as bloom_check_buf() on the filter it was made from.
+ *
+ ******************************************************************************/
+bool bloom_compressed_check_buf(const struct bloom_compressed_t *c, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+        size_t base, pm;
+        int n;
+
+        bloom_hash_pair(key, len, c->seed, &h1, &h2);
+
+        pm   = c->parts > 1 ? c->m / c->parts : c->m;
+        base = c->parts > 1 ? bloom_route(h1, h2, c->parts) * pm : 0;
+
+        for (n=0; n<c->k; n++, h1+=h2) {
+                if (!compressed_getbit(c, base + bloom_reduce64(h1, pm, c->mask)))
+                        return false;
+        }
+
+        return true;
+}
+
+bool bloom_compressed_check(const struct bloom_compressed_t *c, const char *s)
+{
+        return bloom_compressed_check_buf(c, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_decompress  Make an ordinary Bloom filter of a compressed one.
+ * ````````````````
+ * @c     : compressed filter
+ * Returns: An allocated bloom filter, as the one compressed, or NULL.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_decompress(const struct bloom_compressed_t *c)
+{
+        uint64_t e, off, end, pos, q;
+        struct bloom_t *bloom;
+        size_t b, i, nw;
+        uint64_t *w;
+        int r;
+
+        if (c->parts > 1)
+                bloom = bloom_new_parts(c->m, c->k, c->parts);
+        else
+                bloom = bloom_new_k(c->m, c->k);
+        if (!bloom)
+                return NULL;
+
+        bloom->seed = c->seed;
+
+        for (b=0; b<c->nblocks; b++) {
+                w   = bloom->a + b * BLOCK_WORDS;
+                nw  = ROUND(c->m) - b * BLOCK_WORDS;
+                nw  = nw < BLOCK_WORDS ? nw : BLOCK_WORDS;
+                e   = c->index[b];
+                off = e & OFF_MASK;
+                end = c->index[b + 1] & OFF_MASK;
+                r   = e >> 56;
+
+                if (r == RAW) {
+                        for (i=0; i<nw; i++)
+                                w[i] = peek(c->data, off + i * WORD_BIT);
+                        continue;
+                }
+
+                for (pos=-1; off < end; ) {
+                        q    = get_unary(c->data, &off, end);
+                        if (off + r > end)
+                                break;
+                        pos += 1 + ((q << r) | (peek(c->data, off) & ((1ULL << r) - 1)));
+                        off += r;
+                        if (pos >= nw * WORD_BIT)
+                                break;
+                        w[pos / WORD_BIT] |= 1ULL << (pos % WORD_BIT);
+                }
+        }
+
+        return bloom;
+}
@@ -0,0 +1,337 @@
+/******************************************************************************
+ * counting.c
+ * ``````````
+ * Counting Bloom filters
+ *
+ * HISTORY
+ * Keys cannot be removed from an ordinary Bloom filter: a bit may have
+ * been set by several keys, and clearing it for one of them would make
+ * the others disappear. The counting filter (Fan, Cao, Almeida and
+ * Broder, "Summary Cache") replaces each bit with a small counter, which
+ * an add increments and a remove decrements. A key is present when all
+ * of its k counters are non-zero.
+ *
+ * NOTES
+ * Counters are 4 bits wide, packed sixteen to a 64-bit word (two to a
+ * byte). With the usual k = (m/n) ln 2 the chance of any counter ever
+ * reaching 16 is around 1.4e-15 * m, so a counter that does fill up
+ * simply sticks at 15: it can no longer tell how many keys it counts, so
+ * it is never decremented again rather than risk a false negative.
+ *
+ * The positions are those of a single-hash filter made by bloom_new_k()
+ * with the same size, k and seed, and bloom_counting_flatten() turns a
+ * counting filter into that plain filter, a quarter of the size, for
+ * shipping to readers which never remove anything.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define NIBBLE_BITS  4
+#define WORD_NIBBLES (WORD_BIT / NIBBLE_BITS)
+#define NIBBLE_MAX   0xfULL
+
+#define ROUND4(size) (((size) + WORD_NIBBLES - 1) / WORD_NIBBLES)
+
+
+/******************************************************************************
+ * bloom_counting_new  Allocate and return a new counting Bloom filter.
+ * ``````````````````
+ * @size  : number of counters in the filter (the m of a plain filter)
+ * @nfuncs: the number of counters (k) touched per key
+ * Returns: An allocated counting bloom filter, or NULL (errno EINVAL for a
+ *          size of 0).
+ *
+ * USAGE
+ * Size it as for bloom_new_k(); the array takes size/2 bytes, four times
+ * as much as the plain filter. Powers of 2 make for the fastest probes.
+ *
+ ******************************************************************************/
+struct bloom_counting_t *bloom_counting_new(size_t size, size_t num_hashes)
+{
+        struct bloom_counting_t *bloom;
+
+        if (size == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        /* Allocate Bloom filter container */
+        if (!(bloom = malloc(sizeof(struct bloom_counting_t))))
+                return NULL;
+
+        /* Allocate counter array */
+        if (!(bloom->a = calloc(ROUND4(size), sizeof(uint64_t)))) {
+                free(bloom);
+                return NULL;
+        }
+
+        bloom->m     = size;
+        bloom->k     = num_hashes;
+        bloom->mask  = (size & (size - 1)) ? 0 : size - 1;
+        bloom->seed  = 0;
+        bloom->flags = 0;
+
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_counting_del  Delete a counting Bloom filter.
+ * ``````````````````
+ * @bloom : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_counting_del(struct bloom_counting_t *bloom)
+{
+        free(bloom->a);
+        free(bloom);
+}
+
+
+/******************************************************************************
+ * counter_update  Add one to, or take one from, counter n.
+ * ``````````````
+ * @bloom : counting Bloom filter
+ * @n     : counter to update
+ * @inc   : true to increment, false to decrement
+ * Returns: nothing.
+ *
+ * NOTES
+ * Saturated counters are left alone both ways, and so are zero counters
+ * on decrement. With BLOOM_CONCURRENT the word is updated with a
+ * compare-and-swap loop, so that updates to neighbouring counters by
+ * other threads are not lost.
+ *
+ ******************************************************************************/
+static inline uint64_t counter_next(uint64_t w, unsigned int shift, bool inc)
+{
+        uint64_t c = (w >> shift) & NIBBLE_MAX;
+
+        if (c == NIBBLE_MAX || (!inc && c == 0))
+                return w;
+
+        return inc ? w + (1ULL << shift) : w - (1ULL << shift);
+}
+
+static void counter_update(struct bloom_counting_t *bloom, size_t n, bool inc)
+{
+        uint64_t *w = &bloom->a[n / WORD_NIBBLES];
+        unsigned int shift = (n % WORD_NIBBLES) * NIBBLE_BITS;
+        uint64_t old, new;
+
+        if (!(bloom->flags & BLOOM_CONCURRENT)) {
+                *w = counter_next(*w, shift, inc);
+                return;
+        }
+
+        old = __atomic_load_n(w, __ATOMIC_RELAXED);
+        do {
+                if ((new = counter_next(old, shift, inc)) == old)
+                        return;
+        } while (!__atomic_compare_exchange_n(w, &old, new, true,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/******************************************************************************
+ * counter_get  Read counter n.
+ * ```````````
+ ******************************************************************************/
+static inline unsigned int counter_get(const struct bloom_counting_t *bloom, size_t n)
+{
+        return (__atomic_load_n(&bloom->a[n / WORD_NIBBLES], __ATOMIC_RELAXED)
+                >> ((n % WORD_NIBBLES) * NIBBLE_BITS)) & NIBBLE_MAX;
+}
+
+
+/******************************************************************************
+ * bloom_counting_add  Add a string to a counting Bloom filter.
+ * ``````````````````
+ * @bloom : counting Bloom filter
+ * @s     : string to add
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_counting_add(struct bloom_counting_t *bloom, const char *s)
+{
+        bloom_counting_add_buf(bloom, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_counting_add_buf  Add a key of known length to a counting filter.
+ * ``````````````````````
+ * @bloom : counting Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: nothing.
+ *
+ * NOTES
+ * Adding the same key twice counts it twice, and it then takes two
+ * removes to make it go away.
+ *
+ ******************************************************************************/
+void bloom_counting_add_buf(struct bloom_counting_t *bloom, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+        int n;
+
+        bloom_hash_pair(key, len, bloom->seed, &h1, &h2);
+
+        for (n=0; n<bloom->k; n++, h1+=h2)
+                counter_update(bloom, bloom_reduce64(h1, bloom->m, bloom->mask), true);
+}
+
+
+/******************************************************************************
+ * bloom_counting_check  Determine if a string is in a counting filter.
+ * ````````````````````
+ * @bloom : counting Bloom filter
+ * @s     : string to check
+ * Returns: false if string does not exist in the filter, otherwise true.
+ *
+ ******************************************************************************/
+bool bloom_counting_check(struct bloom_counting_t *bloom, const char *s)
+{
+        return bloom_counting_check_buf(bloom, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_counting_check_buf  Determine if a key of known length is present.
+ * ````````````````````````
+ * @bloom : counting Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: false if the key does not exist in the filter, otherwise true.
+ *
+ * NOTES
+ * There is no branch on the counters: (c + 15) >> 4 is 1 for a counter
+ * c in [1, 15] and 0 for c == 0, and these are and-ed together over all
+ * k counters. The k loads are independent of one another, so they are
+ * all in flight at once rather than each waiting on the test of the one
+ * before, which is what matters once the array is out of cache.
+ *
+ ******************************************************************************/
+bool bloom_counting_check_buf(struct bloom_counting_t *bloom, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+        unsigned int hit;
+        int n;
+
+        bloom_hash_pair(key, len, bloom->seed, &h1, &h2);
+
+        for (hit=1, n=0; n<bloom->k; n++, h1+=h2)
+                hit &= (counter_get(bloom, bloom_reduce64(h1, bloom->m, bloom->mask)) + NIBBLE_MAX) >> NIBBLE_BITS;
+
+        return hit;
+}
+
+
+/******************************************************************************
+ * bloom_remove  Remove a string from a counting Bloom filter.
+ * ````````````
+ * @bloom : counting Bloom filter
+ * @s     : string to remove
+ * Returns: true if the key was (possibly) present and has been removed,
+ *          false if it was certainly not in the filter.
+ *
+ ******************************************************************************/
+bool bloom_remove(struct bloom_counting_t *bloom, const char *s)
+{
+        return bloom_remove_buf(bloom, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_remove_buf  Remove a key of known length from a counting filter.
+ * ````````````````
+ * @bloom : counting Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: true if the key was (possibly) present and has been removed,
+ *          false if it was certainly not in the filter.
+ *
+ * NOTES
+ * A key for which some counter is already zero was never added, and is
+ * left alone: decrementing its other counters would take away from the
+ * keys which do share them.
+ *
+ * CAVEAT
+ * Only remove keys which were added. Removing a key which was not, but
+ * happens to check as present (a false positive), takes a count away
+ * from other keys and may make one of them disappear.
+ *
+ * With BLOOM_CONCURRENT each counter is updated atomically, but the
+ * check and the k decrements are not one atomic step: removing the same
+ * key from two threads at once, when it was added once, may decrement
+ * some counters twice.
+ *
+ ******************************************************************************/
+bool bloom_remove_buf(struct bloom_counting_t *bloom, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+        int n;
+
+        if (!bloom_counting_check_buf(bloom, key, len))
+                return false;
+
+        bloom_hash_pair(key, len, bloom->seed, &h1, &h2);
+
+        for (n=0; n<bloom->k; n++, h1+=h2)
+                counter_update(bloom, bloom_reduce64(h1, bloom->m, bloom->mask), false);
+
+        return true;
+}
+
+
+/******************************************************************************
+ * bloom_counting_flatten  Make the plain Bloom filter of a counting filter.
+ * ``````````````````````
+ * @bloom : counting Bloom filter
+ * Returns: An allocated single-hash bloom filter, as made by bloom_new_k()
+ *          with the same size, k and seed, with the bits of all non-zero
+ *          counters set; or NULL.
+ *
+ * NOTES
+ * Sixteen counters make 16 bits: the non-zero nibbles of a word are
+ * found all at once by or-ing each nibble's bits down into its low bit,
+ * then gathered four words at a time into one 64-bit word of the result.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_counting_flatten(struct bloom_counting_t *bloom)
+{
+        const uint64_t low = 0x1111111111111111ULL;
+        struct bloom_t *flat;
+        uint64_t w, bits;
+        size_t n;
+        int b;
+
+        if (!(flat = bloom_new_k(bloom->m, bloom->k)))
+                return NULL;
+
+        flat->seed = bloom->seed;
+
+        for (n=0; n<ROUND4(bloom->m); n++) {
+                w = __atomic_load_n(&bloom->a[n], __ATOMIC_RELAXED);
+                if (!w)
+                        continue;
+
+                w = (w | w >> 1 | w >> 2 | w >> 3) & low;
+
+                for (bits=0; w; w&=w-1) {
+                        b = __builtin_ctzll(w);
+                        bits |= 1ULL << (b / NIBBLE_BITS);
+                }
+                flat->a[n / 4] |= bits << (n % 4 * WORD_NIBBLES);
+        }
+
+        return flat;
+}
@@ -0,0 +1,244 @@
+/******************************************************************************
+ * engine.c
+ * ````````
+ * Filter engines behind one interface
+ *
+ * Which filter is best depends on the set: the classic filter takes adds
+ * forever, the blocked one answers with a single cache miss, and the fuse
+ * filter is the smallest and quickest of all but must be built from the
+ * whole set at once. A struct bloom_engine is the table of functions of
+ * one of them, and a struct bloom_filter pairs an engine with a filter of
+ * that kind, so that callers written against bloom_filter_*() switch
+ * engines by changing one argument to bloom_filter_build().
+ *
+ * NOTES
+ * The engines take the same key bytes, so a set can be built with each
+ * and the answers compared. The false positive rate 'p' given to a build
+ * is a target for the Bloom engines; the fuse filter always gives 1/256.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+/******************************************************************************
+ * Classic
+ ******************************************************************************/
+static void *classic_build(const void *const *keys, const size_t *lens, size_t n, double p)
+{
+        struct bloom_t *bloom;
+
+        if ((bloom = bloom_new_optimal(n, p)))
+                bloom_add_many(bloom, keys, lens, n);
+
+        return bloom;
+}
+
+static int classic_add(void *filter, const void *key, size_t len)
+{
+        return bloom_add_buf(filter, key, len);
+}
+
+static bool classic_check(void *filter, const void *key, size_t len)
+{
+        return bloom_check_buf(filter, key, len);
+}
+
+static size_t classic_bytes(const void *filter)
+{
+        return (((const struct bloom_t *)filter)->m + WORD_BIT - 1) / WORD_BIT * sizeof(uint64_t);
+}
+
+static void classic_del(void *filter)
+{
+        bloom_del(filter);
+}
+
+const struct bloom_engine bloom_engine_classic = {
+        "classic", classic_build, classic_add, classic_check, classic_bytes, classic_del
+};
+
+
+/******************************************************************************
+ * Blocked
+ *
+ * Sized by the classic formulas (see bloom_new_optimal()); blocking costs
+ * a little in false positive rate for the same m and k.
+ *
+ ******************************************************************************/
+static void *blocked_build(const void *const *keys, const size_t *lens, size_t n, double p)
+{
+        struct bloom_blocked_t *bloom;
+        double m, k;
+        size_t i;
+
+        if (!(p > 0.0 && p < 1.0))
+                return NULL;
+        if (n == 0)
+                n = 1;
+
+        m = ceil(-((double)n * log(p)) / (M_LN2 * M_LN2));
+        k = round((m / n) * M_LN2);
+        if (k < 1)
+                k = 1;
+
+        if ((bloom = bloom_blocked_new((size_t)m, (size_t)k))) {
+                for (i=0; i<n; i++)
+                        bloom_blocked_add_buf(bloom, keys[i], lens[i]);
+        }
+
+        return bloom;
+}
+
+static int blocked_add(void *filter, const void *key, size_t len)
+{
+        bloom_blocked_add_buf(filter, key, len);
+
+        return 0;
+}
+
+static bool blocked_check(void *filter, const void *key, size_t len)
+{
+        return bloom_blocked_check_buf(filter, key, len);
+}
+
+static size_t blocked_bytes(const void *filter)
+{
+        return ((const struct bloom_blocked_t *)filter)->m / 8;
+}
+
+static void blocked_del(void *filter)
+{
+        bloom_blocked_del(filter);
+}
+
+const struct bloom_engine bloom_engine_blocked = {
+        "blocked", blocked_build, blocked_add, blocked_check, blocked_bytes, blocked_del
+};
+
+
+/******************************************************************************
+ * Binary fuse
+ ******************************************************************************/
+static void *fuse_build(const void *const *keys, const size_t *lens, size_t n, double p)
+{
+        return bloom_fuse_build(keys, lens, n);
+}
+
+static bool fuse_check(void *filter, const void *key, size_t len)
+{
+        return bloom_fuse_check_buf(filter, key, len);
+}
+
+static size_t fuse_bytes(const void *filter)
+{
+        return ((const struct bloom_fuse_t *)filter)->size;
+}
+
+static void fuse_del(void *filter)
+{
+        bloom_fuse_del(filter);
+}
+
+const struct bloom_engine bloom_engine_fuse = {
+        "fuse", fuse_build, NULL, fuse_check, fuse_bytes, fuse_del
+};
+
+
+/******************************************************************************
+ * bloom_filter_build  Build a filter of any engine from a set of keys.
+ * ``````````````````
+ * @engine: e.g. &bloom_engine_fuse
+ * @keys  : the keys
+ * @lens  : their lengths in bytes
+ * @n     : number of keys
+ * @p     : target false positive rate, where the engine has a choice
+ * Returns: An allocated filter containing the keys, or NULL.
+ *
+ ******************************************************************************/
+struct bloom_filter *bloom_filter_build(const struct bloom_engine *engine,
+                                        const void *const *keys, const size_t *lens,
+                                        size_t n, double p)
+{
+        struct bloom_filter *f;
+
+        if (!(f = malloc(sizeof(struct bloom_filter))))
+                return NULL;
+
+        f->engine = engine;
+
+        if (!(f->impl = engine->build(keys, lens, n, p))) {
+                free(f);
+                return NULL;
+        }
+
+        return f;
+}
+
+
+/******************************************************************************
+ * bloom_filter_del  Delete a filter of any engine.
+ * ````````````````
+ * @f     : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_filter_del(struct bloom_filter *f)
+{
+        f->engine->del(f->impl);
+        free(f);
+}
+
+
+/******************************************************************************
+ * bloom_filter_add  Add a key to a filter of any engine.
+ * ````````````````
+ * @f     : filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: 0, or -1 with errno set to ENOTSUP if the engine is static, or
+ *          as the engine's add sets it (see bloom_add_buf()).
+ *
+ ******************************************************************************/
+int bloom_filter_add(struct bloom_filter *f, const void *key, size_t len)
+{
+        if (!f->engine->add) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        return f->engine->add(f->impl, key, len);
+}
+
+
+/******************************************************************************
+ * bloom_filter_check  Determine if a key is in a filter of any engine.
+ * ``````````````````
+ * @f     : filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: false if the key does not exist in the filter, otherwise true.
+ *
+ ******************************************************************************/
+bool bloom_filter_check(struct bloom_filter *f, const void *key, size_t len)
+{
+        return f->engine->check(f->impl, key, len);
+}
+
+
+/******************************************************************************
+ * bloom_filter_bytes  Size of the array of a filter of any engine.
+ * ``````````````````
+ * @f     : filter
+ * Returns: the number of bytes its bits (or fingerprints) take.
+ *
+ ******************************************************************************/
+size_t bloom_filter_bytes(const struct bloom_filter *f)
+{
+        return f->engine->bytes(f->impl);
+}
@@ -0,0 +1,536 @@
+/******************************************************************************
+ * file.c
+ * ``````
+ * Saving Bloom filters, and opening them again without a copy
+ *
+ * FORMAT
+ * A filter file is a header of BLOOM_FILE_HEADER bytes (one page) followed
+ * immediately by the raw bit array, exactly as it sits in memory:
+ *
+ *      offset  size  field
+ *      0       8     magic, "BLOOMFLT"
+ *      8       4     version, BLOOM_FILE_VERSION
+ *      12      4     hash id (BLOOM_HASH_*)
+ *      16      8     m, bits in the array
+ *      24      8     k
+ *      32      8     seed
+ *      40      4     layout (BLOOM_LAYOUT_*)
+ *      44      4     reserved, 0
+ *      48      8     parts (classic layout) or blocks (blocked layout)
+ *      56      8     bytes in the bit array that follows
+ *      64      8     checksum of the bit array, see bloom_file_checksum()
+ *      72      8     checksum of bytes [0, 72) of the header
+ *      80      -     zero up to BLOOM_FILE_HEADER
+ *
+ * All integers are little-endian, as is the bit array (it is an array of
+ * little-endian 64-bit words). In the compressed layout, the bit array is
+ * replaced by the payload of a struct bloom_compressed_t (see compress.c),
+ * and 'bytes' and the checksum are of that. Only single-hash mode filters can be saved:
+ * the function pointers of the other modes mean nothing to another
+ * process.
+ *
+ * NOTES
+ * Padding the header to a full page means the bit array of a mapped file
+ * starts on a page boundary. bloom_open_mmap() points bloom->a straight at
+ * it: loading is one mmap() whatever the size of the filter, the pages are
+ * read in on demand, and every process that maps the same file shares the
+ * same page cache pages.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define CHECKSUM_CHUNK (64*1024)
+
+_Static_assert(sizeof(struct bloom_file_header) == BLOOM_FILE_HEADER,
+               "the header must fill exactly one page");
+
+
+/******************************************************************************
+ * bloom_file_checksum  Checksum a bit array, or the next piece of one.
+ * ```````````````````
+ * @sum   : checksum of everything before 'p', 0 to begin with
+ * @p     : the bytes
+ * @len   : number of bytes
+ * @off   : offset of 'p' from the start of the bit array
+ * Returns: the checksum of everything up to and including 'p'.
+ *
+ * NOTES
+ * Each CHECKSUM_CHUNK-sized chunk is hashed on its own, seeded with its
+ * index, and the chunk hashes folded together. So a checksum can be built
+ * up piece by piece by a reader or writer streaming the array, as long as
+ * every piece but the last is a whole number of chunks.
+ *
+ ******************************************************************************/
+uint64_t bloom_file_checksum(uint64_t sum, const void *p, size_t len, uint64_t off)
+{
+        const unsigned char *c = p;
+        size_t n;
+
+        for (; len > 0; c += n, len -= n, off += n) {
+                n   = len < CHECKSUM_CHUNK ? len : CHECKSUM_CHUNK;
+                sum = wy_mix(sum ^ wy_hash(c, n, off / CHECKSUM_CHUNK),
+                             0x9e3779b97f4a7c15ULL);
+        }
+
+        return sum;
+}
+
+
+/******************************************************************************
+ * bloom_file_header_sum  Checksum the fixed fields of a header.
+ ******************************************************************************/
+static uint64_t bloom_file_header_sum(const struct bloom_file_header *h)
+{
+        return wy_hash(h, offsetof(struct bloom_file_header, hsum), 0);
+}
+
+
+/******************************************************************************
+ * bloom_file_header_init  Fill in a header for a bit array.
+ * ``````````````````````
+ * @h      : header (filled in)
+ * @layout : BLOOM_LAYOUT_*
+ * @m      : bits
+ * @k      : bit positions set per key
+ * @seed   : hash seed
+ * @parts  : parts (classic) or blocks (blocked)
+ * @a      : the bit array
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_file_header_init(struct bloom_file_header *h, uint32_t layout,
+                            uint64_t m, uint64_t k, uint64_t seed,
+                            uint64_t parts, const uint64_t *a)
+{
+        memset(h, 0, sizeof(*h));
+        memcpy(h->magic, BLOOM_FILE_MAGIC, sizeof(h->magic));
+
+        h->version = BLOOM_FILE_VERSION;
+        h->hash    = BLOOM_HASH_WY;
+        h->m       = m;
+        h->k       = k;
+        h->seed    = seed;
+        h->layout  = layout;
+        h->parts   = parts;
+        h->bytes   = (m + WORD_BIT - 1) / WORD_BIT * sizeof(uint64_t);
+        h->sum     = a ? bloom_file_checksum(0, a, h->bytes, 0) : 0;
+        h->hsum    = bloom_file_header_sum(h);
+}
+
+
+/******************************************************************************
+ * bloom_file_header_valid  Sanity check a header read back in.
+ * ```````````````````````
+ * @h     : header
+ * Returns: true if this is a header we can use, otherwise false (with
+ *          errno set).
+ *
+ * NOTES
+ * A k of 0 would answer every check true, and a k in the millions would
+ * spin every check for nothing; neither comes from a filter this library
+ * wrote, so both are taken as corruption (EINVAL), as a bad checksum is.
+ *
+ ******************************************************************************/
+bool bloom_file_header_valid(const struct bloom_file_header *h)
+{
+        if (memcmp(h->magic, BLOOM_FILE_MAGIC, sizeof(h->magic))
+         || h->hsum != bloom_file_header_sum(h)
+         || h->k == 0 || h->k > BLOOM_FILE_MAX_K) {
+                errno = EINVAL;
+                return false;
+        }
+
+        if (h->version != BLOOM_FILE_VERSION || h->hash != BLOOM_HASH_WY
+         || h->layout > BLOOM_LAYOUT_COMPRESSED || h->m == 0 || h->parts == 0
+         || (h->layout != BLOOM_LAYOUT_COMPRESSED
+          && h->bytes != (h->m + WORD_BIT - 1) / WORD_BIT * sizeof(uint64_t))) {
+                errno = ENOTSUP;
+                return false;
+        }
+
+        return true;
+}
+
+
+/******************************************************************************
+ * write_all  write(2), until done.
+ ******************************************************************************/
+static int write_all(int fd, const void *p, size_t len)
+{
+        const char *c = p;
+        ssize_t n;
+
+        while (len > 0) {
+                if ((n = write(fd, c, len)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                c   += n;
+                len -= n;
+        }
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * save  Write a header and bit array to a file, atomically.
+ * ````
+ * @path  : file to write
+ * @h     : header
+ * @a     : bit array of h->bytes bytes
+ * Returns: 0, or -1 with errno set.
+ *
+ * NOTES
+ * The file is written beside 'path' and renamed over it, so that a
+ * process which has the old file mapped keeps a consistent old filter
+ * (instead of taking SIGBUS when it's truncated under it), and one that
+ * opens 'path' gets either the old file or the new one, whole.
+ *
+ ******************************************************************************/
+static int save(const char *path, const struct bloom_file_header *h, const uint64_t *a)
+{
+        char tmp[4096];
+        int fd, err;
+
+        if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid()) >= sizeof(tmp)) {
+                errno = ENAMETOOLONG;
+                return -1;
+        }
+
+        if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0)
+                return -1;
+
+        if (write_all(fd, h, sizeof(*h)) || write_all(fd, a, h->bytes) || fsync(fd)) {
+                err = errno;
+                close(fd);
+                unlink(tmp);
+                errno = err;
+                return -1;
+        }
+
+        if (close(fd) || rename(tmp, path)) {
+                err = errno;
+                unlink(tmp);
+                errno = err;
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * map  Map a filter file and check its header.
+ * ```
+ * @path  : file to map
+ * @flags : BLOOM_OPEN_*
+ * @h     : copy of the header (filled in)
+ * Returns: the start of the mapping, or NULL with errno set.
+ *
+ ******************************************************************************/
+static void *map(const char *path, unsigned int flags, struct bloom_file_header *h)
+{
+        struct stat st;
+        void *base;
+        int fd, err;
+
+        if ((fd = open(path, O_RDONLY)) < 0)
+                return NULL;
+
+        if (fstat(fd, &st) || st.st_size < sizeof(*h)) {
+                err = st.st_size < sizeof(*h) ? EINVAL : errno;
+                close(fd);
+                errno = err;
+                return NULL;
+        }
+
+        if (flags & BLOOM_OPEN_WRITE)
+                base = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+        else
+                base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        err = errno;
+        close(fd);
+
+        if (base == MAP_FAILED) {
+                errno = err;
+                return NULL;
+        }
+
+        memcpy(h, base, sizeof(*h));
+
+        if (!bloom_file_header_valid(h) || st.st_size != sizeof(*h) + h->bytes) {
+                err = errno == ENOTSUP ? ENOTSUP : EINVAL;
+                munmap(base, st.st_size);
+                errno = err;
+                return NULL;
+        }
+
+        if ((flags & BLOOM_OPEN_VERIFY)
+         && bloom_file_checksum(0, (char *)base + sizeof(*h), h->bytes, 0) != h->sum) {
+                munmap(base, st.st_size);
+                errno = EIO;
+                return NULL;
+        }
+
+        return base;
+}
+
+
+/******************************************************************************
+ * bloom_file_unmap  Unmap the bit array of a filter from bloom_open_mmap().
+ * ````````````````
+ * @a     : the bit array
+ * @bytes : its size in bytes
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_file_unmap(uint64_t *a, size_t bytes)
+{
+        munmap((char *)a - BLOOM_FILE_HEADER, BLOOM_FILE_HEADER + bytes);
+}
+
+
+/******************************************************************************
+ * bloom_save  Save a Bloom filter to a file.
+ * ``````````
+ * @bloom : Bloom filter, in single-hash mode
+ * @path  : file to write; replaced atomically if it exists
+ * Returns: 0 on success, otherwise -1 with errno set.
+ *
+ ******************************************************************************/
+int bloom_save(struct bloom_t *bloom, const char *path)
+{
+        struct bloom_file_header h;
+
+        if (bloom->hash || bloom->hashlen) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        bloom_file_header_init(&h, BLOOM_LAYOUT_CLASSIC, bloom->m, bloom->k,
+                               bloom->seed, bloom->parts, bloom->a);
+
+        return save(path, &h, bloom->a);
+}
+
+
+/******************************************************************************
+ * bloom_open_mmap  Open a saved Bloom filter in place.
+ * ```````````````
+ * @path  : file written by bloom_save()
+ * @flags : any of
+ *          BLOOM_OPEN_VERIFY  check the checksum of the bit array first,
+ *                             which reads all of it
+ *          BLOOM_OPEN_WRITE   allow adds; the pages written to become
+ *                             private to this process (copy-on-write),
+ *                             the file itself is never modified
+ * Returns: a Bloom filter whose bit array is the mapped file, or NULL with
+ *          errno set. Release it with bloom_del() as usual.
+ *
+ * CAVEAT
+ * Without BLOOM_OPEN_WRITE the mapping is read-only, and an add will
+ * crash the process.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_open_mmap(const char *path, unsigned int flags)
+{
+        struct bloom_file_header h;
+        struct bloom_t *bloom;
+        char *base;
+        size_t pm;
+
+        if (!(base = map(path, flags, &h)))
+                return NULL;
+
+        if (h.layout != BLOOM_LAYOUT_CLASSIC || h.m % h.parts
+         || (h.parts > 1 && (h.m / h.parts) % WORD_BIT)) {
+                munmap(base, sizeof(h) + h.bytes);
+                errno = ENOTSUP;
+                return NULL;
+        }
+
+        if (!(bloom = malloc(sizeof(struct bloom_t)))) {
+                munmap(base, sizeof(h) + h.bytes);
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        pm = h.m / h.parts;
+
+        bloom->m       = h.m;
+        bloom->k       = h.k;
+        bloom->parts   = h.parts;
+        bloom->mask    = (pm & (pm - 1)) ? 0 : pm - 1;
+        bloom->seed    = h.seed;
+        bloom->flags   = 0;
+        bloom->own     = BLOOM_MAPPED;
+        bloom->a       = (uint64_t *)(base + sizeof(h));
+        bloom->dirty   = NULL;
+        bloom->hash    = NULL;
+        bloom->hashlen = NULL;
+        bloom->chunk   = NULL;
+        bloom->alloc   = NULL;
+        bloom->stats   = NULL;
+        bloom->touched = NULL;
+
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_blocked_save  Save a blocked Bloom filter to a file.
+ * ``````````````````
+ * As bloom_save().
+ *
+ ******************************************************************************/
+int bloom_blocked_save(struct bloom_blocked_t *bloom, const char *path)
+{
+        struct bloom_file_header h;
+
+        bloom_file_header_init(&h, BLOOM_LAYOUT_BLOCKED, bloom->m, bloom->k,
+                               bloom->seed, bloom->nblocks, bloom->a);
+
+        return save(path, &h, bloom->a);
+}
+
+
+/******************************************************************************
+ * bloom_blocked_open_mmap  Open a saved blocked Bloom filter in place.
+ * ```````````````````````
+ * As bloom_open_mmap(). Release the filter with bloom_blocked_del().
+ *
+ ******************************************************************************/
+struct bloom_blocked_t *bloom_blocked_open_mmap(const char *path, unsigned int flags)
+{
+        struct bloom_file_header h;
+        struct bloom_blocked_t *bloom;
+        char *base;
+
+        if (!(base = map(path, flags, &h)))
+                return NULL;
+
+        if (h.layout != BLOOM_LAYOUT_BLOCKED || h.m != h.parts * BLOOM_BLOCK_BITS) {
+                munmap(base, sizeof(h) + h.bytes);
+                errno = ENOTSUP;
+                return NULL;
+        }
+
+        if (!(bloom = malloc(sizeof(struct bloom_blocked_t)))) {
+                munmap(base, sizeof(h) + h.bytes);
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        bloom->m       = h.m;
+        bloom->k       = h.k;
+        bloom->nblocks = h.parts;
+        bloom->seed    = h.seed;
+        bloom->flags   = 0;
+        bloom->own     = BLOOM_MAPPED;
+        bloom->a       = (uint64_t *)(base + sizeof(h));
+
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_compressed_save  Save a compressed Bloom filter to a file.
+ * `````````````````````
+ * As bloom_save().
+ *
+ ******************************************************************************/
+int bloom_compressed_save(struct bloom_compressed_t *c, const char *path)
+{
+        struct bloom_file_header h;
+
+        bloom_file_header_init(&h, BLOOM_LAYOUT_COMPRESSED, c->m, c->k, c->seed,
+                               c->parts, NULL);
+
+        h.bytes = c->bytes;
+        h.sum   = bloom_file_checksum(0, c->payload, c->bytes, 0);
+        h.hsum  = bloom_file_header_sum(&h);
+
+        return save(path, &h, c->payload);
+}
+
+
+/******************************************************************************
+ * bloom_compressed_open_mmap  Open a saved compressed Bloom filter in place.
+ * ``````````````````````````
+ * As bloom_open_mmap(), without BLOOM_OPEN_WRITE (a compressed filter is
+ * read-only). Release the filter with bloom_compressed_del().
+ *
+ * NOTES
+ * The payload is checked to be the size its index says, and the index
+ * entries to be in order, each block within the data (see
+ * bloom_compressed_valid()): one pass over the index, a 64th of the size
+ * of the raw array. The data is not read until a lookup.
+ *
+ ******************************************************************************/
+struct bloom_compressed_t *bloom_compressed_open_mmap(const char *path, unsigned int flags)
+{
+        struct bloom_compressed_t *c;
+        struct bloom_file_header h;
+        const uint64_t *p;
+        size_t nblocks, words;
+        char *base;
+
+        if (!(base = map(path, flags & ~BLOOM_OPEN_WRITE, &h)))
+                return NULL;
+
+        p       = (const uint64_t *)(base + sizeof(h));
+        words   = h.bytes / sizeof(uint64_t);
+        nblocks = ((h.m + WORD_BIT - 1) / WORD_BIT * WORD_BIT + BLOOM_COMPRESSED_BLOCK - 1)
+                / BLOOM_COMPRESSED_BLOCK;
+
+        if (h.layout != BLOOM_LAYOUT_COMPRESSED || h.m % h.parts
+         || h.bytes % sizeof(uint64_t) || words < 2 + nblocks + 2
+         || p[0] != BLOOM_COMPRESSED_BLOCK || p[1] != nblocks
+         || words != 2 + nblocks + 1 + ((p[2 + nblocks] & ((1ULL << 56) - 1)) + WORD_BIT - 1) / WORD_BIT + 1) {
+                munmap(base, sizeof(h) + h.bytes);
+                errno = h.layout != BLOOM_LAYOUT_COMPRESSED ? ENOTSUP : EINVAL;
+                return NULL;
+        }
+
+        if (!(c = malloc(sizeof(struct bloom_compressed_t)))) {
+                munmap(base, sizeof(h) + h.bytes);
+                errno = ENOMEM;
+                return NULL;
+        }
+
+        c->m       = h.m;
+        c->k       = h.k;
+        c->parts   = h.parts;
+        c->mask    = ((h.m / h.parts) & (h.m / h.parts - 1)) ? 0 : h.m / h.parts - 1;
+        c->seed    = h.seed;
+        c->flags   = 0;
+        c->own     = BLOOM_MAPPED;
+        c->nblocks = nblocks;
+        c->payload = (uint64_t *)p;
+        c->index   = p + 2;
+        c->data    = p + 2 + nblocks + 1;
+        c->bytes   = h.bytes;
+
+        if (!bloom_compressed_valid(c)) {
+                munmap(base, sizeof(h) + h.bytes);
+                free(c);
+                errno = EINVAL;
+                return NULL;
+        }
+
+        return c;
+}
@@ -0,0 +1,402 @@
+/******************************************************************************
+ * fuse.c
+ * ``````
+ * Binary fuse filters
+ *
+ * HISTORY
+ * A Bloom filter needs 1.44 log2(1/e) bits per key for a false positive
+ * rate e, some 44% over the log2(1/e) lower bound. The xor filter (Graf
+ * and Lemire, "Xor Filters: Faster and Smaller Than Bloom and Cuckoo
+ * Filters") and its successor the binary fuse filter (Graf and Lemire,
+ * "Binary Fuse Filters: Fast and Smaller Than Xor Filters") get within a
+ * few percent of it, in exchange for being static: the whole key set is
+ * given at once, and nothing can be added afterwards.
+ *
+ * Every key maps to three slots of an array of 8-bit fingerprints, one
+ * in each of three consecutive segments of the array, and the array is
+ * solved so that the three slots xor to the fingerprint of the key. A
+ * lookup is those three loads and one compare. An absent key passes with
+ * probability 1/256, about 0.39%, at 9 bits per key for large sets (a
+ * Bloom filter needs 11.5 for the same rate).
+ *
+ * NOTES
+ * Construction "peels" the key set: a slot that only one key maps to can
+ * be assigned last, which frees up the other two slots of that key, and
+ * so on until no keys are left. The order found is then walked backwards
+ * to fill in fingerprints. Peeling succeeds with high probability for the
+ * array sizes used here; when it fails, the keys are re-mixed with a new
+ * seed and it starts over.
+ *
+ * Keys are hashed once, and the hashes sorted and made unique, so that
+ * duplicate keys (which can never be peeled) are harmless and every retry
+ * only costs a re-mix of each hash. A retry with another seed is then a
+ * bijection away from the previous hashes, and stays collision-free.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define FUSE_ARITY        3
+#define FUSE_MAX_SEGMENT  (1U << 18)
+#define FUSE_MAX_ATTEMPTS 100
+
+
+/******************************************************************************
+ * fuse_base  Hash a key to the 64-bit value the filter is built on.
+ * `````````
+ * The key is hashed with a fixed seed, and re-mixed with the seed of the
+ * filter; construction retries only need to redo the second step.
+ *
+ ******************************************************************************/
+static inline uint64_t fuse_base(const void *key, size_t len)
+{
+        return wy_hash(key, len, 0);
+}
+
+static inline uint64_t fuse_mix(uint64_t base, uint64_t seed)
+{
+        return fmix64(base + seed);
+}
+
+static inline uint8_t fuse_fingerprint(uint64_t h)
+{
+        return (uint8_t)(h ^ (h >> 32));
+}
+
+
+/******************************************************************************
+ * fuse_slots  Find the three slots of a hashed key.
+ * ``````````
+ * @fuse  : filter
+ * @h     : mixed hash of the key
+ * @slot  : the three slots, in consecutive segments
+ * Returns: nothing.
+ *
+ * NOTES
+ * The high bits of h pick the first segment and the offset in it; the
+ * offsets in the two segments after it are those xor-ed with two other
+ * fields of h, so all three come from one multiply.
+ *
+ ******************************************************************************/
+static inline void fuse_slots(const struct bloom_fuse_t *fuse, uint64_t h, uint32_t slot[3])
+{
+        uint32_t h0;
+
+        h0 = (uint32_t)(((unsigned __int128)h * fuse->seglen_count) >> 64);
+
+        slot[0] = h0;
+        slot[1] = (h0 + fuse->seglen) ^ ((uint32_t)(h >> 18) & (fuse->seglen - 1));
+        slot[2] = (h0 + 2*fuse->seglen) ^ ((uint32_t)h & (fuse->seglen - 1));
+}
+
+
+/******************************************************************************
+ * fuse_alloc  Allocate a filter with room for n distinct keys.
+ * ``````````
+ * @n     : number of keys
+ * Returns: An allocated, zero filled fuse filter, or NULL (with errno set
+ *          to EINVAL if n is too large for 32-bit slots).
+ *
+ * NOTES
+ * The segment length and the slack over n are the empirical choices of
+ * the paper for arity 3; small sets need relatively more room.
+ *
+ ******************************************************************************/
+static struct bloom_fuse_t *fuse_alloc(size_t n)
+{
+        struct bloom_fuse_t *fuse;
+        double factor, capacity;
+        size_t segcount;
+        uint32_t seglen;
+
+        if (n <= 1) {
+                seglen   = 4;
+                capacity = 0;
+        } else {
+                seglen = 1U << (int)floor(log((double)n) / log(3.33) + 2.25);
+                if (seglen > FUSE_MAX_SEGMENT)
+                        seglen = FUSE_MAX_SEGMENT;
+                factor   = fmax(1.125, 0.875 + 0.25 * log(1e6) / log((double)n));
+                capacity = round(n * factor);
+        }
+
+        /* Whole segments, at least one beyond the FUSE_ARITY-1 of overhang */
+        segcount = ((size_t)capacity + seglen - 1) / seglen;
+        segcount = segcount > FUSE_ARITY - 1 ? segcount - (FUSE_ARITY - 1) : 1;
+
+        if ((segcount + FUSE_ARITY - 1) * seglen > UINT32_MAX) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (!(fuse = malloc(sizeof(struct bloom_fuse_t))))
+                return NULL;
+
+        fuse->n            = n;
+        fuse->seed         = 0;
+        fuse->seglen       = seglen;
+        fuse->seglen_count = segcount * seglen;
+        fuse->segcount     = segcount;
+        fuse->size         = (segcount + FUSE_ARITY - 1) * seglen;
+
+        if (!(fuse->fp = calloc(fuse->size, 1))) {
+                free(fuse);
+                return NULL;
+        }
+
+        return fuse;
+}
+
+
+static int cmp64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a;
+        uint64_t y = *(const uint64_t *)b;
+
+        return (x > y) - (x < y);
+}
+
+
+/******************************************************************************
+ * fuse_peel  Find an order in which the slots of the keys can be assigned.
+ * `````````
+ * @fuse  : filter, sized for n keys
+ * @base  : distinct base hashes of the keys
+ * @n     : number of keys
+ * @stack : out, the mixed hashes of the keys in peeling order
+ * @which : out, which of its three slots each key in 'stack' gets
+ * @t     : scratch, fuse->size 64-bit words
+ * @count : scratch, fuse->size bytes
+ * @queue : scratch, fuse->size 32-bit words
+ * Returns: true if all n keys were peeled.
+ *
+ * NOTES
+ * For every slot, t[] holds the xor of the hashes of the keys mapped to
+ * it and count[] four times their number, plus in its low two bits the
+ * xor of which slot (0, 1 or 2) of each key it is. Once the count is 1,
+ * t[] is that one key's hash and the low bits say which of its slots
+ * this is: no list of keys per slot is ever needed.
+ *
+ * The keys are first bucketed by the first segment they map to, so the
+ * counting pass sweeps the array more or less in order rather than at
+ * random, which matters once it out-grows the cache.
+ *
+ ******************************************************************************/
+static bool fuse_peel(struct bloom_fuse_t *fuse, const uint64_t *base, size_t n,
+                      uint64_t *stack, uint8_t *which, uint64_t *t, uint8_t *count,
+                      uint32_t *queue)
+{
+        uint32_t slot[3], s, other;
+        size_t i, q, top, nbuckets, *start;
+        uint64_t h;
+        int bits, f, j;
+
+        memset(t, 0, fuse->size * sizeof(uint64_t));
+        memset(count, 0, fuse->size);
+
+        for (bits=0; (1ULL << bits) < fuse->segcount; bits++)
+                ;
+        nbuckets = 1ULL << bits;
+
+        if (!(start = malloc(nbuckets * sizeof(size_t))))
+                return false;
+
+        /* Bucket the mixed hashes by their top bits into 'stack' */
+        for (i=0; i<nbuckets; i++)
+                start[i] = (i * n) >> bits;
+        memset(stack, 0, n * sizeof(uint64_t));
+
+        for (i=0; i<n; i++) {
+                h = fuse_mix(base[i], fuse->seed);
+                j = bits ? h >> (64 - bits) : 0;
+                while (start[j] >= n || stack[start[j]] != 0)
+                        j = (j + 1) & (nbuckets - 1);
+                stack[start[j]++] = h;
+        }
+        free(start);
+
+        for (i=0; i<n; i++) {
+                fuse_slots(fuse, stack[i], slot);
+                for (f=0; f<3; f++) {
+                        t[slot[f]]     ^= stack[i];
+                        count[slot[f]] += 4;
+                        count[slot[f]] ^= f;
+                }
+        }
+
+        for (q=0, i=0; i<fuse->size; i++) {
+                if ((count[i] >> 2) == 1)
+                        queue[q++] = i;
+        }
+
+        for (top=0; q > 0; ) {
+                s = queue[--q];
+                if ((count[s] >> 2) != 1)
+                        continue;
+
+                h = t[s];
+                f = count[s] & 3;
+
+                stack[top] = h;
+                which[top] = f;
+                top++;
+
+                fuse_slots(fuse, h, slot);
+                for (j=1; j<3; j++) {
+                        other = slot[(f + j) % 3];
+                        if ((count[other] >> 2) == 2)
+                                queue[q++] = other;
+                        t[other]     ^= h;
+                        count[other] -= 4;
+                        count[other] ^= (f + j) % 3;
+                }
+        }
+
+        return top == n;
+}
+
+
+/******************************************************************************
+ * bloom_fuse_build  Build a binary fuse filter from a set of keys.
+ * ````````````````
+ * @keys  : the keys
+ * @lens  : their lengths in bytes
+ * @n     : number of keys
+ * Returns: An allocated fuse filter containing exactly the given keys, or
+ *          NULL.
+ *
+ * USAGE
+ * Duplicate keys are fine. The build needs about 32 bytes per key of
+ * scratch memory on top of the filter, and is expected to take one or
+ * two attempts.
+ *
+ ******************************************************************************/
+struct bloom_fuse_t *bloom_fuse_build(const void *const *keys, const size_t *lens, size_t n)
+{
+        struct bloom_fuse_t *fuse = NULL;
+        uint64_t *base, *stack = NULL, *t = NULL;
+        uint8_t *which = NULL, *count = NULL;
+        uint32_t *queue = NULL;
+        uint32_t slot[3];
+        uint64_t rng;
+        size_t i, u;
+        int attempt, f;
+
+        if (!(base = malloc((n ? n : 1) * sizeof(uint64_t))))
+                return NULL;
+
+        for (i=0; i<n; i++)
+                base[i] = fuse_base(keys[i], lens[i]);
+
+        /* Sort and drop duplicate hashes; they are the same key to us */
+        qsort(base, n, sizeof(uint64_t), cmp64);
+        for (u=0, i=0; i<n; i++) {
+                if (u == 0 || base[i] != base[u-1])
+                        base[u++] = base[i];
+        }
+        n = u;
+
+        if (!(fuse = fuse_alloc(n)))
+                goto done;
+
+        stack = malloc((n ? n : 1) * sizeof(uint64_t));
+        which = malloc(n ? n : 1);
+        t     = malloc(fuse->size * sizeof(uint64_t));
+        count = malloc(fuse->size);
+        queue = malloc(fuse->size * sizeof(uint32_t));
+
+        if (!stack || !which || !t || !count || !queue)
+                goto fail;
+
+        for (rng=0x726b2b9d438b9d4dULL, attempt=0; ; attempt++) {
+                if (attempt == FUSE_MAX_ATTEMPTS) {
+                        errno = EAGAIN;
+                        goto fail;
+                }
+
+                /* Seeds from a splitmix64 sequence */
+                rng       += 0x9e3779b97f4a7c15ULL;
+                fuse->seed = fmix64(rng);
+
+                if (fuse_peel(fuse, base, n, stack, which, t, count, queue))
+                        break;
+        }
+
+        /* Assign in reverse peeling order: the other two slots are final */
+        for (i=n; i-- > 0; ) {
+                fuse_slots(fuse, stack[i], slot);
+                f = which[i];
+                fuse->fp[slot[f]] = fuse_fingerprint(stack[i])
+                                  ^ fuse->fp[slot[(f + 1) % 3]]
+                                  ^ fuse->fp[slot[(f + 2) % 3]];
+        }
+
+        goto done;
+
+fail:
+        bloom_fuse_del(fuse);
+        fuse = NULL;
+
+done:
+        free(base);
+        free(stack);
+        free(which);
+        free(t);
+        free(count);
+        free(queue);
+
+        return fuse;
+}
+
+
+/******************************************************************************
+ * bloom_fuse_del  Delete a binary fuse filter.
+ * ``````````````
+ * @fuse  : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_fuse_del(struct bloom_fuse_t *fuse)
+{
+        if (!fuse)
+                return;
+
+        free(fuse->fp);
+        free(fuse);
+}
+
+
+/******************************************************************************
+ * bloom_fuse_check_buf  Determine if a key is in a binary fuse filter.
+ * ````````````````````
+ * @fuse  : fuse filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: false if the key is not in the filter, otherwise true.
+ *
+ * NOTES
+ * Exactly three loads from the array, independent of one another, and no
+ * branches on their values.
+ *
+ ******************************************************************************/
+bool bloom_fuse_check_buf(const struct bloom_fuse_t *fuse, const void *key, size_t len)
+{
+        uint32_t slot[3];
+        uint64_t h;
+
+        h = fuse_mix(fuse_base(key, len), fuse->seed);
+        fuse_slots(fuse, h, slot);
+
+        return (fuse_fingerprint(h) ^ fuse->fp[slot[0]] ^ fuse->fp[slot[1]] ^ fuse->fp[slot[2]]) == 0;
+}
+
+bool bloom_fuse_check(const struct bloom_fuse_t *fuse, const char *s)
+{
+        return bloom_fuse_check_buf(fuse, s, strlen(s));
+}
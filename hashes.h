@@ -1,3 +1,10 @@
+#ifndef _BLOOM_HASHES_H
+#define _BLOOM_HASHES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 /******************************************************************************
  * djb2_hash
  * `````````
@@ -157,3 +164,260 @@ static inline unsigned int fnv_hash(const char *str, unsigned int len)
         return hash;
 }
 
+
+
+/******************************************************************************
+ * fnv64_hash
+ * ``````````
+ * 64-bit FNV-1a, with a final avalanche step borrowed from MurmurHash3
+ * (fmix64) so that every output bit depends on every input bit.
+ *
+ * NOTE
+ * This was the hash behind the single-hash (double hashing) mode of the
+ * Bloom filter, before wy_hash() below. It is still a fine choice on
+ * machines without a fast wide multiply.
+ *
+ ******************************************************************************/
+static inline uint64_t fmix64(uint64_t h)
+{
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+
+        return h;
+}
+
+static inline uint64_t fnv64_hash(const char *str)
+{
+        #define FNV64_OFFSET 0xcbf29ce484222325ULL
+        #define FNV64_PRIME  0x100000001b3ULL
+        uint64_t hash;
+        unsigned int c;
+
+        hash = FNV64_OFFSET;
+
+        while ((c = (unsigned char)*str++)) {
+                hash ^= c;
+                hash *= FNV64_PRIME;
+        }
+
+        return fmix64(hash);
+}
+
+/******************************************************************************
+ * Length-aware variants
+ * `````````````````````
+ * The functions above all walk the key until they hit a '\0', so they
+ * cannot hash binary keys (packed integers, UUID bytes) or a key that is
+ * a view into some larger buffer. Each one has a *_len twin below that
+ * computes the same function over exactly 'len' bytes instead; for a
+ * NUL-terminated string 's', x_hash_len(s, strlen(s)) == x_hash(s) (up to
+ * the truncation to unsigned int).
+ *
+ * dek_hash() and fnv_hash() already take a length, but ignore it (dek
+ * only uses it as the seed), and existing callers pass them around as a
+ * one-argument hashfp_t, so their behaviour is left alone.
+ *
+ ******************************************************************************/
+static inline unsigned int djb2_hash_len(const void *key, size_t len)
+{
+        const unsigned char *p = (const unsigned char *)key;
+        unsigned long hash;
+
+        hash = 5381;
+
+        while (len--)
+                hash = ((hash << 5) + hash) + *p++; /* hash * 33 + c */
+
+        return hash;
+}
+
+static inline unsigned int sdbm_hash_len(const void *key, size_t len)
+{
+        const unsigned char *p = (const unsigned char *)key;
+        unsigned long hash;
+
+        hash = 0;
+
+        while (len--)
+                hash = *p++ + (hash << 6) + (hash << 16) - hash;
+
+        return hash;
+}
+
+static inline unsigned int kr_hash_len(const void *key, size_t len)
+{
+        const unsigned char *p = (const unsigned char *)key;
+        unsigned int hash;
+
+        hash = 0;
+
+        while (len--)
+                hash += *p++;
+
+        return hash;
+}
+
+static inline unsigned int sax_hash_len(const void *key, size_t len)
+{
+        const unsigned char *p = (const unsigned char *)key;
+        unsigned int h;
+
+        h = 0;
+
+        while (len--)
+                h^=(h<<5)+(h>>2)+*p++;
+
+        return h;
+}
+
+static inline unsigned int dek_hash_len(const void *key, size_t len)
+{
+        const char *p = (const char *)key;
+        unsigned int hash;
+
+        hash = len;
+
+        while (len--)
+                hash = ((hash << 5) ^ (hash >> 27)) ^ (unsigned int)*p++;
+
+        return hash;
+}
+
+static inline unsigned int fnv_hash_len(const void *key, size_t len)
+{
+        const char *p = (const char *)key;
+        unsigned int hash;
+
+        hash = 0;
+
+        while (len--) {
+                hash *= FNV_PRIME;
+                hash ^= (unsigned int)*p++;
+        }
+
+        return hash;
+}
+
+static inline uint64_t fnv64_hash_len(const void *key, size_t len)
+{
+        const unsigned char *p = (const unsigned char *)key;
+        uint64_t hash;
+
+        hash = FNV64_OFFSET;
+
+        while (len--) {
+                hash ^= *p++;
+                hash *= FNV64_PRIME;
+        }
+
+        return fmix64(hash);
+}
+
+/******************************************************************************
+ * wy_hash
+ * ```````
+ * HISTORY
+ * wyhash, by Wang Yi, public domain (this is the "final 4" revision). It
+ * belongs to the newer family of hashes (with xxh3 and friends) built for
+ * machines with a fast 64x64->128 multiply: the key is consumed 8 or 16
+ * bytes at a time rather than one, and each step folds the two halves of
+ * one wide product together, which mixes far better than the shift-and-
+ * add steps of the older functions above. It passes SMHasher, and every
+ * one of its 64 output bits is usable, which matters when the filter has
+ * more than 2^32 bits to cover.
+ *
+ * NOTES
+ * Keys of 16 bytes or less are read with at most four overlapping loads
+ * and no loop at all. Longer keys go 48 bytes per iteration, on three
+ * independent lanes. Reads assume a little-endian machine.
+ *
+ * This is the default hash of the single-hash mode (see bloom_new_k() in
+ * bloom.c), seeded with bloom->seed.
+ *
+ ******************************************************************************/
+static inline uint64_t wy_read8(const unsigned char *p)
+{
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+}
+
+static inline uint64_t wy_read4(const unsigned char *p)
+{
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+}
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b)
+{
+        unsigned __int128 r = (unsigned __int128)a * b;
+
+        return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wy_hash(const void *key, size_t len, uint64_t seed)
+{
+        static const uint64_t secret[4] = {
+                0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+                0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+        };
+        const unsigned char *p = (const unsigned char *)key;
+        unsigned __int128 r;
+        uint64_t a, b, see1, see2;
+        size_t i;
+
+        seed ^= wy_mix(seed ^ secret[0], secret[1]);
+
+        if (len <= 16) {
+                if (len >= 4) {
+                        a = (wy_read4(p) << 32) | wy_read4(p + ((len >> 3) << 2));
+                        b = (wy_read4(p + len - 4) << 32)
+                          | wy_read4(p + len - 4 - ((len >> 3) << 2));
+                } else if (len > 0) {
+                        a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+                        b = 0;
+                } else {
+                        a = b = 0;
+                }
+        } else {
+                i = len;
+                if (i >= 48) {
+                        see1 = see2 = seed;
+                        do {
+                                seed = wy_mix(wy_read8(p)      ^ secret[1], wy_read8(p + 8)  ^ seed);
+                                see1 = wy_mix(wy_read8(p + 16) ^ secret[2], wy_read8(p + 24) ^ see1);
+                                see2 = wy_mix(wy_read8(p + 32) ^ secret[3], wy_read8(p + 40) ^ see2);
+                                p += 48;
+                                i -= 48;
+                        } while (i >= 48);
+                        seed ^= see1 ^ see2;
+                }
+                while (i > 16) {
+                        seed = wy_mix(wy_read8(p) ^ secret[1], wy_read8(p + 8) ^ seed);
+                        i -= 16;
+                        p += 16;
+                }
+                a = wy_read8(p + i - 16);
+                b = wy_read8(p + i - 8);
+        }
+
+        a ^= secret[1];
+        b ^= seed;
+        r  = (unsigned __int128)a * b;
+        a  = (uint64_t)r;
+        b  = (uint64_t)(r >> 64);
+
+        return wy_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+/* For use where a hashlenfp_t is wanted; the low 32 bits, seed 0 */
+static inline unsigned int wy_hash_len(const void *key, size_t len)
+{
+        return (unsigned int)wy_hash(key, len, 0);
+}
+
+#endif
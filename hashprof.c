@@ -0,0 +1,466 @@
+/******************************************************************************
+ * hashprof.c
+ * ``````````
+ * Hash function profiler
+ *
+ * The false positive rate of bloom.c's formulas assumes the k hash
+ * functions are uniform and independent of each other. This runs a
+ * corpus of keys through the hash functions of hashes.h and measures
+ * how far each one, and each pair of a chosen set of k, is from that:
+ *
+ *      uniformity              chi-squared of the keys over 2^b buckets,
+ *                              by the low bits (which is what a power of
+ *                              2 sized filter uses) and by the high bits
+ *                              (Lemire reduction, every other size)
+ *      avalanche               how often flipping one key bit flips each
+ *                              bit of the hash, which should be half the
+ *                              time; the worst and the mean bias
+ *      speed                   bytes hashed per cycle
+ *      pairwise independence   per pair of the set, chi-squared of their
+ *                              joint buckets, the correlation of their
+ *                              values, and how often they pick the same
+ *                              bit, relative to chance
+ *      false positive rate     of a filter over the set, against the
+ *                              formula and against single-hash mode
+ *
+ * Chi-squared is reported as a z-score: (X^2 - df) / sqrt(2 df), which
+ * for a uniform hash is within a few units of 0. Tens or hundreds mean
+ * the buckets are lumpy, for this corpus.
+ *
+ * USAGE
+ *      bloom_hashprof [-f corpus] [-n keys] [-H hashes] [-k set] [-b bits]
+ *
+ * The corpus is a file of keys, one per line, or else n generated keys
+ * "key0", "key1", ... which are a hard case for weak functions. Hashes
+ * and the set are comma separated names (see HASHES below); the set
+ * defaults to the one test.c used to be built with.
+ *
+ * CAVEAT
+ * The false positive rate adds the first half of the corpus and checks
+ * the second half, so duplicate lines in a corpus file count as false
+ * positives.
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bloom.h"
+#include "hashes.h"
+
+
+#define MAX_SET      8
+#define AVAL_KEYS    2000       /* keys sampled for avalanche */
+#define AVAL_BITS    256        /* key bits flipped, at most */
+#define SPEED_BYTES  (64UL << 20)
+#define PAIR_BITS    8          /* joint buckets of 2^8 x 2^8 */
+
+
+static unsigned int fnv64_lo(const void *key, size_t len)
+{
+        return (unsigned int)fnv64_hash_len(key, len);
+}
+
+static const struct {
+        const char *name;
+        hashlenfp_t fn;
+} HASHES[] = {
+        { "djb2",  djb2_hash_len },
+        { "sdbm",  sdbm_hash_len },
+        { "kr",    kr_hash_len   },
+        { "sax",   sax_hash_len  },
+        { "dek",   dek_hash_len  },
+        { "fnv",   fnv_hash_len  },
+        { "fnv64", fnv64_lo      },     /* low 32 bits */
+        { "wy",    wy_hash_len   },
+};
+
+#define NHASHES (sizeof(HASHES) / sizeof(HASHES[0]))
+
+
+struct corpus {
+        char *buf;
+        const void **key;
+        size_t *len;
+        size_t n;
+        size_t bytes;
+};
+
+
+static int hash_index(const char *name)
+{
+        int i;
+
+        for (i=0; i<NHASHES; i++) {
+                if (strcmp(HASHES[i].name, name) == 0)
+                        return i;
+        }
+
+        fprintf(stderr, "unknown hash '%s'\n", name);
+        exit(1);
+}
+
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;  /* ns, not cycles */
+#endif
+}
+
+
+/******************************************************************************
+ * corpus_load  Read a file of keys, one per line, or generate n keys.
+ * ```````````
+ * @c     : corpus (filled in)
+ * @path  : file, or NULL to generate
+ * @n     : number of keys to generate
+ * Returns: 0, or -1 if the file can't be read or holds no keys.
+ *
+ ******************************************************************************/
+static int corpus_load(struct corpus *c, const char *path, size_t n)
+{
+        size_t size, i, start;
+        FILE *f;
+
+        if (path) {
+                if (!(f = fopen(path, "rb")))
+                        return -1;
+                fseek(f, 0, SEEK_END);
+                size = ftell(f);
+                fseek(f, 0, SEEK_SET);
+                if (!(c->buf = malloc(size + 1)) || fread(c->buf, 1, size, f) != size) {
+                        fclose(f);
+                        return -1;
+                }
+                fclose(f);
+                c->buf[size] = '\n';
+
+                for (n=0, i=0; i<=size; i++)
+                        n += c->buf[i] == '\n';
+        } else {
+                if (!(c->buf = malloc(n * 24)))
+                        return -1;
+                for (size=0, i=0; i<n; i++)
+                        size += sprintf(c->buf + size, "key%zu\n", i);
+                size--;
+        }
+
+        c->key = malloc(n * sizeof(void *));
+        c->len = malloc(n * sizeof(size_t));
+        if (!c->key || !c->len)
+                return -1;
+
+        /* Splitting on '\n'; empty lines are skipped */
+        for (c->n=0, c->bytes=0, start=0, i=0; i<=size; i++) {
+                if (c->buf[i] != '\n')
+                        continue;
+                if (i > start) {
+                        c->key[c->n]   = c->buf + start;
+                        c->len[c->n++] = i - start;
+                        c->bytes      += i - start;
+                }
+                start = i + 1;
+        }
+
+        return c->n ? 0 : -1;
+}
+
+
+/* (X^2 - df) / sqrt(2 df) of counts against a uniform n/nb each */
+static double chi2_z(const uint32_t *count, size_t nb, size_t n)
+{
+        double e = (double)n / nb, x2 = 0, d;
+        size_t i;
+
+        for (i=0; i<nb; i++) {
+                d   = count[i] - e;
+                x2 += d * d / e;
+        }
+
+        return (x2 - (nb - 1)) / sqrt(2.0 * (nb - 1));
+}
+
+
+static void uniformity(hashlenfp_t fn, const struct corpus *c, int bits,
+                       double *lo, double *hi)
+{
+        size_t nb = 1UL << bits, i;
+        uint32_t *cl, *ch;
+        unsigned int h;
+
+        cl = calloc(nb, sizeof(uint32_t));
+        ch = calloc(nb, sizeof(uint32_t));
+        if (!cl || !ch) {
+                perror("calloc");
+                exit(1);
+        }
+
+        for (i=0; i<c->n; i++) {
+                h = fn(c->key[i], c->len[i]);
+                cl[h & (nb - 1)]++;
+                ch[h >> (32 - bits)]++;
+        }
+
+        *lo = chi2_z(cl, nb, c->n);
+        *hi = chi2_z(ch, nb, c->n);
+
+        free(cl);
+        free(ch);
+}
+
+
+/******************************************************************************
+ * avalanche  Measure the strict avalanche bias of a hash function.
+ * `````````
+ * @fn    : hash function
+ * @c     : corpus, of which up to AVAL_KEYS keys are used
+ * @worst : out, largest |2p - 1| over all (key bit, hash bit) pairs
+ * @mean  : out, mean |2p - 1|
+ * Returns: nothing.
+ *
+ * NOTES
+ * p is the fraction of keys for which flipping the key bit flips the
+ * hash bit. With s samples of a perfect hash |2p - 1| is about
+ * 0.8/sqrt(s) anyway, so compare functions on the same corpus.
+ *
+ ******************************************************************************/
+static void avalanche(hashlenfp_t fn, const struct corpus *c, double *worst, double *mean)
+{
+        static uint32_t flips[AVAL_BITS][32];
+        static uint32_t samples[AVAL_BITS];
+        unsigned char key[AVAL_BITS / 8];
+        size_t i, len, step, nb, cells;
+        unsigned int h, x;
+        double b, sum;
+        int bit, j;
+
+        memset(flips, 0, sizeof(flips));
+        memset(samples, 0, sizeof(samples));
+
+        step = c->n > AVAL_KEYS ? c->n / AVAL_KEYS : 1;
+
+        for (i=0; i<c->n; i+=step) {
+                len = c->len[i] < sizeof(key) ? c->len[i] : sizeof(key);
+                memcpy(key, c->key[i], len);
+                h = fn(key, len);
+
+                for (bit=0; bit<len*8; bit++) {
+                        key[bit / 8] ^= 1 << (bit % 8);
+                        x = h ^ fn(key, len);
+                        key[bit / 8] ^= 1 << (bit % 8);
+
+                        samples[bit]++;
+                        for (j=0; j<32; j++)
+                                flips[bit][j] += (x >> j) & 1;
+                }
+        }
+
+        for (*worst=0, sum=0, cells=0, nb=0; nb<AVAL_BITS; nb++) {
+                if (!samples[nb])
+                        continue;
+                for (j=0; j<32; j++, cells++) {
+                        b    = fabs(2.0 * flips[nb][j] / samples[nb] - 1);
+                        sum += b;
+                        if (b > *worst)
+                                *worst = b;
+                }
+        }
+
+        *mean = cells ? sum / cells : 0;
+}
+
+
+static double speed(hashlenfp_t fn, const struct corpus *c)
+{
+        volatile unsigned int sink;
+        unsigned int acc = 0;
+        uint64_t t0, t1;
+        size_t done, i;
+
+        /* Once to warm up, then timed over at least SPEED_BYTES */
+        for (i=0; i<c->n; i++)
+                acc += fn(c->key[i], c->len[i]);
+
+        t0 = cycles();
+        for (done=0; done<SPEED_BYTES; done+=c->bytes) {
+                for (i=0; i<c->n; i++)
+                        acc += fn(c->key[i], c->len[i]);
+        }
+        t1 = cycles();
+
+        sink = acc;
+        (void)sink;
+
+        return t1 > t0 ? (double)done / (t1 - t0) : 0;
+}
+
+
+/******************************************************************************
+ * pairwise  Measure the dependence of two hash functions.
+ * ````````
+ * @fa, @fb : hash functions
+ * @c       : corpus
+ * @z       : out, chi-squared z of their joint low-bit buckets
+ * @r       : out, correlation coefficient of their values
+ * @same    : out, how often they map a key to the same one of 2^bits
+ *            buckets, as a multiple of chance (1 for independent ones)
+ * Returns: nothing.
+ *
+ * NOTES
+ * Two functions that are each uniform can still be dependent: if they
+ * tend to pick the same bit, or bits that move together, a key really
+ * sets fewer than k distinct bits, and another is likelier to find them
+ * all set. That is where the FPR above the formula comes from.
+ *
+ ******************************************************************************/
+static void pairwise(hashlenfp_t fa, hashlenfp_t fb, const struct corpus *c, int bits,
+                     double *z, double *r, double *same)
+{
+        static uint32_t joint[1 << (2 * PAIR_BITS)];
+        double sa=0, sb=0, saa=0, sbb=0, sab=0, x, y, n = c->n;
+        unsigned int ha, hb, mask = (1U << bits) - 1;
+        size_t hits, i;
+
+        memset(joint, 0, sizeof(joint));
+
+        for (hits=0, i=0; i<c->n; i++) {
+                ha = fa(c->key[i], c->len[i]);
+                hb = fb(c->key[i], c->len[i]);
+
+                joint[(ha & ((1 << PAIR_BITS) - 1)) << PAIR_BITS | (hb & ((1 << PAIR_BITS) - 1))]++;
+                hits += (ha & mask) == (hb & mask);
+
+                x = ha;
+                y = hb;
+                sa += x; sb += y; saa += x*x; sbb += y*y; sab += x*y;
+        }
+
+        *z    = chi2_z(joint, 1 << (2 * PAIR_BITS), c->n);
+        *r    = (n*sab - sa*sb) / sqrt((n*saa - sa*sa) * (n*sbb - sb*sb));
+        *same = (double)hits / c->n * (mask + 1.0);
+}
+
+
+/******************************************************************************
+ * fpr  Measure the false positive rate of a filter over a set of hashes.
+ * ```
+ * @bloom : empty filter
+ * @c     : corpus; the first half is added, the second half checked
+ * Returns: the fraction of the second half found.
+ *
+ ******************************************************************************/
+static double fpr(struct bloom_t *bloom, const struct corpus *c)
+{
+        size_t half = c->n / 2, fp, i;
+
+        if (!bloom)
+                return NAN;
+
+        for (i=0; i<half; i++)
+                bloom_add_buf(bloom, c->key[i], c->len[i]);
+        for (fp=0, i=half; i<c->n; i++)
+                fp += bloom_check_buf(bloom, c->key[i], c->len[i]);
+
+        bloom_del(bloom);
+
+        return (double)fp / (c->n - half);
+}
+
+
+int main(int argc, char *argv[])
+{
+        char def_hashes[] = "djb2,sdbm,kr,sax,dek,fnv,fnv64,wy";
+        char def_set[]    = "fnv,sax,sdbm,djb2";
+        char *path = NULL, *hashes = def_hashes, *set = def_set, *name;
+        int bits = 16, opt, i, j, hi, nset = 0, sel[MAX_SET];
+        double lo, hb, worst, mean, z, r, same, m, theory;
+        hashlenfp_t f[MAX_SET];
+        struct corpus c;
+        size_t n = 1000000;
+
+        while ((opt = getopt(argc, argv, "f:n:H:k:b:")) != -1) {
+                switch (opt) {
+                case 'f': path   = optarg; break;
+                case 'n': n      = strtoul(optarg, NULL, 10); break;
+                case 'H': hashes = optarg; break;
+                case 'k': set    = optarg; break;
+                case 'b': bits   = atoi(optarg); break;
+                default:
+                        fprintf(stderr, "usage: %s [-f corpus] [-n keys] [-H hashes] "
+                                "[-k set] [-b bucket bits]\n", argv[0]);
+                        return 1;
+                }
+        }
+
+        if (bits < PAIR_BITS || bits > 24) {
+                fprintf(stderr, "bucket bits must be %d to 24\n", PAIR_BITS);
+                return 1;
+        }
+
+        if (corpus_load(&c, path, n) != 0) {
+                fprintf(stderr, "no keys in %s\n", path ? path : "corpus");
+                return 1;
+        }
+
+        printf("corpus: %zu keys, %zu bytes, %s\n\n", c.n, c.bytes, path ? path : "generated");
+
+        printf("%-6s %10s %10s %10s %10s %8s\n", "hash", "chi2 lo z", "chi2 hi z",
+               "aval max", "aval mean",
+#if defined(__x86_64__) || defined(__i386__)
+               "B/cycle"
+#else
+               "B/ns"
+#endif
+               );
+
+        for (name=strtok(hashes, ","); name; name=strtok(NULL, ",")) {
+                hi = hash_index(name);
+
+                uniformity(HASHES[hi].fn, &c, bits, &lo, &hb);
+                avalanche(HASHES[hi].fn, &c, &worst, &mean);
+
+                printf("%-6s %10.1f %10.1f %10.3f %10.3f %8.2f\n", HASHES[hi].name, lo, hb,
+                       worst, mean, speed(HASHES[hi].fn, &c));
+        }
+
+        for (name=strtok(set, ","); name && nset<MAX_SET; name=strtok(NULL, ","))
+                sel[nset++] = hash_index(name);
+
+        if (nset < 1 || c.n < 2)
+                return 0;
+
+        printf("\n%-13s %10s %10s %10s\n", "pair", "joint z", "corr", "same bit");
+
+        for (i=0; i<nset; i++) {
+                for (j=i+1; j<nset; j++) {
+                        pairwise(HASHES[sel[i]].fn, HASHES[sel[j]].fn, &c, bits, &z, &r, &same);
+                        printf("%-6s %-6s %10.1f %10.4f %10.2f\n", HASHES[sel[i]].name,
+                               HASHES[sel[j]].name, z, r, same);
+                }
+        }
+
+        /* 10 bits per added key, the filter of the set against single-hash mode */
+        for (i=0; i<MAX_SET; i++)
+                f[i] = HASHES[sel[i % nset]].fn;
+
+        m      = 10.0 * (c.n / 2);
+        theory = pow(1 - exp(-(double)nset * (c.n / 2) / m), nset);
+
+        printf("\nfalse positives at 10 bits/key, k=%d: set %.5f, single-hash %.5f, formula %.5f\n",
+               nset,
+               fpr(bloom_new_len((size_t)m, nset, f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7]), &c),
+               fpr(bloom_new_k((size_t)m, nset), &c), theory);
+
+        return 0;
+}
@@ -0,0 +1,147 @@
+/******************************************************************************
+ * hpp.cpp
+ * ```````
+ * Checks of bloom.hpp against the C library
+ *
+ * A filter saved by bloom_save() is loaded into a bloom::filter, and one
+ * saved by a bloom::filter opened with bloom_open_mmap(), for each layout;
+ * each side must find every key the other added, and see the same bits.
+ *
+ * USAGE
+ *      make hpp
+ *
+ ******************************************************************************/
+
+#include <cstdio>
+#include <cstring>
+
+#include "bloom.hpp"
+
+
+#define NKEYS 5000
+
+static int failed;
+
+#define CHECK(cond) do {                                                \
+        if (!(cond)) {                                                  \
+                fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__,     \
+                        #cond);                                         \
+                failed++;                                               \
+        }                                                               \
+} while (0)
+
+
+static char path[] = "/tmp/bloom_hpp_XXXXXX";        /* see main() */
+
+static void key(char *buf, size_t size, int i)
+{
+        snprintf(buf, size, "key%d", i);
+}
+
+
+static void check_classic(void)
+{
+        bloom::filter<7> f(1 << 16, 42);
+        struct bloom_t *b;
+        char s[32];
+        int i, miss;
+
+        /* C to C++ */
+        b = bloom_new_k(1 << 16, 7);
+        b->seed = 42;
+        for (i=0; i<NKEYS; i++) {
+                key(s, sizeof(s), i);
+                bloom_add(b, s);
+        }
+        CHECK(bloom_save(b, path) == 0);
+        CHECK(f.load(path) == 0);
+        CHECK(memcmp(f.data(), b->a, f.bytes()) == 0);
+        for (miss=0, i=0; i<NKEYS; i++) {
+                key(s, sizeof(s), i);
+                miss += !f.check(s);
+        }
+        CHECK(miss == 0);
+        bloom_del(b);
+
+        /* C++ to C */
+        for (i=NKEYS; i<2*NKEYS; i++) {
+                key(s, sizeof(s), i);
+                f.add(s);
+        }
+        CHECK(f.save(path) == 0);
+        CHECK((b = bloom_open_mmap(path, BLOOM_OPEN_VERIFY)) != NULL);
+        if (b) {
+                CHECK(memcmp(f.data(), b->a, f.bytes()) == 0);
+                for (miss=0, i=0; i<2*NKEYS; i++) {
+                        key(s, sizeof(s), i);
+                        miss += !bloom_check(b, s);
+                }
+                CHECK(miss == 0);
+                bloom_del(b);
+        }
+}
+
+
+static void check_blocked(void)
+{
+        bloom::filter<8, bloom::wyhash, bloom::blocked> f(1 << 16);
+        struct bloom_blocked_t *b;
+        char s[32];
+        int i, miss;
+
+        b = bloom_blocked_new(1 << 16, 8);
+        for (i=0; i<NKEYS; i++) {
+                key(s, sizeof(s), i);
+                bloom_blocked_add(b, s);
+        }
+        CHECK(bloom_blocked_save(b, path) == 0);
+        CHECK(f.load(path) == 0);
+        CHECK(memcmp(f.data(), b->a, f.bytes()) == 0);
+        for (miss=0, i=0; i<NKEYS; i++) {
+                key(s, sizeof(s), i);
+                miss += !f.check(s);
+        }
+        CHECK(miss == 0);
+        bloom_blocked_del(b);
+
+        for (i=NKEYS; i<2*NKEYS; i++) {
+                key(s, sizeof(s), i);
+                f.add(s);
+        }
+        CHECK(f.save(path) == 0);
+        CHECK((b = bloom_blocked_open_mmap(path, BLOOM_OPEN_VERIFY)) != NULL);
+        if (b) {
+                for (miss=0, i=0; i<2*NKEYS; i++) {
+                        key(s, sizeof(s), i);
+                        miss += !bloom_blocked_check(b, s);
+                }
+                CHECK(miss == 0);
+                bloom_blocked_del(b);
+        }
+}
+
+
+int main(void)
+{
+        bloom::filter<7> f(1 << 10);
+        int fd;
+
+        /* A name of our own, so that runs side by side don't collide */
+        if ((fd = mkstemp(path)) < 0) {
+                perror("mkstemp");
+                return 1;
+        }
+        close(fd);
+
+        check_classic();
+        check_blocked();
+
+        /* The blocked file left behind has another layout and k */
+        CHECK(f.load(path) == -1 && errno == ENOTSUP);
+
+        unlink(path);
+
+        printf("%s: bloom.hpp, %d failed\n", failed ? "FAIL" : "ok", failed);
+
+        return failed ? 1 : 0;
+}
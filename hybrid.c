@@ -0,0 +1,240 @@
+/******************************************************************************
+ * hybrid.c
+ * ````````
+ * Exact membership behind a blocked Bloom filter
+ *
+ * Where a maybe is not good enough, the usual answer is a Bloom filter in
+ * front of a hash table: the filter turns away most of the keys that are
+ * not there, and the table settles the rest. The table is typically
+ * somewhere else entirely, so each positive costs a second cache miss
+ * (and a TLB miss, the table being large) on top of that of the filter.
+ *
+ * Here both live in one array. It is cut into units, each holding one
+ * block of a blocked filter (see blocked.c) and then 'lines' cache lines
+ * of a table of the 64-bit fingerprints of the keys that block holds:
+ *
+ *      | block 0 | line 0 | line 1 | block 1 | line 2 | line 3 | ...
+ *
+ * A key's block is chosen by h1, as in the blocked filter, and its home
+ * line is one of the lines of that same unit, picked with other bits of
+ * h1. The table is open addressing with linear probing by lines, eight
+ * fingerprints each: a key whose home line is full goes in the next line,
+ * which is past the end of the unit only once all its lines are full.
+ *
+ * So a negative is decided by the one block, as in a blocked filter, and
+ * a positive by one more line, a few hundred bytes from the block, on the
+ * same page.
+ *
+ * NOTES
+ * The answers are exact up to collisions of the 64-bit fingerprint (h1
+ * of bloom_hash_pair()): with n keys stored, a key not among them is
+ * taken for one of them with probability about n/2^64. Fingerprint 0
+ * marks an empty slot, so a key hashing to 0 is stored as 1.
+ *
+ * There is no removal, and adds are not safe alongside other adds or
+ * lookups; lookups are, alongside other lookups.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define BLOCK_WORDS (BLOOM_BLOCK_BITS / 64)
+#define LINE_SLOTS  8           /* fingerprints per cache line */
+#define HYBRID_LOAD 0.75        /* of the table, at the capacity asked for */
+
+
+/* The words of global table line l */
+static inline uint64_t *hybrid_line(const struct bloom_hybrid_t *h, size_t l)
+{
+        return h->a + ((l / h->lines) * (1 + h->lines) + 1 + l % h->lines) * BLOCK_WORDS;
+}
+
+
+/* The home line of a key in block b */
+static inline size_t hybrid_home(const struct bloom_hybrid_t *h, size_t b, uint64_t h1)
+{
+        return b * h->lines + (size_t)(((h1 & 0xffffffff) * h->lines) >> 32);
+}
+
+
+/******************************************************************************
+ * bloom_hybrid_new  Allocate and return a new, empty hybrid filter.
+ * ````````````````
+ * @n     : the number of keys it is to hold
+ * @p     : the false positive rate of its filter, 0 < p < 1
+ * Returns: An allocated hybrid filter, or NULL (errno EINVAL for a bad p).
+ *
+ * NOTES
+ * The filter is sized as the blocked engine's (see engine.c) for n and
+ * p; p only decides how many of the keys that are not there get past the
+ * filter to the table, not the answers. The table is given lines enough
+ * per block for n keys to fill it to HYBRID_LOAD, and takes keys until
+ * 1/16 of its slots are left, when bloom_hybrid_add() gives up.
+ *
+ ******************************************************************************/
+struct bloom_hybrid_t *bloom_hybrid_new(size_t n, double p)
+{
+        struct bloom_hybrid_t *h;
+        size_t nblocks, lines, bytes;
+        double m, k;
+
+        if (!(p > 0.0 && p < 1.0)) {
+                errno = EINVAL;
+                return NULL;
+        }
+        if (n == 0)
+                n = 1;
+
+        m = ceil(-((double)n * log(p)) / (M_LN2 * M_LN2));
+        k = round((m / n) * M_LN2);
+        if (k < 1)
+                k = 1;
+
+        nblocks = ((size_t)m + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+        lines   = (size_t)ceil(n / (nblocks * LINE_SLOTS * HYBRID_LOAD));
+        if (lines == 0)
+                lines = 1;
+
+        bytes = nblocks * (1 + lines) * BLOOM_BLOCK_BITS / 8;
+
+        if (!(h = malloc(sizeof(struct bloom_hybrid_t))))
+                return NULL;
+
+        if (!(h->a = aligned_alloc(BLOOM_BLOCK_BITS/8, bytes))) {
+                free(h);
+                return NULL;
+        }
+        memset(h->a, 0, bytes);
+
+        h->nblocks = nblocks;
+        h->k       = (size_t)k;
+        h->lines   = lines;
+        h->count   = 0;
+        h->cap     = nblocks * lines * LINE_SLOTS;
+        h->cap    -= (h->cap + 15) / 16;        /* so there is always a 0 */
+        h->seed    = 0;
+
+        return h;
+}
+
+
+/******************************************************************************
+ * bloom_hybrid_del  Delete a hybrid filter.
+ * ````````````````
+ * @h     : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_hybrid_del(struct bloom_hybrid_t *h)
+{
+        free(h->a);
+        free(h);
+}
+
+
+/******************************************************************************
+ * bloom_hybrid_add_buf  Add a key to a hybrid filter.
+ * ````````````````````
+ * @h     : hybrid filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: 0 (a key already there included), or -1 with errno set to
+ *          ENOSPC if the table is full.
+ *
+ ******************************************************************************/
+int bloom_hybrid_add_buf(struct bloom_hybrid_t *h, const void *key, size_t len)
+{
+        uint64_t mask[BLOCK_WORDS] = {0};
+        uint64_t h1, h2, fp, *block, *line;
+        size_t b, l, j;
+
+        bloom_hash_pair(key, len, h->seed, &h1, &h2);
+
+        b     = bloom_reduce64(h1, h->nblocks, 0);
+        block = h->a + b * (1 + h->lines) * BLOCK_WORDS;
+        fp    = h1 ? h1 : 1;
+
+        for (l=hybrid_home(h, b, h1); ; l=(l + 1) % (h->nblocks * h->lines)) {
+                line = hybrid_line(h, l);
+                for (j=0; j<LINE_SLOTS; j++) {
+                        if (line[j] == fp)
+                                return 0;
+                        if (line[j] == 0)
+                                goto found;
+                }
+        }
+
+found:
+        if (h->count >= h->cap) {
+                errno = ENOSPC;
+                return -1;
+        }
+
+        line[j] = fp;
+        h->count++;
+
+        bloom_block_bits(h2, h->k, mask);
+        for (j=0; j<BLOCK_WORDS; j++)
+                block[j] |= mask[j];
+
+        return 0;
+}
+
+int bloom_hybrid_add(struct bloom_hybrid_t *h, const char *s)
+{
+        return bloom_hybrid_add_buf(h, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_hybrid_contains_buf  Determine if a key is in a hybrid filter.
+ * `````````````````````````
+ * @h     : hybrid filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: true if the key was added, false if not (see the NOTES at the
+ *          top of this file for what "exact" means here).
+ *
+ * NOTES
+ * The probing stops at the first empty slot: with no removals, a key
+ * that was added is always before it.
+ *
+ ******************************************************************************/
+bool bloom_hybrid_contains_buf(struct bloom_hybrid_t *h, const void *key, size_t len)
+{
+        uint64_t mask[BLOCK_WORDS] = {0};
+        uint64_t h1, h2, fp, *block, *line;
+        size_t b, l, j;
+
+        bloom_hash_pair(key, len, h->seed, &h1, &h2);
+
+        b     = bloom_reduce64(h1, h->nblocks, 0);
+        block = h->a + b * (1 + h->lines) * BLOCK_WORDS;
+
+        bloom_block_bits(h2, h->k, mask);
+        if (!bloom_block_kernel(block, mask))
+                return false;
+
+        fp = h1 ? h1 : 1;
+
+        for (l=hybrid_home(h, b, h1); ; l=(l + 1) % (h->nblocks * h->lines)) {
+                line = hybrid_line(h, l);
+                for (j=0; j<LINE_SLOTS; j++) {
+                        if (line[j] == fp)
+                                return true;
+                        if (line[j] == 0)
+                                return false;
+                }
+        }
+}
+
+bool bloom_hybrid_contains(struct bloom_hybrid_t *h, const char *s)
+{
+        return bloom_hybrid_contains_buf(h, s, strlen(s));
+}
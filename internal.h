@@ -0,0 +1,451 @@
+/******************************************************************************
+ * internal.h
+ * ``````````
+ * Helpers shared between the filter implementations. Not installed, not
+ * part of the API.
+ *
+ ******************************************************************************/
+#ifndef _BLOOM_INTERNAL_H
+#define _BLOOM_INTERNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bloom.h"
+#include "hashes.h"
+
+
+/* The bit arrays are stored as 64-bit words */
+#define WORD_BIT 64
+
+
+/******************************************************************************
+ * bloom_setbit  Set bit n of a bit array.
+ * ````````````
+ * @a     : bit array
+ * @n     : bit to set
+ * @flags : filter flags; BLOOM_CONCURRENT selects an atomic fetch-or
+ * Returns: true if the bit was clear before, otherwise false.
+ *
+ ******************************************************************************/
+static inline bool bloom_setbit(uint64_t *a, size_t n, unsigned int flags)
+{
+        uint64_t *w = &a[n / WORD_BIT];
+        uint64_t bit = 1ULL << (n % WORD_BIT);
+        uint64_t old;
+
+        if (!(flags & BLOOM_CONCURRENT)) {
+                old = *w;
+                *w  = old | bit;
+                return !(old & bit);
+        }
+
+        if (__atomic_load_n(w, __ATOMIC_RELAXED) & bit)
+                return false;
+
+        return !(__atomic_fetch_or(w, bit, __ATOMIC_RELAXED) & bit);
+}
+
+/* As bloom_setbit(), for a whole mask of bits within one word */
+static inline void bloom_setbits(uint64_t *w, uint64_t bits, unsigned int flags)
+{
+        if (!(flags & BLOOM_CONCURRENT)) {
+                *w |= bits;
+                return;
+        }
+
+        if ((__atomic_load_n(w, __ATOMIC_RELAXED) & bits) != bits)
+                __atomic_fetch_or(w, bits, __ATOMIC_RELAXED);
+}
+
+
+/******************************************************************************
+ * bloom_getbit  Read bit n of a bit array.
+ * ````````````
+ * NOTES
+ * A relaxed atomic load compiles to a plain load on every platform we
+ * care about, so it is used unconditionally; it keeps lookups that race
+ * with concurrent inserts well defined.
+ *
+ ******************************************************************************/
+static inline bool bloom_getbit(const uint64_t *a, size_t n)
+{
+        return (__atomic_load_n(&a[n / WORD_BIT], __ATOMIC_RELAXED) >> (n % WORD_BIT)) & 1;
+}
+
+
+/******************************************************************************
+ * bloom_reduce64  Map a 64-bit hash value onto [0, m).
+ * ``````````````
+ * @h     : hash value
+ * @m     : size of the range
+ * @mask  : m-1 if m is a power of 2, otherwise 0
+ * Returns: a position in [0, m).
+ *
+ * NOTES
+ * 'h % m' is a hardware divide, dozens of cycles, paid on every probe.
+ * When m is a power of 2 a mask does the same job. Otherwise we use
+ * Lemire's multiply-shift range reduction ("A fast alternative to the
+ * modulo reduction"): taking h as a fraction h/2^64 of the range,
+ *
+ *      (h * m) / 2^64
+ *
+ * is in [0, m), and is just as uniform as 'h % m' for a uniform h. It
+ * takes its answer from the high bits of h rather than the low ones,
+ * which is fine for a well mixed hash.
+ *
+ ******************************************************************************/
+static inline size_t bloom_reduce64(uint64_t h, size_t m, size_t mask)
+{
+        if (mask)
+                return h & mask;
+
+        return (size_t)(((unsigned __int128)h * m) >> 64);
+}
+
+
+/******************************************************************************
+ * bloom_reduce32  Map a 32-bit hash value onto [0, m).
+ * ``````````````
+ * As bloom_reduce64(), for the legacy unsigned int hash functions.
+ *
+ ******************************************************************************/
+static inline size_t bloom_reduce32(uint32_t h, size_t m, size_t mask)
+{
+        if (mask)
+                return h & mask;
+
+        return bloom_reduce64((uint64_t)h << 32, m, 0);
+}
+
+
+
+/******************************************************************************
+ * bloom_block_bits  Mark the k bits of a key within its block.
+ * ````````````````
+ * @h2    : second hash of the key (the first picks the block)
+ * @k     : number of bits
+ * @mask  : BLOOM_BLOCK_BITS/64 words, zeroed, to set the bits in
+ * Returns: nothing.
+ *
+ * NOTES
+ * Double hashing on the two halves of h2; the stride is odd, hence
+ * co-prime with the block size, so k <= BLOOM_BLOCK_BITS probes never
+ * land on the same bit twice. Shared by every blocked layout (blocked.c,
+ * hybrid.c).
+ *
+ ******************************************************************************/
+static inline void bloom_block_bits(uint64_t h2, size_t k, uint64_t *mask)
+{
+        uint32_t pos, step;
+        size_t n;
+
+        pos  = (uint32_t)h2;
+        step = (uint32_t)(h2 >> 32) | 1;
+
+        for (n=0; n<k; n++, pos+=step)
+                mask[(pos % BLOOM_BLOCK_BITS) / 64] |= 1ULL << (pos % 64);
+}
+
+
+/******************************************************************************
+ * Probe kernels (simd.c)
+ * `````````````
+ * bloom_probe_kernel: the k probes of a single-hash mode key, h1 and h2
+ *                     being its double hashing values; true if all set.
+ * bloom_block_kernel: whether all the 'bits' of one blocked filter block
+ *                     are set in 'block'.
+ *
+ * Both point at the fastest implementation the CPU supports.
+ *
+ * The vector kernels read the bit array with ordinary vector loads and
+ * gathers. On x86 each aligned 64-bit element of those is a single-copy
+ * atomic access, which is all a relaxed load promises, so they are also
+ * used on BLOOM_CONCURRENT filters.
+ *
+ ******************************************************************************/
+typedef bool (*bloom_probe_fn)(const uint64_t *a, size_t m, size_t mask,
+                               size_t k, uint64_t h1, uint64_t h2);
+typedef bool (*bloom_block_fn)(const uint64_t *block, const uint64_t *bits);
+
+extern bloom_probe_fn bloom_probe_kernel;
+extern bloom_block_fn bloom_block_kernel;
+
+/* Whole-array kernels, dst = a op b over n words (simd.c) */
+typedef void     (*bloom_words_fn)(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n);
+typedef uint64_t (*bloom_popcount_fn)(const uint64_t *a, size_t n);
+
+extern bloom_words_fn    bloom_or_kernel;
+extern bloom_words_fn    bloom_and_kernel;
+extern bloom_popcount_fn bloom_popcount_kernel;
+
+
+
+/******************************************************************************
+ * bloom_route  Pick the partition (or shard) of a key.
+ * ```````````
+ * @h1    : first double hashing value of the key
+ * @h2    : second double hashing value of the key
+ * @parts : number of partitions
+ * Returns: a partition in [0, parts).
+ *
+ * NOTES
+ * Taken from the high bits of a value mixed from both hashes, rather than
+ * from h1 itself: the first probe is also taken from the high bits of h1,
+ * and routing on those would squeeze it into 1/parts of the partition.
+ *
+ ******************************************************************************/
+static inline size_t bloom_route(uint64_t h1, uint64_t h2, size_t parts)
+{
+        return bloom_reduce64((h1 ^ h2) * 0x9e3779b97f4a7c15ULL, parts, 0);
+}
+
+
+/******************************************************************************
+ * bloom_part  Find the slice of the bit array a key probes.
+ * ``````````
+ * @bloom : Bloom filter, in single-hash mode
+ * @h1    : first double hashing value of the key
+ * @h2    : second double hashing value of the key
+ * @pm    : number of bits in the slice (filled in)
+ * Returns: the first word of the slice.
+ *
+ * NOTES
+ * An unpartitioned filter is a single slice, the whole array. bloom->mask
+ * always describes the size of one slice.
+ *
+ ******************************************************************************/
+static inline uint64_t *bloom_part(const struct bloom_t *bloom,
+                                   uint64_t h1, uint64_t h2, size_t *pm)
+{
+        if (bloom->parts <= 1) {
+                *pm = bloom->m;
+                return bloom->a;
+        }
+
+        *pm = bloom->m / bloom->parts;
+
+        return bloom->a + bloom_route(h1, h2, bloom->parts) * (*pm / WORD_BIT);
+}
+
+
+/* Bytes of a bit array of size bits, in whole cache lines */
+#define BLOOM_ARRAY_BYTES(size) \
+        ((((size) + WORD_BIT - 1) / WORD_BIT * sizeof(uint64_t) + 63) & ~(size_t)63)
+
+/* Single-hash mode entry points with the hashing already done (bloom.c) */
+struct bloom_t *bloom_init(struct bloom_t *bloom, uint64_t *a, size_t size,
+                           size_t num_hashes);
+struct bloom_t *bloom_alloc(size_t size, size_t num_hashes, size_t table,
+                            const struct bloom_alloc *opts, void **tablep);
+struct bloom_t *bloom_new_parts(size_t size, size_t num_hashes, size_t parts);
+void bloom_add_hashed  (struct bloom_t *bloom, uint64_t h1, uint64_t h2);
+bool bloom_check_hashed(struct bloom_t *bloom, uint64_t h1, uint64_t h2);
+
+
+/******************************************************************************
+ * Touched blocks (clear.c)
+ * ``````````````
+ * After bloom_track_touched(), the first bit set in each TOUCH_BLOCK_BITS
+ * block of the array since the last bloom_clear() puts the block on a list,
+ * a map keeping it from going on twice. bloom_clear() then zeroes only the
+ * blocks on the list. A list that runs out of room is 'count > cap', and
+ * the next clear zeroes everything.
+ *
+ ******************************************************************************/
+#define TOUCH_BLOCK_BITS 512
+
+struct bloom_touched {
+        size_t cap;             /* of list */
+        size_t count;           /* blocks touched, may pass cap */
+        uint64_t *map;          /* bit per block: on the list */
+        size_t list[];
+};
+
+static inline void bloom_touch(struct bloom_touched *t, size_t block, unsigned int flags)
+{
+        size_t i;
+
+        if (!bloom_setbit(t->map, block, flags))
+                return;
+
+        if (flags & BLOOM_CONCURRENT)
+                i = __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+        else
+                i = t->count++;
+
+        if (i < t->cap)
+                t->list[i] = block;
+}
+
+
+/******************************************************************************
+ * bloom_set  Set bit n of a filter, noting the change for delta and clear.
+ * `````````
+ * @bloom : Bloom filter
+ * @n     : bit to set
+ * Returns: nothing.
+ *
+ * NOTES
+ * The dirty map (see stream.c) has one bit per BLOOM_DIRTY_REGION bytes
+ * of the bit array. It is only written when a bit really changes, which
+ * for a filter that is filling up is a shrinking share of adds; so is the
+ * touched list, which only takes the first bit set in a block.
+ *
+ ******************************************************************************/
+#define DIRTY_REGION_BITS (BLOOM_DIRTY_REGION * 8)
+
+static inline void bloom_set(struct bloom_t *bloom, size_t n)
+{
+        if (!bloom_setbit(bloom->a, n, bloom->flags))
+                return;
+        if (bloom->dirty)
+                bloom_setbit(bloom->dirty, n / DIRTY_REGION_BITS, bloom->flags);
+        if (bloom->touched)
+                bloom_touch(bloom->touched, n / TOUCH_BLOCK_BITS, bloom->flags);
+}
+
+/* As bloom_set(), for a whole mask of bits within word w */
+static inline void bloom_or_word(struct bloom_t *bloom, size_t w, uint64_t bits)
+{
+        bloom_setbits(&bloom->a[w], bits, bloom->flags);
+        if (bloom->dirty)
+                bloom_setbit(bloom->dirty, w * WORD_BIT / DIRTY_REGION_BITS, bloom->flags);
+        if (bloom->touched)
+                bloom_touch(bloom->touched, w * WORD_BIT / TOUCH_BLOCK_BITS, bloom->flags);
+}
+
+/*
+ * The dirty map is followed by a map as large of the regions bloom_clear()
+ * zeroed. The next delta sends those as replace ranges, whose words the
+ * receiver stores instead of ORing them in (see stream.c).
+ */
+#define DIRTY_MAP_WORDS(m) \
+        ((((m) + DIRTY_REGION_BITS - 1) / DIRTY_REGION_BITS + WORD_BIT - 1) / WORD_BIT)
+
+/* Note in the dirty map that words [from, to) were overwritten */
+static inline void bloom_mark_cleared(struct bloom_t *bloom, size_t from, size_t to)
+{
+        size_t r, last, words;
+
+        words = DIRTY_MAP_WORDS(bloom->m);
+        last  = (to * WORD_BIT - 1) / DIRTY_REGION_BITS;
+
+        for (r=from * WORD_BIT / DIRTY_REGION_BITS; r<=last; r++) {
+                bloom_setbit(bloom->dirty + words, r, bloom->flags);
+                bloom_setbit(bloom->dirty, r, bloom->flags);
+        }
+}
+
+
+/******************************************************************************
+ * Statistics counters (stats.c)
+ * ```````````````````
+ * A block of BLOOM_STATS_SLOTS counter sets, a cache line each. A thread
+ * only ever writes the slot of its number, so the counters cost a couple
+ * of plain adds to a line nobody else touches, rather than an atomic add
+ * to a line every thread bounces around. bloom_stats() sums the slots.
+ *
+ * BLOOM_STATS_NOTE() compiles to nothing without BLOOM_STATS, arguments
+ * and all, and with it to a test of bloom->stats when none are kept.
+ *
+ ******************************************************************************/
+#define BLOOM_STATS_SLOTS 64
+
+struct bloom_stats_slot {
+        uint64_t adds;
+        uint64_t checks;
+        uint64_t positives;
+        uint64_t probes;
+} __attribute__((aligned(64)));
+
+struct bloom_stats_block {
+        struct bloom_stats_slot slot[BLOOM_STATS_SLOTS];
+};
+
+extern __thread unsigned int bloom_stats_tid;
+extern unsigned int bloom_stats_threads;
+
+#ifdef BLOOM_STATS
+static inline void bloom_stats_note(struct bloom_t *bloom, uint64_t adds, uint64_t checks,
+                                    uint64_t positives, uint64_t probes)
+{
+        struct bloom_stats_slot *s;
+
+        if (!bloom->stats)
+                return;
+
+        if (!bloom_stats_tid)
+                bloom_stats_tid = __atomic_add_fetch(&bloom_stats_threads, 1, __ATOMIC_RELAXED);
+
+        s = &bloom->stats->slot[bloom_stats_tid % BLOOM_STATS_SLOTS];
+
+        /* Relaxed loads and stores, not read-modify-writes; see stats.c */
+        __atomic_store_n(&s->adds, __atomic_load_n(&s->adds, __ATOMIC_RELAXED) + adds, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->checks, __atomic_load_n(&s->checks, __ATOMIC_RELAXED) + checks, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->positives, __atomic_load_n(&s->positives, __ATOMIC_RELAXED) + positives, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->probes, __atomic_load_n(&s->probes, __ATOMIC_RELAXED) + probes, __ATOMIC_RELAXED);
+}
+
+#define BLOOM_STATS_NOTE(bloom, adds, checks, positives, probes) \
+        bloom_stats_note((bloom), (adds), (checks), (positives), (probes))
+#else
+#define BLOOM_STATS_NOTE(bloom, adds, checks, positives, probes) ((void)0)
+#endif
+
+
+/* An empty filter with the configuration of another (ops.c) */
+struct bloom_t *bloom_clone(const struct bloom_t *bloom);
+
+/* Threads for the set operations on large arrays, 0 for one per CPU (ops.c) */
+extern long bloom_ops_threads;
+
+
+/* Allocation helpers (alloc.c) */
+int bloom_numa_nodes(void);
+uint64_t *bloom_chunk_alloc(size_t bytes, const struct bloom_alloc *opts,
+                            void **chunk, size_t *size);
+void bloom_chunk_free(void *chunk, size_t size, const struct bloom_alloc *opts);
+
+
+/* File format helpers (file.c) */
+uint64_t bloom_file_checksum(uint64_t sum, const void *p, size_t len, uint64_t off);
+void bloom_file_header_init(struct bloom_file_header *h, uint32_t layout,
+                            uint64_t m, uint64_t k, uint64_t seed,
+                            uint64_t parts, const uint64_t *a);
+bool bloom_file_header_valid(const struct bloom_file_header *h);
+void bloom_file_unmap(uint64_t *a, size_t bytes);
+
+
+/* The index of a compressed filter is sound (compress.c) */
+bool bloom_compressed_valid(const struct bloom_compressed_t *c);
+
+#define BLOOM_REDUCE64(bloom, h) bloom_reduce64((h), (bloom)->m, (bloom)->mask)
+#define BLOOM_REDUCE32(bloom, h) bloom_reduce32((h), (bloom)->m, (bloom)->mask)
+
+
+/******************************************************************************
+ * bloom_hash_pair  Compute the two double hashing values of a key.
+ * ```````````````
+ * @key   : bytes of the key to hash
+ * @len   : length of the key in bytes
+ * @seed  : hash seed of the filter
+ * @h1    : first hash value (filled in)
+ * @h2    : second hash value, i.e. the stride (filled in)
+ * Returns: nothing.
+ *
+ * NOTES
+ * One pass of wy_hash() over the key; h2 is remixed from h1 with fmix64.
+ * The stride is forced odd, so that it is never 0 (which would collapse
+ * all k probes onto one bit) and is co-prime with power of 2 sizes.
+ *
+ ******************************************************************************/
+static inline void bloom_hash_pair(const void *key, size_t len, uint64_t seed,
+                                   uint64_t *h1, uint64_t *h2)
+{
+        *h1 = wy_hash(key, len, seed);
+        *h2 = fmix64(*h1 ^ 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+#endif
@@ -0,0 +1,84 @@
+/******************************************************************************
+ * mkbloom.c
+ * `````````
+ * Build a Bloom filter file from a file of keys
+ *
+ * USAGE
+ *      mkbloom [-p rate] [-t threads] [-M] keys.txt filter.bloom
+ *
+ *      -p      false positive rate wanted, default 0.01
+ *      -t      threads, default one per online CPU
+ *      -M      per-thread filters ORed at the end (BLOOM_BUILD_MERGE),
+ *              rather than concurrent adds
+ *
+ * The keys are the lines of keys.txt (see build.c); the filter is written
+ * with bloom_save(), to be opened with bloom_open_mmap().
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bloom.h"
+
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+int main(int argc, char *argv[])
+{
+        struct bloom_t *bloom;
+        unsigned int flags = 0;
+        int nthreads = 0, opt;
+        double p = 0.01, t0, t1;
+
+        while ((opt = getopt(argc, argv, "p:t:M")) != -1) {
+                switch (opt) {
+                case 'p': p        = atof(optarg); break;
+                case 't': nthreads = atoi(optarg); break;
+                case 'M': flags   |= BLOOM_BUILD_MERGE; break;
+                default:
+                        goto usage;
+                }
+        }
+
+        if (argc - optind != 2)
+                goto usage;
+
+        t0 = now();
+
+        if (!(bloom = bloom_build_from_file(argv[optind], p, nthreads, flags))) {
+                fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+                return 1;
+        }
+
+        t1 = now();
+
+        if (bloom_save(bloom, argv[optind + 1]) != 0) {
+                fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(errno));
+                bloom_del(bloom);
+                return 1;
+        }
+
+        fprintf(stderr, "m: %zu  k: %zu  keys: ~%.0f  built in %.2fs, saved in %.2fs\n",
+                bloom->m, bloom->k, bloom_estimate_count(bloom), t1 - t0, now() - t1);
+
+        bloom_del(bloom);
+
+        return 0;
+
+usage:
+        fprintf(stderr, "usage: %s [-p rate] [-t threads] [-M] keys.txt filter.bloom\n", argv[0]);
+        return 1;
+}
@@ -0,0 +1,352 @@
+/******************************************************************************
+ * ops.c
+ * `````
+ * Set operations on Bloom filters
+ *
+ * Two filters built with the same m, k and hash functions set the same
+ * bits for the same key, so the filter of the union of their key sets is
+ * the bitwise OR of their arrays, exactly as if every key had been added
+ * to one filter. The bitwise AND contains every key of the intersection
+ * (no false negatives), but its false positive rate is higher than that
+ * of a filter built from the intersection alone, since a bit may be set
+ * in both for different keys.
+ *
+ * The number of bits set, X, gives an estimate of how many distinct keys
+ * a filter holds (Swamidass and Baldi):
+ *
+ *      n ~= -(m/k) ln(1 - X/m)
+ *
+ * NOTES
+ * All of these are streaming passes over whole arrays, limited by memory
+ * bandwidth rather than by instructions. The word kernels are vectorized
+ * (see simd.c), and arrays of OPS_THREAD_WORDS words or more are split
+ * over one thread per online CPU, so that more than one core's worth of
+ * outstanding loads is in flight.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+#define ROUND(size) (((size) + WORD_BIT - 1) / WORD_BIT)
+
+#define OPS_THREAD_WORDS (1UL << 20)    /* 8 MiB */
+#define OPS_MAX_THREADS  64
+
+long bloom_ops_threads;         /* 0: one per online CPU */
+
+
+struct ops_job {
+        bloom_words_fn    fn;           /* NULL for a popcount */
+        uint64_t         *dst;
+        const uint64_t   *a;
+        const uint64_t   *b;
+        size_t            n;
+        uint64_t          count;
+};
+
+
+static void *ops_work(void *arg)
+{
+        struct ops_job *job = arg;
+
+        if (job->fn)
+                job->fn(job->dst, job->a, job->b, job->n);
+        else
+                job->count = bloom_popcount_kernel(job->a, job->n);
+
+        return NULL;
+}
+
+
+/******************************************************************************
+ * ops_run  Run a word kernel over n words, on several threads if large.
+ * ```````
+ * @fn    : or/and kernel, or NULL to count the bits of 'a'
+ * @dst   : destination array (unused by a count)
+ * @a, @b : source arrays (b unused by a count)
+ * @n     : number of words
+ * Returns: the number of bits set, for a count; otherwise 0.
+ *
+ * NOTES
+ * Each thread gets a contiguous range, a multiple of 8 words so that no
+ * two threads write to the same cache line; the last range is the short
+ * one. Threads that fail to start have their range done by the caller
+ * instead.
+ *
+ ******************************************************************************/
+static uint64_t ops_run(bloom_words_fn fn, uint64_t *dst, const uint64_t *a,
+                        const uint64_t *b, size_t n)
+{
+        struct ops_job job[OPS_MAX_THREADS];
+        pthread_t tid[OPS_MAX_THREADS];
+        bool started[OPS_MAX_THREADS];
+        uint64_t count;
+        size_t chunk, off;
+        long nthreads;
+        int t;
+
+        if (n < OPS_THREAD_WORDS)
+                nthreads = 1;
+        else if (!(nthreads = bloom_ops_threads))
+                nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads > OPS_MAX_THREADS)
+                nthreads = OPS_MAX_THREADS;
+        if (nthreads > n / (OPS_THREAD_WORDS / 4))
+                nthreads = n / (OPS_THREAD_WORDS / 4);
+        if (nthreads < 1)
+                nthreads = 1;
+
+        /* Rounded up, or the last n % nthreads words would go undone */
+        chunk = ((n + nthreads - 1) / nthreads + 7) & ~(size_t)7;
+
+        for (t=0, off=0; t<nthreads; t++, off+=chunk) {
+                job[t].fn    = fn;
+                job[t].dst   = dst + off;
+                job[t].a     = a + off;
+                job[t].b     = b ? b + off : NULL;
+                job[t].n     = off >= n ? 0 : (n - off < chunk ? n - off : chunk);
+                job[t].count = 0;
+        }
+
+        /* The caller takes the first range itself */
+        for (t=1; t<nthreads; t++)
+                started[t] = pthread_create(&tid[t], NULL, ops_work, &job[t]) == 0;
+
+        ops_work(&job[0]);
+
+        for (count=job[0].count, t=1; t<nthreads; t++) {
+                if (started[t])
+                        pthread_join(tid[t], NULL);
+                else
+                        ops_work(&job[t]);
+                count += job[t].count;
+        }
+
+        return count;
+}
+
+
+/******************************************************************************
+ * ops_compatible  Determine if two filters set the same bits for a key.
+ * ``````````````
+ * @a, @b : Bloom filters
+ * Returns: true if m, k, partitioning, seed and hash functions all match.
+ *
+ ******************************************************************************/
+static bool ops_compatible(const struct bloom_t *a, const struct bloom_t *b)
+{
+        if (a->m != b->m || a->k != b->k || a->parts != b->parts || a->seed != b->seed)
+                return false;
+
+        if (!a->hash != !b->hash || !a->hashlen != !b->hashlen)
+                return false;
+
+        if (a->hash)
+                return memcmp(a->hash, b->hash, a->k*sizeof(hashfp_t)) == 0;
+        if (a->hashlen)
+                return memcmp(a->hashlen, b->hashlen, a->k*sizeof(hashlenfp_t)) == 0;
+
+        return true;
+}
+
+
+/******************************************************************************
+ * bloom_clone  Allocate an empty filter configured like another one.
+ * ```````````
+ * @bloom : Bloom filter to copy the configuration of
+ * Returns: An allocated, zeroed bloom filter, or NULL.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_clone(const struct bloom_t *bloom)
+{
+        struct bloom_t *copy;
+        size_t table;
+        void *p;
+
+        table = bloom->hash    ? bloom->k*sizeof(hashfp_t)
+              : bloom->hashlen ? bloom->k*sizeof(hashlenfp_t) : 0;
+
+        if (!(copy = bloom_alloc(bloom->m, bloom->k, table, NULL, &p)))
+                return NULL;
+
+        copy->seed  = bloom->seed;
+        copy->parts = bloom->parts;
+        copy->mask  = bloom->mask;
+
+        if (bloom->hash)
+                copy->hash = memcpy(p, bloom->hash, table);
+        if (bloom->hashlen)
+                copy->hashlen = memcpy(p, bloom->hashlen, table);
+
+        return copy;
+}
+
+
+/******************************************************************************
+ * bloom_union  Add every key of one Bloom filter to another.
+ * ```````````
+ * @dst   : Bloom filter to add to
+ * @src   : Bloom filter to add from
+ * Returns: 0 on success, or -1 with errno set to EINVAL if the filters
+ *          differ in size, k or hashing.
+ *
+ * NOTES
+ * If 'dst' is BLOOM_CONCURRENT or tracks dirty regions or touched blocks,
+ * the words are merged one at a time through the ordinary add path
+ * instead, so that concurrent adds are not lost and the changes show up
+ * in the next delta and the next bloom_clear().
+ *
+ ******************************************************************************/
+int bloom_union(struct bloom_t *dst, const struct bloom_t *src)
+{
+        size_t n, words;
+
+        if (!ops_compatible(dst, src)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        words = ROUND(dst->m);
+
+        if ((dst->flags & BLOOM_CONCURRENT) || dst->dirty || dst->touched) {
+                for (n=0; n<words; n++) {
+                        if (src->a[n])
+                                bloom_or_word(dst, n, src->a[n]);
+                }
+                return 0;
+        }
+
+        ops_run(bloom_or_kernel, dst->a, dst->a, src->a, words);
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * bloom_intersect  Keep only the bits of a Bloom filter set in another.
+ * ```````````````
+ * @dst   : Bloom filter to intersect into
+ * @src   : Bloom filter to intersect with
+ * Returns: 0 on success, or -1 with errno set to EINVAL if the filters
+ *          differ in size, k or hashing.
+ *
+ * CAVEAT
+ * This clears bits, which nothing else does: readers running at the same
+ * time may see false negatives for keys of 'dst' not in 'src', and adds
+ * to 'dst' running at the same time may be lost. Dirty tracking only
+ * follows bits being set, so a delta will not carry an intersection.
+ *
+ ******************************************************************************/
+int bloom_intersect(struct bloom_t *dst, const struct bloom_t *src)
+{
+        if (!ops_compatible(dst, src)) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        ops_run(bloom_and_kernel, dst->a, dst->a, src->a, ROUND(dst->m));
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * bloom_union_new  Allocate the union of two Bloom filters.
+ * ```````````````
+ * @a, @b : Bloom filters
+ * Returns: An allocated bloom filter holding the keys of both, or NULL,
+ *          with errno set to EINVAL if the filters differ in size, k or
+ *          hashing.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_union_new(const struct bloom_t *a, const struct bloom_t *b)
+{
+        struct bloom_t *bloom;
+
+        if (!ops_compatible(a, b)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (!(bloom = bloom_clone(a)))
+                return NULL;
+
+        ops_run(bloom_or_kernel, bloom->a, a->a, b->a, ROUND(a->m));
+
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_intersect_new  Allocate the intersection of two Bloom filters.
+ * ```````````````````
+ * @a, @b : Bloom filters
+ * Returns: An allocated bloom filter holding the keys common to both, or
+ *          NULL, with errno set to EINVAL if the filters differ in size, k
+ *          or hashing.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_intersect_new(const struct bloom_t *a, const struct bloom_t *b)
+{
+        struct bloom_t *bloom;
+
+        if (!ops_compatible(a, b)) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (!(bloom = bloom_clone(a)))
+                return NULL;
+
+        ops_run(bloom_and_kernel, bloom->a, a->a, b->a, ROUND(a->m));
+
+        return bloom;
+}
+
+
+/******************************************************************************
+ * bloom_count_set_bits  Count the bits set in a Bloom filter.
+ * ````````````````````
+ * @bloom : Bloom filter
+ * Returns: the number of bits set.
+ *
+ ******************************************************************************/
+size_t bloom_count_set_bits(const struct bloom_t *bloom)
+{
+        return ops_run(NULL, NULL, bloom->a, NULL, ROUND(bloom->m));
+}
+
+
+/******************************************************************************
+ * bloom_estimate_count  Estimate the number of distinct keys in a filter.
+ * ````````````````````
+ * @bloom : Bloom filter
+ * Returns: the estimate -(m/k) ln(1 - X/m), X the number of bits set, or
+ *          INFINITY if every bit is set.
+ *
+ * NOTES
+ * Applied to the union of two filters this estimates the size of the
+ * union of their key sets, and from it |A n B| = |A| + |B| - |A u B|,
+ * which is better than estimating from bloom_intersect().
+ *
+ ******************************************************************************/
+double bloom_estimate_count(const struct bloom_t *bloom)
+{
+        size_t x;
+
+        if (bloom->k == 0)
+                return 0;
+
+        x = bloom_count_set_bits(bloom);
+        if (x >= bloom->m)
+                return INFINITY;
+
+        return -((double)bloom->m / bloom->k) * log1p(-(double)x / bloom->m);
+}
@@ -0,0 +1,299 @@
+/******************************************************************************
+ * range.c
+ * ```````
+ * Range and prefix queries over Bloom filters
+ *
+ * A Bloom filter answers "is x in the set?"; a range scan wants "is
+ * anything in [lo, hi] in the set?", which one bloom_check() per value of
+ * the range answers only for the smallest of ranges. A range filter
+ * (Luo et al., "Rosetta: A Robust Space-Time Optimized Range Filter for
+ * Key-Value Stores") keeps one Bloom filter per prefix length instead, each
+ * holding the prefixes of that length of every key:
+ *
+ *      level 0         the keys themselves, 'bits' bits wide
+ *      level 1         the keys >> 1
+ *      ...
+ *      level L-1       the keys >> (L-1)
+ *
+ * A prefix of level j stands for the 2^j keys that share it: a dyadic
+ * interval. A range is cut into the fewest dyadic intervals that cover it
+ * (at most two per level), each is probed at its level, and from each
+ * that may be populated the search goes down a level, into its two halves,
+ * and so on down to level 0: the range may hold a key only if some path
+ * comes out positive at every level to the bottom. A false positive of an
+ * upper level only costs the probes below it; the answer is wrong only if
+ * the bottom level is wrong too, at the rate of a point query.
+ *
+ * Byte keys are mapped to integers by their first 8 bytes, big-endian, so
+ * the order of the keys is kept and a prefix of bytes is a dyadic interval
+ * (see bloom_range_add_buf(), bloom_range_check_prefix()).
+ *
+ * NOTES
+ * Level j holds at most 2^(bits-j) distinct prefixes, and each level is
+ * sized for the lesser of that and n (see bloom_new_optimal()), so the top
+ * levels of a wide stack cost little.
+ *
+ * A level is a single-hash bloom_t; BLOOM_CONCURRENT set on all of them
+ * makes adds safe from many threads.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define RANGE_PROBES 4096       /* probes a range query may take */
+
+
+/* The prefix p at level j may be populated: descend until level 0 */
+static bool range_descend(struct bloom_range_t *r, uint64_t p, int j, size_t *budget)
+{
+        if (*budget == 0)
+                return true;    /* give up: "maybe" is always right */
+        (*budget)--;
+
+        if (!bloom_check_buf(r->level[j], &p, sizeof(p)))
+                return false;
+        if (j == 0)
+                return true;
+
+        return range_descend(r, p << 1, j - 1, budget)
+            || range_descend(r, (p << 1) | 1, j - 1, budget);
+}
+
+
+/******************************************************************************
+ * bloom_range_new  Allocate and return a new, empty range filter.
+ * ```````````````
+ * @n     : the number of keys expected to be added
+ * @p     : the false positive rate wanted of each level, 0 < p < 1
+ * @bits  : width of the keys, 1 to 64
+ * @levels: number of levels, 1 to bits; ranges of up to 2^(levels-1) keys
+ *          are probed as one interval at the top
+ * Returns: An allocated range filter, or NULL (errno EINVAL for bad
+ *          arguments).
+ *
+ ******************************************************************************/
+struct bloom_range_t *bloom_range_new(size_t n, double p, int bits, int levels)
+{
+        struct bloom_range_t *r;
+        size_t cap;
+        int j;
+
+        if (!(p > 0.0 && p < 1.0) || bits < 1 || bits > 64 || levels < 1 || levels > bits) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (!(r = calloc(1, sizeof(struct bloom_range_t))))
+                return NULL;
+
+        r->bits   = bits;
+        r->levels = levels;
+
+        for (j=0; j<levels; j++) {
+                cap = n;
+                if (bits - j < 63 && cap > (1ULL << (bits - j)))
+                        cap = 1ULL << (bits - j);
+
+                if (!(r->level[j] = bloom_new_optimal(cap, p))) {
+                        bloom_range_del(r);
+                        errno = ENOMEM;
+                        return NULL;
+                }
+        }
+
+        return r;
+}
+
+
+/******************************************************************************
+ * bloom_range_del  Delete a range filter.
+ * ```````````````
+ * @r     : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_range_del(struct bloom_range_t *r)
+{
+        int j;
+
+        for (j=0; j<r->levels; j++) {
+                if (r->level[j])
+                        bloom_del(r->level[j]);
+        }
+        free(r);
+}
+
+
+/* Keys are taken modulo 2^bits */
+static inline uint64_t range_mask(const struct bloom_range_t *r)
+{
+        return r->bits == 64 ? ~0ULL : (1ULL << r->bits) - 1;
+}
+
+
+/******************************************************************************
+ * bloom_range_add  Add an integer key to a range filter.
+ * ```````````````
+ * @r     : range filter
+ * @key   : the key; only its low 'bits' bits are kept
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_range_add(struct bloom_range_t *r, uint64_t key)
+{
+        uint64_t p;
+        int j;
+
+        key &= range_mask(r);
+
+        for (j=0; j<r->levels; j++) {
+                p = key >> j;
+                bloom_add_buf(r->level[j], &p, sizeof(p));
+        }
+}
+
+
+/******************************************************************************
+ * bloom_range_check  Determine if an integer key is in a range filter.
+ * `````````````````
+ * @r     : range filter
+ * @key   : the key
+ * Returns: false if the key is not in the filter, otherwise true.
+ *
+ ******************************************************************************/
+bool bloom_range_check(struct bloom_range_t *r, uint64_t key)
+{
+        key &= range_mask(r);
+
+        return bloom_check_buf(r->level[0], &key, sizeof(key));
+}
+
+
+/******************************************************************************
+ * bloom_range_check_range  Determine if any key of a range is in the filter.
+ * ```````````````````````
+ * @r     : range filter
+ * @lo    : first key of the range
+ * @hi    : last key of the range, included
+ * Returns: false if no key in [lo, hi] is in the filter, otherwise true.
+ *
+ * NOTES
+ * The range is covered from lo up by the largest dyadic interval that
+ * starts there, fits, and is no larger than the top level. A range wider
+ * than the top level takes one interval for each 2^(levels-1) keys, and
+ * every probe counts against RANGE_PROBES: past that, the answer is true,
+ * which is never wrong for a filter, only less useful. A range of more
+ * than RANGE_PROBES top level intervals is answered true at once, rather
+ * than after spending the probes to find that out.
+ *
+ ******************************************************************************/
+bool bloom_range_check_range(struct bloom_range_t *r, uint64_t lo, uint64_t hi)
+{
+        size_t budget = RANGE_PROBES;
+        uint64_t span;
+        int j;
+
+        if (hi > range_mask(r))
+                hi = range_mask(r);
+        if (lo > hi)
+                return false;
+        if ((hi - lo) >> (r->levels - 1) >= RANGE_PROBES)
+                return true;
+
+        for (;;) {
+                j = lo ? __builtin_ctzll(lo) : 63;
+                if (j > r->levels - 1)
+                        j = r->levels - 1;
+                while (j > 0 && hi - lo < (1ULL << j) - 1)
+                        j--;
+
+                if (range_descend(r, lo >> j, j, &budget))
+                        return true;
+
+                span = (1ULL << j) - 1;
+                if (hi - lo == span)
+                        return false;
+                lo += span + 1;
+        }
+}
+
+
+/******************************************************************************
+ * range_key  Map a byte key to the integer key of a range filter.
+ * `````````
+ * @r     : range filter
+ * @key   : bytes of the key
+ * @len   : length of the key in bytes
+ * Returns: the first 8 bytes of the key, big-endian and padded with zero
+ *          bytes, cut to the top 'bits' bits.
+ *
+ ******************************************************************************/
+static uint64_t range_key(const struct bloom_range_t *r, const void *key, size_t len)
+{
+        const unsigned char *b = key;
+        uint64_t v = 0;
+        size_t i;
+
+        for (i=0; i<8; i++)
+                v = (v << 8) | (i < len ? b[i] : 0);
+
+        return v >> (64 - r->bits);
+}
+
+
+/******************************************************************************
+ * bloom_range_add_buf  Add a byte key to a range filter.
+ * ```````````````````
+ * @r     : range filter, usually 64 bits wide
+ * @key   : bytes of the key
+ * @len   : length of the key in bytes
+ * Returns: nothing.
+ *
+ * NOTES
+ * Only the first 8 bytes count (fewer, if the filter is narrower): keys
+ * that share them are one key to the filter.
+ *
+ ******************************************************************************/
+void bloom_range_add_buf(struct bloom_range_t *r, const void *key, size_t len)
+{
+        bloom_range_add(r, range_key(r, key, len));
+}
+
+
+/******************************************************************************
+ * bloom_range_check_prefix  Determine if any key with a prefix is present.
+ * ````````````````````````
+ * @r     : range filter of byte keys (see bloom_range_add_buf())
+ * @prefix: the prefix
+ * @len   : length of the prefix in bytes
+ * Returns: false if no key starting with the prefix is in the filter,
+ *          otherwise true.
+ *
+ * NOTES
+ * A prefix of len bytes is the dyadic interval of the keys sharing its
+ * 8*len bits. A prefix as long as the filter is wide is a point query.
+ *
+ * A prefix the levels reach, 8*len > bits - levels, is one probe at its
+ * level and the descent below it. A shorter one is 2^(bits - 8*len -
+ * levels + 1) intervals of the top level, and once that is more than
+ * RANGE_PROBES (2^12), that is for fewer than bits - levels - 11 bits of
+ * prefix, the answer is always true, a "maybe". For every byte prefix to
+ * get a real answer, give the filter as many levels as bits.
+ *
+ ******************************************************************************/
+bool bloom_range_check_prefix(struct bloom_range_t *r, const void *prefix, size_t len)
+{
+        uint64_t lo;
+
+        lo = range_key(r, prefix, len);
+
+        if (8*len >= (size_t)r->bits)
+                return bloom_range_check(r, lo);
+
+        return bloom_range_check_range(r, lo, lo | (range_mask(r) >> (8*len)));
+}
@@ -0,0 +1,211 @@
+/******************************************************************************
+ * scalable.c
+ * ``````````
+ * Scalable Bloom filters
+ *
+ * HISTORY
+ * A Bloom filter is sized for the number of keys it will hold, and past
+ * that its false positive rate climbs without bound. When the number is
+ * not known up front, the scalable filter (Almeida, Baquero, Preguica and
+ * Hutchison, "Scalable Bloom Filters") adds keys to a chain of ordinary
+ * filters instead: once the newest one is full, a larger one is started
+ * after it, and a key is present if any of them says so.
+ *
+ * Stage i is built for n0 * s^i keys at an error rate of p0 * r^i, with
+ * growth s = SCALABLE_GROWTH and tightening ratio r = SCALABLE_TIGHTEN.
+ * The overall rate is at most the sum of the stages', p0 / (1 - r), so
+ * p0 = p (1 - r) keeps it under the target p however many stages there
+ * are, and the geometric growth keeps their number logarithmic in n.
+ *
+ * NOTES
+ * "Full" is measured rather than assumed: a filter with the optimal
+ * number of functions for its rate has half of its bits set when it is
+ * at capacity, at which point its false positive rate is 0.5^k, the rate
+ * it was built for. So the newest stage keeps a running popcount of its
+ * bits, incremented as bits flip from 0 to 1 on insert, and a new stage
+ * is started when half are set. Duplicate keys set no new bits and so
+ * do not count against the capacity.
+ *
+ * A key is hashed once, and the one hash pair probes every stage (see
+ * bloom_check_hashed()). Stages are checked from the newest, which holds
+ * about half of all keys, to the oldest.
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define SCALABLE_GROWTH  2
+#define SCALABLE_TIGHTEN 0.85
+
+
+/******************************************************************************
+ * scalable_grow  Start a new, empty stage.
+ * `````````````
+ * @sf    : scalable Bloom filter
+ * Returns: 0 on success, or -1.
+ *
+ ******************************************************************************/
+static int scalable_grow(struct bloom_scalable_t *sf)
+{
+        struct bloom_t **stage;
+        struct bloom_t *bloom;
+
+        if (sf->nstages == sf->cap) {
+                stage = realloc(sf->stage, 2 * (sf->cap ? sf->cap : 4) * sizeof(struct bloom_t *));
+                if (!stage)
+                        return -1;
+                sf->stage = stage;
+                sf->cap   = 2 * (sf->cap ? sf->cap : 4);
+        }
+
+        if (!(bloom = bloom_new_optimal(sf->next, sf->err)))
+                return -1;
+
+        bloom->seed = sf->seed;
+
+        sf->stage[sf->nstages++] = bloom;
+
+        sf->fill  = 0;
+        sf->limit = bloom->m / 2;
+        sf->next *= SCALABLE_GROWTH;
+        sf->err  *= SCALABLE_TIGHTEN;
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * bloom_scalable_new  Allocate and return a new scalable Bloom filter.
+ * ``````````````````
+ * @n     : expected number of keys, the capacity of the first stage
+ * @p     : the desired false positive rate, for any number of keys
+ * Returns: An allocated scalable bloom filter, or NULL.
+ *
+ * USAGE
+ * A good guess for n saves memory (a scalable filter holding n keys is
+ * somewhat larger than a fixed one sized for n), but a poor one only
+ * costs a few extra stages.
+ *
+ ******************************************************************************/
+struct bloom_scalable_t *bloom_scalable_new(size_t n, double p)
+{
+        struct bloom_scalable_t *sf;
+
+        if (!(p > 0.0 && p < 1.0))
+                return NULL;
+
+        if (!(sf = malloc(sizeof(struct bloom_scalable_t))))
+                return NULL;
+
+        sf->nstages = 0;
+        sf->cap     = 0;
+        sf->stage   = NULL;
+        sf->seed    = 0;
+        sf->next    = n ? n : 1;
+        sf->err     = p * (1 - SCALABLE_TIGHTEN);
+
+        if (scalable_grow(sf) < 0) {
+                bloom_scalable_del(sf);
+                return NULL;
+        }
+
+        return sf;
+}
+
+
+/******************************************************************************
+ * bloom_scalable_del  Delete a scalable Bloom filter.
+ * ``````````````````
+ * @sf    : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_scalable_del(struct bloom_scalable_t *sf)
+{
+        size_t n;
+
+        for (n=0; n<sf->nstages; n++)
+                bloom_del(sf->stage[n]);
+
+        free(sf->stage);
+        free(sf);
+}
+
+
+/******************************************************************************
+ * bloom_scalable_add_buf  Add a key to a scalable Bloom filter.
+ * ``````````````````````
+ * @sf    : scalable Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: 0 on success, or -1 if a new stage was needed and could not
+ *          be allocated (the key is then added to the full stage).
+ *
+ * NOTES
+ * Keys only ever go into the newest stage, and nothing is moved or
+ * re-hashed when a stage is added: an insert is k probes, plus now and
+ * then the allocation of a new stage (whose zeroed pages the kernel
+ * hands out lazily).
+ *
+ * CAVEAT
+ * Not safe to call from several threads at once.
+ *
+ ******************************************************************************/
+int bloom_scalable_add_buf(struct bloom_scalable_t *sf, const void *key, size_t len)
+{
+        struct bloom_t *bloom;
+        uint64_t h1, h2;
+        int n, rc = 0;
+
+        if (sf->fill >= sf->limit)
+                rc = scalable_grow(sf);
+
+        bloom = sf->stage[sf->nstages - 1];
+
+        bloom_hash_pair(key, len, sf->seed, &h1, &h2);
+
+        for (n=0; n<bloom->k; n++, h1+=h2)
+                sf->fill += bloom_setbit(bloom->a, bloom_reduce64(h1, bloom->m, bloom->mask), 0);
+
+        return rc;
+}
+
+int bloom_scalable_add(struct bloom_scalable_t *sf, const char *s)
+{
+        return bloom_scalable_add_buf(sf, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_scalable_check_buf  Determine if a key is in a scalable filter.
+ * ````````````````````````
+ * @sf    : scalable Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: false if the key does not exist in the filter, otherwise true.
+ *
+ ******************************************************************************/
+bool bloom_scalable_check_buf(struct bloom_scalable_t *sf, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+        size_t n;
+
+        bloom_hash_pair(key, len, sf->seed, &h1, &h2);
+
+        for (n=sf->nstages; n-- > 0; ) {
+                if (bloom_check_hashed(sf->stage[n], h1, h2))
+                        return true;
+        }
+
+        return false;
+}
+
+bool bloom_scalable_check(struct bloom_scalable_t *sf, const char *s)
+{
+        return bloom_scalable_check_buf(sf, s, strlen(s));
+}
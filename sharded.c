@@ -0,0 +1,260 @@
+/******************************************************************************
+ * sharded.c
+ * `````````
+ * Sharded Bloom filters
+ *
+ * Atomic inserts (BLOOM_CONCURRENT) make a single filter safe to share,
+ * but every insert still lands on a random line of one big array, and
+ * under a heavy insert load those lines bounce between the caches of all
+ * the cores doing the inserting. A sharded filter splits the array into N
+ * independent sub-filters, each with its own, separately allocated bit
+ * array. One hash of the key routes it to a shard, and all of its k
+ * probes stay in that shard.
+ *
+ * Ingest then scales with cores by giving each worker its own shards:
+ * producers route keys with bloom_sharded_shard() and hand each key to the
+ * worker that owns the shard, which inserts into memory nobody else
+ * writes, without atomics. The shard arrays are spread round-robin over
+ * the NUMA nodes of the machine, shard i on node i % nodes, so an owner
+ * pinned to the right node inserts into local memory.
+ *
+ * NOTES
+ * Shard sizes are a whole number of cache lines, and the routing is the
+ * one used by partitioned filters (see bloom_new_parts()), so the shards
+ * laid end to end are an ordinary bloom_t which bloom_check() understands.
+ * That is what bloom_sharded_merge() produces, for export.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+/******************************************************************************
+ * bloom_sharded_new  Allocate and return a new sharded Bloom filter.
+ * `````````````````
+ * @size   : total size of the bit arrays of all shards
+ * @nfuncs : the number of bit positions (k) set per key
+ * @nshards: the number of shards
+ * Returns: An allocated sharded bloom filter, or NULL (errno EINVAL for a
+ *          size of 0).
+ *
+ * USAGE
+ * Each shard gets size/nshards bits, rounded up to a whole number of
+ * cache lines. As ever, powers of 2 for both make for the fastest probes.
+ *
+ ******************************************************************************/
+struct bloom_sharded_t *bloom_sharded_new(size_t size, size_t num_hashes, size_t nshards)
+{
+        struct bloom_sharded_t *sh;
+        size_t pm;
+        int nodes;
+        int n;
+
+        if (size == 0) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (nshards == 0)
+                nshards = 1;
+
+        pm = (size + nshards - 1) / nshards;
+        pm = (pm + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS * BLOOM_BLOCK_BITS;
+
+        if (!(sh = malloc(sizeof(struct bloom_sharded_t))))
+                return NULL;
+
+        /* Line aligned headers; aligned_alloc() takes whole lines only */
+        if (!(sh->shard = aligned_alloc(64, (nshards*sizeof(struct bloom_t) + 63) & ~(size_t)63))) {
+                free(sh);
+                return NULL;
+        }
+        if (!(sh->opts = malloc(nshards*sizeof(struct bloom_alloc)))) {
+                free(sh->shard);
+                free(sh);
+                return NULL;
+        }
+
+        sh->nshards = nshards;
+        sh->k       = num_hashes;
+        sh->m       = pm * nshards;
+        sh->seed    = 0;
+
+        nodes = bloom_numa_nodes();
+
+        for (n=0; n<nshards; n++) {
+                sh->shard[n].m       = pm;
+                sh->shard[n].k       = num_hashes;
+                sh->shard[n].mask    = (pm & (pm - 1)) ? 0 : pm - 1;
+                sh->shard[n].parts   = 1;
+                sh->shard[n].seed    = 0;
+                sh->shard[n].flags   = 0;
+                sh->shard[n].own     = 0;
+                sh->shard[n].dirty   = NULL;
+                sh->shard[n].hash    = NULL;
+                sh->shard[n].hashlen = NULL;
+                sh->shard[n].stats   = NULL;
+                sh->shard[n].touched = NULL;
+                sh->shard[n].alloc   = &sh->opts[n];
+
+                /* Preferred, not bound: if the node is full, use another */
+                sh->opts[n].align = 64;
+                sh->opts[n].flags = nodes > 1 ? BLOOM_ALLOC_NUMA_PREFER : 0;
+                sh->opts[n].node  = n % nodes;
+                sh->opts[n].alloc = NULL;
+                sh->opts[n].free  = NULL;
+                sh->opts[n].ctx   = NULL;
+
+                if (!(sh->shard[n].a = bloom_chunk_alloc(pm/8, &sh->opts[n], &sh->shard[n].chunk,
+                                                         &sh->shard[n].chunk_size))) {
+                        sh->nshards = n;
+                        bloom_sharded_del(sh);
+                        return NULL;
+                }
+        }
+
+        return sh;
+}
+
+
+/******************************************************************************
+ * bloom_sharded_del  Delete a sharded Bloom filter.
+ * `````````````````
+ * @sh    : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_sharded_del(struct bloom_sharded_t *sh)
+{
+        int n;
+
+        for (n=0; n<sh->nshards; n++)
+                bloom_chunk_free(sh->shard[n].chunk, sh->shard[n].chunk_size, sh->shard[n].alloc);
+
+        free(sh->opts);
+        free(sh->shard);
+        free(sh);
+}
+
+
+/******************************************************************************
+ * bloom_sharded_set_flags  Set the flags of every shard.
+ * ```````````````````````
+ * @sh    : sharded Bloom filter
+ * @flags : e.g. BLOOM_CONCURRENT, if shards are not owned by one thread
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_sharded_set_flags(struct bloom_sharded_t *sh, unsigned int flags)
+{
+        int n;
+
+        for (n=0; n<sh->nshards; n++)
+                sh->shard[n].flags = flags;
+}
+
+
+/******************************************************************************
+ * bloom_sharded_shard  Determine which shard a key belongs to.
+ * ```````````````````
+ * @sh    : sharded Bloom filter
+ * @key   : bytes of the key
+ * @len   : length of the key in bytes
+ * Returns: the index of the shard in [0, sh->nshards).
+ *
+ ******************************************************************************/
+size_t bloom_sharded_shard(struct bloom_sharded_t *sh, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+
+        bloom_hash_pair(key, len, sh->seed, &h1, &h2);
+
+        return bloom_route(h1, h2, sh->nshards);
+}
+
+
+/******************************************************************************
+ * bloom_sharded_add_buf  Add a key to a sharded Bloom filter.
+ * `````````````````````
+ * @sh    : sharded Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_sharded_add_buf(struct bloom_sharded_t *sh, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+
+        bloom_hash_pair(key, len, sh->seed, &h1, &h2);
+        bloom_add_hashed(&sh->shard[bloom_route(h1, h2, sh->nshards)], h1, h2);
+}
+
+void bloom_sharded_add(struct bloom_sharded_t *sh, const char *s)
+{
+        bloom_sharded_add_buf(sh, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_sharded_check_buf  Determine if a key is in a sharded Bloom filter.
+ * ```````````````````````
+ * @sh    : sharded Bloom filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: false if the key does not exist in the filter, otherwise true.
+ *
+ ******************************************************************************/
+bool bloom_sharded_check_buf(struct bloom_sharded_t *sh, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+
+        bloom_hash_pair(key, len, sh->seed, &h1, &h2);
+
+        return bloom_check_hashed(&sh->shard[bloom_route(h1, h2, sh->nshards)], h1, h2);
+}
+
+bool bloom_sharded_check(struct bloom_sharded_t *sh, const char *s)
+{
+        return bloom_sharded_check_buf(sh, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_sharded_merge  Combine the shards into a single Bloom filter.
+ * ```````````````````
+ * @sh    : sharded Bloom filter
+ * Returns: An allocated (partitioned) bloom filter holding every key added
+ *          to 'sh', or NULL.
+ *
+ * NOTES
+ * Nothing is re-hashed: shard i is copied to slice i of the new filter,
+ * which routes keys the same way the sharded filter does. The result is
+ * checked with bloom_check() like any other filter.
+ *
+ * CAVEAT
+ * Inserts still in flight on other threads may or may not make the copy.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_sharded_merge(struct bloom_sharded_t *sh)
+{
+        struct bloom_t *bloom;
+        size_t words;
+        int n;
+
+        if (!(bloom = bloom_new_parts(sh->m, sh->k, sh->nshards)))
+                return NULL;
+
+        bloom->seed = sh->seed;
+
+        words = sh->m / sh->nshards / WORD_BIT;
+
+        for (n=0; n<sh->nshards; n++)
+                memcpy(bloom->a + n*words, sh->shard[n].a, words*sizeof(uint64_t));
+
+        return bloom;
+}
@@ -0,0 +1,466 @@
+/******************************************************************************
+ * simd.c
+ * ``````
+ * Vectorized probe kernels
+ *
+ * Once the key has been hashed (once, in single-hash mode), a membership
+ * test is k probes: reduce g_i = h1 + i*h2 onto [0, m), load the word,
+ * test the bit. The scalar loop does these one after another. The kernels
+ * here do eight (AVX2) or sixteen (AVX-512) probes at once: positions are
+ * computed in 64-bit lanes, the words fetched with a gather, and all the
+ * bits tested with a single compare.
+ *
+ * NOTES
+ * A binary has to keep running on machines without these instructions, so
+ * the kernels are compiled with per-function target attributes, and the
+ * one to use is picked once, at load time, from what the CPU reports.
+ * Setting BLOOM_KERNEL=scalar|avx2|avx512 in the environment overrides the
+ * choice (a kernel the CPU can't run is never selected).
+ *
+ * The blocked filter gets the same treatment: its 512-bit block is held in
+ * one AVX-512 register (or two AVX2 ones) and tested against the mask of
+ * the key in one go.
+ *
+ ******************************************************************************/
+
+#include <string.h>
+#include <immintrin.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+/******************************************************************************
+ * Scalar kernels
+ ******************************************************************************/
+static bool probe_scalar(const uint64_t *a, size_t m, size_t mask, size_t k,
+                         uint64_t h1, uint64_t h2)
+{
+        size_t pos;
+        int n;
+
+        for (n=0; n<k; n++, h1+=h2) {
+                pos = bloom_reduce64(h1, m, mask);
+                if (!bloom_getbit(a, pos))
+                        return false;
+        }
+        return true;
+}
+
+static bool block_scalar(const uint64_t *block, const uint64_t *bits)
+{
+        uint64_t miss;
+        int n;
+
+        for (miss=0, n=0; n<BLOOM_BLOCK_BITS/WORD_BIT; n++)
+                miss |= bits[n] & ~block[n];
+
+        return miss == 0;
+}
+
+
+/******************************************************************************
+ * AVX2 kernels
+ * ````````````
+ * NOTES
+ * AVX2 has no 64x64->128 multiply, so the high half needed by Lemire's
+ * reduction (see bloom_reduce64()) is put together from 32x32->64
+ * partial products, schoolbook fashion.
+ *
+ ******************************************************************************/
+__attribute__((target("avx2")))
+static inline __m256i mulhi64_avx2(__m256i x, __m256i y)
+{
+        const __m256i lo32 = _mm256_set1_epi64x(0xffffffffULL);
+        __m256i xh, yh, p0, p1, p2, p3, mid;
+
+        xh = _mm256_srli_epi64(x, 32);
+        yh = _mm256_srli_epi64(y, 32);
+
+        p0 = _mm256_mul_epu32(x,  y);
+        p1 = _mm256_mul_epu32(x,  yh);
+        p2 = _mm256_mul_epu32(xh, y);
+        p3 = _mm256_mul_epu32(xh, yh);
+
+        mid = _mm256_add_epi64(_mm256_srli_epi64(p0, 32),
+              _mm256_add_epi64(_mm256_and_si256(p1, lo32),
+                               _mm256_and_si256(p2, lo32)));
+
+        return _mm256_add_epi64(p3,
+               _mm256_add_epi64(_mm256_srli_epi64(mid, 32),
+               _mm256_add_epi64(_mm256_srli_epi64(p1, 32),
+                                _mm256_srli_epi64(p2, 32))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i miss_avx2(const uint64_t *a, __m256i g, __m256i vm,
+                                __m256i vmask, bool pow2, __m256i active)
+{
+        const __m256i one = _mm256_set1_epi64x(1);
+        const __m256i low = _mm256_set1_epi64x(WORD_BIT - 1);
+        __m256i pos, word, bit;
+
+        pos  = pow2 ? _mm256_and_si256(g, vmask) : mulhi64_avx2(g, vm);
+        bit  = _mm256_sllv_epi64(one, _mm256_and_si256(pos, low));
+        bit  = _mm256_and_si256(bit, active);
+        word = _mm256_i64gather_epi64((const long long *)a,
+                                      _mm256_srli_epi64(pos, 6), 8);
+
+        return _mm256_andnot_si256(word, bit);
+}
+
+__attribute__((target("avx2")))
+static bool probe_avx2(const uint64_t *a, size_t m, size_t mask, size_t k,
+                       uint64_t h1, uint64_t h2)
+{
+        const __m256i lane = _mm256_set_epi64x(3, 2, 1, 0);
+        __m256i g0, g1, step, vm, vmask, miss, left;
+        size_t n;
+
+        g0    = _mm256_set_epi64x(h1 + 3*h2, h1 + 2*h2, h1 + h2, h1);
+        g1    = _mm256_add_epi64(g0, _mm256_set1_epi64x(4*h2));
+        step  = _mm256_set1_epi64x(8*h2);
+        vm    = _mm256_set1_epi64x(m);
+        vmask = _mm256_set1_epi64x(mask);
+
+        for (n=0; n<k; n+=8) {
+                /* lanes past the k'th probe test nothing */
+                left = _mm256_set1_epi64x(k - n);
+                miss = miss_avx2(a, g0, vm, vmask, mask != 0,
+                                 _mm256_cmpgt_epi64(left, lane));
+                left = _mm256_sub_epi64(left, _mm256_set1_epi64x(4));
+                miss = _mm256_or_si256(miss,
+                       miss_avx2(a, g1, vm, vmask, mask != 0,
+                                 _mm256_cmpgt_epi64(left, lane)));
+
+                if (!_mm256_testz_si256(miss, miss))
+                        return false;
+
+                g0 = _mm256_add_epi64(g0, step);
+                g1 = _mm256_add_epi64(g1, step);
+        }
+        return true;
+}
+
+__attribute__((target("avx2")))
+static bool block_avx2(const uint64_t *block, const uint64_t *bits)
+{
+        __m256i miss;
+
+        miss = _mm256_or_si256(
+                _mm256_andnot_si256(_mm256_load_si256((const __m256i *)block),
+                                    _mm256_loadu_si256((const __m256i *)bits)),
+                _mm256_andnot_si256(_mm256_load_si256((const __m256i *)block + 1),
+                                    _mm256_loadu_si256((const __m256i *)bits + 1)));
+
+        return _mm256_testz_si256(miss, miss);
+}
+
+
+/******************************************************************************
+ * AVX-512 kernels
+ ******************************************************************************/
+__attribute__((target("avx512f")))
+static inline __m512i mulhi64_avx512(__m512i x, __m512i y)
+{
+        const __m512i lo32 = _mm512_set1_epi64(0xffffffffULL);
+        __m512i xh, yh, p0, p1, p2, p3, mid;
+
+        xh = _mm512_srli_epi64(x, 32);
+        yh = _mm512_srli_epi64(y, 32);
+
+        p0 = _mm512_mul_epu32(x,  y);
+        p1 = _mm512_mul_epu32(x,  yh);
+        p2 = _mm512_mul_epu32(xh, y);
+        p3 = _mm512_mul_epu32(xh, yh);
+
+        mid = _mm512_add_epi64(_mm512_srli_epi64(p0, 32),
+              _mm512_add_epi64(_mm512_and_si512(p1, lo32),
+                               _mm512_and_si512(p2, lo32)));
+
+        return _mm512_add_epi64(p3,
+               _mm512_add_epi64(_mm512_srli_epi64(mid, 32),
+               _mm512_add_epi64(_mm512_srli_epi64(p1, 32),
+                                _mm512_srli_epi64(p2, 32))));
+}
+
+__attribute__((target("avx512f")))
+static inline bool hit_avx512(const uint64_t *a, __m512i g, __m512i vm,
+                              __m512i vmask, bool pow2, __mmask8 active)
+{
+        const __m512i one = _mm512_set1_epi64(1);
+        const __m512i low = _mm512_set1_epi64(WORD_BIT - 1);
+        __m512i pos, word, bit;
+
+        pos  = pow2 ? _mm512_and_si512(g, vmask) : mulhi64_avx512(g, vm);
+        bit  = _mm512_sllv_epi64(one, _mm512_and_si512(pos, low));
+        word = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(), active,
+                                           _mm512_srli_epi64(pos, 6), a, 8);
+
+        return _mm512_mask_test_epi64_mask(active, word, bit) == active;
+}
+
+__attribute__((target("avx512f")))
+static bool probe_avx512(const uint64_t *a, size_t m, size_t mask, size_t k,
+                         uint64_t h1, uint64_t h2)
+{
+        __m512i g0, g1, step, vm, vmask;
+        size_t n, left;
+
+        g0    = _mm512_set_epi64(h1 + 7*h2, h1 + 6*h2, h1 + 5*h2, h1 + 4*h2,
+                                 h1 + 3*h2, h1 + 2*h2, h1 + h2, h1);
+        g1    = _mm512_add_epi64(g0, _mm512_set1_epi64(8*h2));
+        step  = _mm512_set1_epi64(16*h2);
+        vm    = _mm512_set1_epi64(m);
+        vmask = _mm512_set1_epi64(mask);
+
+        for (n=0; n<k; n+=16) {
+                left = k - n;
+                if (!hit_avx512(a, g0, vm, vmask, mask != 0,
+                                left >= 8 ? 0xff : (1u << left) - 1))
+                        return false;
+                if (left > 8 && !hit_avx512(a, g1, vm, vmask, mask != 0,
+                                            left >= 16 ? 0xff : (1u << (left - 8)) - 1))
+                        return false;
+
+                g0 = _mm512_add_epi64(g0, step);
+                g1 = _mm512_add_epi64(g1, step);
+        }
+        return true;
+}
+
+__attribute__((target("avx512f")))
+static bool block_avx512(const uint64_t *block, const uint64_t *bits)
+{
+        __m512i b, want;
+
+        b    = _mm512_load_si512(block);
+        want = _mm512_loadu_si512(bits);
+
+        return _mm512_test_epi64_mask(_mm512_andnot_si512(b, want),
+                                      _mm512_andnot_si512(b, want)) == 0;
+}
+
+
+/******************************************************************************
+ * Word kernels
+ * ````````````
+ * Whole-array operations for set algebra on filters (see ops.c):
+ *
+ *      or : dst[i] = a[i] | b[i]
+ *      and: dst[i] = a[i] & b[i]
+ *      popcount: number of bits set in a[0..n)
+ *
+ * dst may be the same array as a (in place).
+ *
+ * NOTES
+ * The AVX2 popcount is the nibble lookup of Mula, Kurz and Lemire
+ * ("Faster Population Counts Using AVX2 Instructions"): pshufb counts the
+ * bits of each nibble from a 16 entry table, and psadbw sums the bytes.
+ * AVX-512 parts with VPOPCNTDQ count whole words directly.
+ *
+ ******************************************************************************/
+static void or_scalar(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n)
+{
+        size_t i;
+
+        for (i=0; i<n; i++)
+                dst[i] = a[i] | b[i];
+}
+
+static void and_scalar(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n)
+{
+        size_t i;
+
+        for (i=0; i<n; i++)
+                dst[i] = a[i] & b[i];
+}
+
+static uint64_t popcount_scalar(const uint64_t *a, size_t n)
+{
+        uint64_t c;
+        size_t i;
+
+        for (c=0, i=0; i<n; i++)
+                c += __builtin_popcountll(a[i]);
+
+        return c;
+}
+
+__attribute__((target("avx2")))
+static void or_avx2(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n)
+{
+        size_t i;
+
+        for (i=0; i+4<=n; i+=4)
+                _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                        _mm256_loadu_si256((const __m256i *)(b + i))));
+        or_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void and_avx2(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n)
+{
+        size_t i;
+
+        for (i=0; i+4<=n; i+=4)
+                _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                         _mm256_loadu_si256((const __m256i *)(b + i))));
+        and_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t popcount_avx2(const uint64_t *a, size_t n)
+{
+        const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                               0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low = _mm256_set1_epi8(0x0f);
+        __m256i sum, v, c;
+        uint64_t lanes[4];
+        size_t i;
+
+        sum = _mm256_setzero_si256();
+
+        for (i=0; i+4<=n; i+=4) {
+                v   = _mm256_loadu_si256((const __m256i *)(a + i));
+                c   = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+                                      _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+                sum = _mm256_add_epi64(sum, _mm256_sad_epu8(c, _mm256_setzero_si256()));
+        }
+
+        _mm256_storeu_si256((__m256i *)lanes, sum);
+
+        return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_scalar(a + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void or_avx512(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n)
+{
+        size_t i;
+
+        for (i=0; i+8<=n; i+=8)
+                _mm512_storeu_si512(dst + i, _mm512_or_si512(_mm512_loadu_si512(a + i),
+                                                             _mm512_loadu_si512(b + i)));
+        or_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f")))
+static void and_avx512(uint64_t *dst, const uint64_t *a, const uint64_t *b, size_t n)
+{
+        size_t i;
+
+        for (i=0; i+8<=n; i+=8)
+                _mm512_storeu_si512(dst + i, _mm512_and_si512(_mm512_loadu_si512(a + i),
+                                                              _mm512_loadu_si512(b + i)));
+        and_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static uint64_t popcount_avx512(const uint64_t *a, size_t n)
+{
+        __m512i sum;
+        size_t i;
+
+        sum = _mm512_setzero_si512();
+
+        for (i=0; i+8<=n; i+=8)
+                sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(_mm512_loadu_si512(a + i)));
+
+        return _mm512_reduce_add_epi64(sum) + popcount_scalar(a + i, n - i);
+}
+
+
+/******************************************************************************
+ * Dispatch
+ ******************************************************************************/
+static const struct {
+        const char *name;
+        const char *cpu;
+        bloom_probe_fn probe;
+        bloom_block_fn block;
+        bloom_words_fn or;
+        bloom_words_fn and;
+        bloom_popcount_fn popcount;
+} kernels[] = {
+        { "avx512", "avx512f", probe_avx512, block_avx512, or_avx512,  and_avx512,  popcount_avx2   },
+        { "avx2",   "avx2",    probe_avx2,   block_avx2,   or_avx2,    and_avx2,    popcount_avx2   },
+        { "scalar", NULL,      probe_scalar, block_scalar, or_scalar,  and_scalar,  popcount_scalar },
+};
+
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static const char *kernel_name = "scalar";
+
+bloom_probe_fn    bloom_probe_kernel    = probe_scalar;
+bloom_block_fn    bloom_block_kernel    = block_scalar;
+bloom_words_fn    bloom_or_kernel       = or_scalar;
+bloom_words_fn    bloom_and_kernel      = and_scalar;
+bloom_popcount_fn bloom_popcount_kernel = popcount_scalar;
+
+
+/******************************************************************************
+ * kernel_supported  Determine whether the CPU can run a kernel.
+ * ````````````````
+ * NOTES
+ * __builtin_cpu_supports() only takes string literals, hence the chain.
+ *
+ ******************************************************************************/
+static bool kernel_supported(const char *cpu)
+{
+        if (!cpu)
+                return true;
+        if (!strcmp(cpu, "avx512f"))
+                return __builtin_cpu_supports("avx512f");
+        if (!strcmp(cpu, "avx2"))
+                return __builtin_cpu_supports("avx2");
+        return false;
+}
+
+
+/******************************************************************************
+ * kernel_select  Pick the probe kernels, once, before main() runs.
+ * `````````````
+ ******************************************************************************/
+__attribute__((constructor))
+static void kernel_select(void)
+{
+        const char *want;
+        int n;
+
+        __builtin_cpu_init();
+
+        want = getenv("BLOOM_KERNEL");
+
+        for (n=0; n<NKERNELS; n++) {
+                if (want && strcmp(want, kernels[n].name))
+                        continue;
+                if (!kernel_supported(kernels[n].cpu))
+                        continue;
+                kernel_name           = kernels[n].name;
+                bloom_probe_kernel    = kernels[n].probe;
+                bloom_block_kernel    = kernels[n].block;
+                bloom_or_kernel       = kernels[n].or;
+                bloom_and_kernel      = kernels[n].and;
+                bloom_popcount_kernel = kernels[n].popcount;
+
+                /* VPOPCNTDQ is a separate extension to AVX-512 */
+                if (kernels[n].probe == probe_avx512
+                 && __builtin_cpu_supports("avx512vpopcntdq"))
+                        bloom_popcount_kernel = popcount_avx512;
+                return;
+        }
+}
+
+
+/******************************************************************************
+ * bloom_kernel  Name the probe kernel in use.
+ * ````````````
+ * Returns: "avx512", "avx2" or "scalar".
+ *
+ ******************************************************************************/
+const char *bloom_kernel(void)
+{
+        return kernel_name;
+}
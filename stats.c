@@ -0,0 +1,157 @@
+/******************************************************************************
+ * stats.c
+ * ```````
+ * Statistics for Bloom filters in production
+ *
+ * A filter gives no sign that it is overfull: it goes on answering, with
+ * a false positive rate that climbs as the bits fill up. bloom_stats()
+ * takes a snapshot from which to see it coming, and resize in time:
+ *
+ *      adds, checks            operations since the counters started
+ *      positives               checks that answered true; for a workload
+ *                              of mostly absent keys, this is near the
+ *                              measured false positive rate
+ *      probes_per_check        bits examined before the first clear one
+ *                              (k for a positive); a mean creeping up
+ *                              towards k means the filter is filling up
+ *      fill, fpr, keys         bits set, the false positive rate that
+ *                              fill implies, and the number of distinct
+ *                              keys it implies (see bloom_estimate_count())
+ *
+ * The counters cost nothing unless the library is built with BLOOM_STATS
+ * defined (make STATS=1), and then only for filters that have called
+ * bloom_stats_enable(). The fill fields are always available.
+ *
+ * NOTES
+ * Each thread counts into a slot of its own, one cache line apiece, and
+ * the slots are summed on read, so counting adds no contention between
+ * threads. Threads are numbered in the order they first count, and
+ * share a slot when more than BLOOM_STATS_SLOTS have done so; the counts
+ * of threads sharing a slot at the same time can lose an increment now
+ * and then, which is the price of not using atomic adds.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+__thread unsigned int bloom_stats_tid;   /* 0 until the first count */
+unsigned int bloom_stats_threads;
+
+
+/******************************************************************************
+ * bloom_stats_enable  Start keeping the counters of a Bloom filter.
+ * ``````````````````
+ * @bloom : Bloom filter
+ * Returns: 0, or -1 with errno set to ENOTSUP if the library was built
+ *          without BLOOM_STATS, or ENOMEM.
+ *
+ * CAVEAT
+ * Call this before the filter is shared between threads. Enabling twice
+ * is harmless, and keeps the counts.
+ *
+ ******************************************************************************/
+int bloom_stats_enable(struct bloom_t *bloom)
+{
+#ifdef BLOOM_STATS
+        if (bloom->stats)
+                return 0;
+
+        if (!(bloom->stats = aligned_alloc(64, sizeof(struct bloom_stats_block)))) {
+                errno = ENOMEM;
+                return -1;
+        }
+        memset(bloom->stats, 0, sizeof(struct bloom_stats_block));
+
+        return 0;
+#else
+        errno = ENOTSUP;
+        return -1;
+#endif
+}
+
+
+/******************************************************************************
+ * bloom_stats_reset  Zero the counters of a Bloom filter.
+ * `````````````````
+ * @bloom : Bloom filter
+ * Returns: nothing.
+ *
+ * NOTES
+ * Operations running at the same time may be counted in the old period
+ * or the new one. To export rates, rather than reset, take differences
+ * of successive snapshots.
+ *
+ ******************************************************************************/
+void bloom_stats_reset(struct bloom_t *bloom)
+{
+        struct bloom_stats_slot *s;
+        int n;
+
+        if (!bloom->stats)
+                return;
+
+        for (n=0; n<BLOOM_STATS_SLOTS; n++) {
+                s = &bloom->stats->slot[n];
+                __atomic_store_n(&s->adds,      0, __ATOMIC_RELAXED);
+                __atomic_store_n(&s->checks,    0, __ATOMIC_RELAXED);
+                __atomic_store_n(&s->positives, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&s->probes,    0, __ATOMIC_RELAXED);
+        }
+}
+
+
+/******************************************************************************
+ * bloom_stats  Take a snapshot of the statistics of a Bloom filter.
+ * ```````````
+ * @bloom : Bloom filter
+ * @st    : snapshot (filled in)
+ * Returns: 0, or -1 with errno set to ENOTSUP if no counters are kept
+ *          (the counter fields are then 0; the fill fields are filled in
+ *          either way).
+ *
+ * NOTES
+ * The fill is counted from the bit array, a pass over all of it (see
+ * bloom_count_set_bits()): cheap for a metrics scrape every few seconds,
+ * not something to call per operation. The counters are summed slot by
+ * slot while other threads go on counting, so the snapshot is not one
+ * instant, but every count it holds did happen.
+ *
+ ******************************************************************************/
+int bloom_stats(const struct bloom_t *bloom, struct bloom_stats *st)
+{
+        const struct bloom_stats_slot *s;
+        int n;
+
+        memset(st, 0, sizeof(struct bloom_stats));
+
+        st->bits_set = bloom_count_set_bits(bloom);
+        st->fill     = bloom->m ? (double)st->bits_set / bloom->m : 0;
+        st->fpr      = pow(st->fill, (double)bloom->k);
+        st->keys     = bloom_estimate_count(bloom);
+
+        if (!bloom->stats) {
+                errno = ENOTSUP;
+                return -1;
+        }
+
+        for (n=0; n<BLOOM_STATS_SLOTS; n++) {
+                s = &bloom->stats->slot[n];
+                st->adds      += __atomic_load_n(&s->adds,      __ATOMIC_RELAXED);
+                st->checks    += __atomic_load_n(&s->checks,    __ATOMIC_RELAXED);
+                st->positives += __atomic_load_n(&s->positives, __ATOMIC_RELAXED);
+                st->probes    += __atomic_load_n(&s->probes,    __ATOMIC_RELAXED);
+        }
+
+        if (st->checks) {
+                st->probes_per_check = (double)st->probes / st->checks;
+                st->positive_rate    = (double)st->positives / st->checks;
+        }
+
+        return 0;
+}
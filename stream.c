@@ -0,0 +1,457 @@
+/******************************************************************************
+ * stream.c
+ * ````````
+ * Streaming Bloom filters, and shipping only what changed
+ *
+ * bloom_write() and bloom_read() move a filter through a callback (or a
+ * file descriptor, with the *_fd versions) a chunk at a time. The bytes
+ * are those of a filter file (see file.c), so a stream can be saved as is
+ * and opened with bloom_open_mmap(). Nothing the size of the bit array is
+ * ever buffered: the writer hands out pieces of bloom->a itself, and the
+ * reader reads straight into the bit array of the new filter.
+ *
+ * For replication, re-sending the whole array after every batch of adds
+ * is mostly wasted: the bits are only ever set, and most regions of the
+ * array have not changed. After bloom_track_dirty(), the add path notes
+ * which BLOOM_DIRTY_REGION sized regions of the array have had a bit set,
+ * and bloom_export_delta() writes just those regions (runs of them, as
+ * word ranges) and starts a new checkpoint. The receiver merges them in
+ * with bloom_apply_delta(), which is the union of the header of bloom.c:
+ * a bitwise OR.
+ *
+ * The one way bits are unset is bloom_clear() (see clear.c). The regions
+ * it zeroes are noted apart, and go out as replace ranges, which the
+ * receiver copies over its own words rather than ORing into them.
+ *
+ * DELTA FORMAT
+ *      offset  size  field
+ *      0       8     magic, "BLOOMDLT"
+ *      8       4     version, BLOOM_FILE_VERSION
+ *      12      4     reserved, 0
+ *      16      8     m
+ *      24      8     k
+ *      32      8     seed
+ *      40      8     parts
+ *      48      8     number of ranges that follow
+ *      56      8     reserved, 0
+ *
+ * then for each range, its first word and number of words (8 bytes each)
+ * followed by the words themselves. The top bit of the number of words,
+ * DELTA_REPLACE, marks a replace range. Little-endian throughout.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+/* Multiple of the 64 KiB checksum chunk of file.c */
+#define STREAM_CHUNK (1024*1024)
+#define APPLY_WORDS  4096
+
+#define DELTA_REPLACE (1ULL << 63)      /* in a range's number of words */
+
+struct bloom_delta_header {
+        char     magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t m;
+        uint64_t k;
+        uint64_t seed;
+        uint64_t parts;
+        uint64_t ranges;
+        uint64_t reserved2;
+};
+
+
+/******************************************************************************
+ * fd_write, fd_read  The callbacks behind the *_fd functions.
+ * `````````````````
+ * @ctx   : pointer to the file descriptor
+ * @buf   : bytes to write / read into
+ * @len   : number of bytes; all of them, or it's an error
+ * Returns: 0, or -1 with errno set.
+ *
+ ******************************************************************************/
+static int fd_write(void *ctx, const void *buf, size_t len)
+{
+        const char *c = buf;
+        ssize_t n;
+
+        while (len > 0) {
+                if ((n = write(*(int *)ctx, c, len)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                c   += n;
+                len -= n;
+        }
+        return 0;
+}
+
+static int fd_read(void *ctx, void *buf, size_t len)
+{
+        char *c = buf;
+        ssize_t n;
+
+        while (len > 0) {
+                if ((n = read(*(int *)ctx, c, len)) <= 0) {
+                        if (n < 0 && errno == EINTR)
+                                continue;
+                        if (n == 0)
+                                errno = EIO; /* truncated */
+                        return -1;
+                }
+                c   += n;
+                len -= n;
+        }
+        return 0;
+}
+
+
+/******************************************************************************
+ * bloom_write  Serialize a Bloom filter through a callback.
+ * ```````````
+ * @bloom : Bloom filter, in single-hash mode
+ * @fn    : called with each successive piece of the stream
+ * @ctx   : passed to fn
+ * Returns: 0, or -1 with errno set (a failure of fn is passed on).
+ *
+ * CAVEAT
+ * The checksum in the header is taken before the array is written, so
+ * adds must not run while the filter is being written, or the reader will
+ * find a mismatch.
+ *
+ ******************************************************************************/
+int bloom_write(struct bloom_t *bloom, bloom_write_fn fn, void *ctx)
+{
+        struct bloom_file_header h;
+        const char *a;
+        size_t off, n;
+
+        if (bloom->hash || bloom->hashlen) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        bloom_file_header_init(&h, BLOOM_LAYOUT_CLASSIC, bloom->m, bloom->k,
+                               bloom->seed, bloom->parts, bloom->a);
+
+        if (fn(ctx, &h, sizeof(h)))
+                return -1;
+
+        for (a=(const char *)bloom->a, off=0; off < h.bytes; off += n) {
+                n = h.bytes - off < STREAM_CHUNK ? h.bytes - off : STREAM_CHUNK;
+                if (fn(ctx, a + off, n))
+                        return -1;
+        }
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * bloom_read  Deserialize a Bloom filter through a callback.
+ * ``````````
+ * @fn    : called to fill each successive piece of the stream
+ * @ctx   : passed to fn
+ * Returns: An allocated bloom filter, or NULL with errno set.
+ *
+ ******************************************************************************/
+struct bloom_t *bloom_read(bloom_read_fn fn, void *ctx)
+{
+        struct bloom_file_header h;
+        struct bloom_t *bloom;
+        uint64_t sum;
+        char *a;
+        size_t off, n;
+
+        if (fn(ctx, &h, sizeof(h)))
+                return NULL;
+
+        if (!bloom_file_header_valid(&h))
+                return NULL;
+
+        if (h.layout != BLOOM_LAYOUT_CLASSIC || h.m % h.parts
+         || (h.parts > 1 && (h.m / h.parts) % WORD_BIT)) {
+                errno = ENOTSUP;
+                return NULL;
+        }
+
+        if (!(bloom = bloom_new_parts(h.m, h.k, h.parts))) {
+                errno = ENOMEM;
+                return NULL;
+        }
+        bloom->seed = h.seed;
+
+        for (sum=0, a=(char *)bloom->a, off=0; off < h.bytes; off += n) {
+                n = h.bytes - off < STREAM_CHUNK ? h.bytes - off : STREAM_CHUNK;
+                if (fn(ctx, a + off, n)) {
+                        bloom_del(bloom);
+                        return NULL;
+                }
+                sum = bloom_file_checksum(sum, a + off, n, off);
+        }
+
+        if (sum != h.sum) {
+                bloom_del(bloom);
+                errno = EIO;
+                return NULL;
+        }
+
+        return bloom;
+}
+
+
+int bloom_write_fd(struct bloom_t *bloom, int fd)
+{
+        return bloom_write(bloom, fd_write, &fd);
+}
+
+struct bloom_t *bloom_read_fd(int fd)
+{
+        return bloom_read(fd_read, &fd);
+}
+
+
+/******************************************************************************
+ * bloom_track_dirty  Start noting which regions of a filter change.
+ * `````````````````
+ * @bloom : Bloom filter
+ * Returns: 0, or -1 with errno set.
+ *
+ * NOTES
+ * Call before the filter is shared between threads. Every region counts
+ * as clean to begin with: the first delta covers changes from this call
+ * on, so a receiver should start from a full copy taken at the same time.
+ *
+ ******************************************************************************/
+int bloom_track_dirty(struct bloom_t *bloom)
+{
+        if (bloom->dirty)
+                return 0;
+
+        /* The dirty map, then the map of cleared regions (internal.h) */
+        if (!(bloom->dirty = calloc(2 * DIRTY_MAP_WORDS(bloom->m), sizeof(uint64_t)))) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        return 0;
+}
+
+
+/******************************************************************************
+ * dirty_snapshot  Take, and clear, the dirty map of a filter.
+ * ``````````````
+ * @bloom : Bloom filter, with a dirty map
+ * @words : number of words in the map, the map of cleared regions after
+ * Returns: a copy of the map as it was, or NULL.
+ *
+ * NOTES
+ * Each word is swapped for zero atomically. An add that races with this
+ * either left its mark before the swap (and its region is in this delta)
+ * or after (and it will be in the next one), so no change is ever lost.
+ *
+ ******************************************************************************/
+static uint64_t *dirty_snapshot(struct bloom_t *bloom, size_t words)
+{
+        uint64_t *snap;
+        size_t n;
+
+        if (!(snap = malloc(words * sizeof(uint64_t))))
+                return NULL;
+
+        for (n=0; n<words; n++)
+                snap[n] = __atomic_exchange_n(&bloom->dirty[n], 0, __ATOMIC_ACQ_REL);
+
+        return snap;
+}
+
+
+/******************************************************************************
+ * next_range  Find the next run of dirty regions, all cleared or none.
+ * ``````````
+ * @snap    : dirty map snapshot
+ * @cleared : cleared map snapshot
+ * @regions : number of regions in the map
+ * @r       : region to start looking from (updated to the end of the run)
+ * Returns: the first region of the run, or 'regions' if there is none.
+ *
+ ******************************************************************************/
+#define MAPBIT(map, r) ((map)[(r) / WORD_BIT] >> ((r) % WORD_BIT) & 1)
+
+static size_t next_range(const uint64_t *snap, const uint64_t *cleared,
+                         size_t regions, size_t *r)
+{
+        size_t first;
+
+        while (*r < regions && !MAPBIT(snap, *r))
+                (*r)++;
+
+        for (first = *r; *r < regions && MAPBIT(snap, *r)
+                      && MAPBIT(cleared, *r) == MAPBIT(cleared, first); )
+                (*r)++;
+
+        return first;
+}
+
+
+/******************************************************************************
+ * bloom_export_delta  Write the regions changed since the last checkpoint.
+ * ``````````````````
+ * @bloom : Bloom filter, after bloom_track_dirty()
+ * @fn    : called with each successive piece of the delta
+ * @ctx   : passed to fn
+ * Returns: 0, or -1 with errno set.
+ *
+ * NOTES
+ * This is the checkpoint: the dirty map is cleared as it is read, so the
+ * next delta starts from here. Adds may carry on meanwhile. Should fn
+ * fail, the changes are not re-marked; send a full copy to recover.
+ *
+ ******************************************************************************/
+int bloom_export_delta(struct bloom_t *bloom, bloom_write_fn fn, void *ctx)
+{
+        struct bloom_delta_header h;
+        size_t regions, words, nwords, r, first;
+        uint64_t range[2], n;
+        uint64_t *snap;
+        int rc;
+
+        if (!bloom->dirty) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        regions = (bloom->m + DIRTY_REGION_BITS - 1) / DIRTY_REGION_BITS;
+        words   = DIRTY_MAP_WORDS(bloom->m);
+        nwords  = (bloom->m + WORD_BIT - 1) / WORD_BIT;
+
+        if (!(snap = dirty_snapshot(bloom, 2 * words))) {
+                errno = ENOMEM;
+                return -1;
+        }
+
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, BLOOM_DELTA_MAGIC, sizeof(h.magic));
+        h.version = BLOOM_FILE_VERSION;
+        h.m       = bloom->m;
+        h.k       = bloom->k;
+        h.seed    = bloom->seed;
+        h.parts   = bloom->parts;
+
+        for (r=0; next_range(snap, snap + words, regions, &r) < regions; )
+                h.ranges++;
+
+        rc = fn(ctx, &h, sizeof(h));
+
+        for (r=0; !rc && (first = next_range(snap, snap + words, regions, &r)) < regions; ) {
+                range[0] = first * (BLOOM_DIRTY_REGION / sizeof(uint64_t));
+                range[1] = r     * (BLOOM_DIRTY_REGION / sizeof(uint64_t));
+                if (range[1] > nwords)
+                        range[1] = nwords;
+                range[1] -= range[0];
+                n = range[1];
+
+                if (MAPBIT(snap + words, first))
+                        range[1] |= DELTA_REPLACE;
+
+                rc = fn(ctx, range, sizeof(range))
+                  || fn(ctx, bloom->a + range[0], n * sizeof(uint64_t));
+        }
+
+        free(snap);
+
+        return rc ? -1 : 0;
+}
+
+
+/* Store word w of a replace range, with the bookkeeping of bloom_or_word() */
+static void delta_store_word(struct bloom_t *bloom, size_t w, uint64_t bits)
+{
+        __atomic_store_n(&bloom->a[w], bits, __ATOMIC_RELAXED);
+
+        if (bloom->dirty)
+                bloom_mark_cleared(bloom, w, w + 1);
+        if (bloom->touched && bits)
+                bloom_touch(bloom->touched, w * WORD_BIT / TOUCH_BLOCK_BITS, bloom->flags);
+}
+
+
+/******************************************************************************
+ * bloom_apply_delta  Merge a delta into a filter.
+ * `````````````````
+ * @bloom : Bloom filter, the same shape (m, k, seed, parts) as the sender
+ * @fn    : called to fill each successive piece of the delta
+ * @ctx   : passed to fn
+ * Returns: 0, or -1 with errno set. A failure part way leaves the ranges
+ *          read up to then merged, which is harmless.
+ *
+ * NOTES
+ * Words are ORed in, atomically for BLOOM_CONCURRENT filters, so lookups
+ * may carry on meanwhile; those of replace ranges are stored, one atomic
+ * store each, so a lookup sees a word as before or as after, never as 0
+ * in between. If the receiver tracks its own dirty regions the merge marks
+ * them (replace ranges as cleared), so deltas can be relayed onwards.
+ *
+ ******************************************************************************/
+int bloom_apply_delta(struct bloom_t *bloom, bloom_read_fn fn, void *ctx)
+{
+        struct bloom_delta_header h;
+        uint64_t buf[APPLY_WORDS];
+        uint64_t range[2], i, n, r, j, w;
+        size_t nwords;
+        bool replace;
+
+        if (fn(ctx, &h, sizeof(h)))
+                return -1;
+
+        if (memcmp(h.magic, BLOOM_DELTA_MAGIC, sizeof(h.magic))
+         || h.version != BLOOM_FILE_VERSION) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        if (h.m != bloom->m || h.k != bloom->k || h.seed != bloom->seed
+         || h.parts != bloom->parts || bloom->hash || bloom->hashlen) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        nwords = (bloom->m + WORD_BIT - 1) / WORD_BIT;
+
+        for (r=0; r<h.ranges; r++) {
+                if (fn(ctx, range, sizeof(range)))
+                        return -1;
+
+                replace   = range[1] & DELTA_REPLACE;
+                range[1] &= ~DELTA_REPLACE;
+
+                if (range[0] > nwords || range[1] > nwords - range[0]) {
+                        errno = EINVAL;
+                        return -1;
+                }
+
+                for (i=0; i<range[1]; i+=n) {
+                        n = range[1] - i < APPLY_WORDS ? range[1] - i : APPLY_WORDS;
+                        if (fn(ctx, buf, n * sizeof(uint64_t)))
+                                return -1;
+
+                        for (j=0; j<n; j++) {
+                                w = range[0] + i + j;
+                                if (replace)
+                                        delta_store_word(bloom, w, buf[j]);
+                                else if (buf[j] & ~__atomic_load_n(&bloom->a[w], __ATOMIC_RELAXED))
+                                        bloom_or_word(bloom, w, buf[j]);
+                        }
+                }
+        }
+
+        return 0;
+}
@@ -31,7 +31,7 @@ int main(int argc, char *argv[])
                 exit(0);
         }
 
-        bloom = bloom_new(2500000, 4, fnv_hash, sax_hash, sdbm_hash, djb2_hash);
+        bloom = bloom_new_optimal(nstrings, 0.001);
 
         printf("Testing Bloom filter.\n\n");
         printf("m: %zd\nk: %zd\n\n", bloom->m, bloom->k);
@@ -0,0 +1,307 @@
+/******************************************************************************
+ * window.c
+ * ````````
+ * Sliding window Bloom filters
+ *
+ * To remember keys for only the last T seconds (deduplicating a stream,
+ * say), the usual trick is to keep one filter per period of T/g, add to
+ * the newest, check all g of them, and at the end of each period throw
+ * away the oldest and start an empty one. The trouble is the empty one:
+ * zeroing (or allocating) hundreds of megabytes at the end of a period
+ * stalls whatever thread does the rotation.
+ *
+ * Here the g generations live in g+1 slots. The spare slot is the next
+ * generation, and is always already empty by the time it is needed, so
+ * bloom_window_rotate() only has to swap a couple of indices. The slot of
+ * the generation that just expired becomes the new spare: it is taken
+ * out of queries at once, and then zeroed while the filter goes on being
+ * used, either by a background thread or lazily, a few words at a time,
+ * as keys are added.
+ *
+ * NOTES
+ * The slots are interleaved word by word: word w of every slot sits at
+ * a[w*slots .. w*slots+slots), so a probe finds its bit of every
+ * generation in the same one or two cache lines, and checking g
+ * generations costs hardly more misses than checking one. The words of the
+ * slots not live are masked out of the OR, so there is no branch on them.
+ *
+ ******************************************************************************/
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "internal.h"
+
+
+#define ROUND(size) (((size) + WORD_BIT - 1) / WORD_BIT)
+
+#define LAZY_WORDS 16           /* words of the spare zeroed per add */
+#define NO_SLOT    ((size_t)-1)
+
+
+/******************************************************************************
+ * window_clear  Zero words [from, to) of a slot.
+ * ````````````
+ ******************************************************************************/
+static void window_clear(struct bloom_window_t *win, size_t slot, size_t from, size_t to)
+{
+        uint64_t *a = win->a + slot;
+        size_t w;
+
+        for (w=from; w<to; w++)
+                __atomic_store_n(&a[w * win->slots], 0, __ATOMIC_RELAXED);
+}
+
+static void *window_worker(void *arg)
+{
+        struct bloom_window_t *win = arg;
+
+        window_clear(win, win->clearing, 0, ROUND(win->m));
+
+        return NULL;
+}
+
+
+/******************************************************************************
+ * window_settle  Finish zeroing the spare slot, if that is still going on.
+ * `````````````
+ * @win   : sliding window filter
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+static void window_settle(struct bloom_window_t *win)
+{
+        if (win->clearing == NO_SLOT)
+                return;
+
+        if (win->worker) {
+                pthread_join(*(pthread_t *)win->worker, NULL);
+                free(win->worker);
+                win->worker = NULL;
+        } else {
+                window_clear(win, win->clearing, win->cleared, ROUND(win->m));
+        }
+
+        win->clearing = NO_SLOT;
+}
+
+
+/******************************************************************************
+ * bloom_window_new  Allocate and return a new sliding window Bloom filter.
+ * ````````````````
+ * @size  : size of the bit array of each generation
+ * @nfuncs: the number of bit positions (k) set per key
+ * @gens  : the number of generations remembered, 1 to BLOOM_WINDOW_MAX
+ * @flags : BLOOM_WINDOW_BACKGROUND to zero expired generations on a
+ *          thread of their own, otherwise they are zeroed by the adds
+ * Returns: An allocated sliding window filter, or NULL (errno EINVAL for
+ *          a bad number of generations).
+ *
+ * USAGE
+ * A check sees the OR of the generations, which is the filter of all the
+ * keys in the window, so size 'size' and k as for one filter holding the
+ * keys of the whole window. With a window of T and gens generations,
+ * call bloom_window_rotate() every T/gens: keys are then remembered for
+ * between T - T/gens and T.
+ *
+ ******************************************************************************/
+struct bloom_window_t *bloom_window_new(size_t size, size_t num_hashes, size_t gens,
+                                        unsigned int flags)
+{
+        struct bloom_window_t *win;
+        size_t s;
+
+        if (gens < 1 || gens > BLOOM_WINDOW_MAX) {
+                errno = EINVAL;
+                return NULL;
+        }
+
+        if (!(win = malloc(sizeof(struct bloom_window_t))))
+                return NULL;
+
+        if (!(win->a = calloc(ROUND(size) * (gens + 1), sizeof(uint64_t)))) {
+                free(win);
+                return NULL;
+        }
+
+        win->m        = size;
+        win->k        = num_hashes;
+        win->mask     = (size & (size - 1)) ? 0 : size - 1;
+        win->seed     = 0;
+        win->flags    = flags;
+        win->slots    = gens + 1;
+        win->cur      = 0;
+        win->clearing = NO_SLOT;
+        win->cleared  = 0;
+        win->worker   = NULL;
+
+        /* Only the current generation is live to begin with */
+        for (s=0; s<BLOOM_WINDOW_MAX+1; s++)
+                win->live[s] = 0;
+        win->live[0] = ~0ULL;
+
+        return win;
+}
+
+
+/******************************************************************************
+ * bloom_window_del  Delete a sliding window Bloom filter.
+ * ````````````````
+ * @win   : The condemned.
+ * Returns: nothing.
+ *
+ ******************************************************************************/
+void bloom_window_del(struct bloom_window_t *win)
+{
+        if (win->worker) {
+                pthread_join(*(pthread_t *)win->worker, NULL);
+                free(win->worker);
+        }
+
+        free(win->a);
+        free(win);
+}
+
+
+/******************************************************************************
+ * bloom_window_rotate  Start a new generation, forgetting the oldest.
+ * ```````````````````
+ * @win   : sliding window filter
+ * Returns: 0, or -1 if the background thread could not be started (the
+ *          expired generation is then zeroed lazily instead).
+ *
+ * NOTES
+ * The new generation is the spare slot, zeroed during the last period,
+ * so this costs next to nothing. Only if that zeroing has not finished
+ * yet -- a rotation period too short for the array, or too few adds to
+ * get through it lazily -- does the rest of it happen here.
+ *
+ ******************************************************************************/
+int bloom_window_rotate(struct bloom_window_t *win)
+{
+        size_t next, oldest;
+        pthread_t *t;
+
+        window_settle(win);
+
+        next   = (win->cur + 1) % win->slots;
+        oldest = (next + 1) % win->slots;
+
+        win->live[next]   = ~0ULL;
+        win->live[oldest] = 0;
+        win->cur          = next;
+
+        /* With fewer than 'gens' rotations so far, the oldest was never used */
+        win->clearing = oldest;
+        win->cleared  = 0;
+
+        if (!(win->flags & BLOOM_WINDOW_BACKGROUND))
+                return 0;
+
+        if ((t = malloc(sizeof(pthread_t)))) {
+                if (pthread_create(t, NULL, window_worker, win) == 0) {
+                        win->worker = t;
+                        return 0;
+                }
+                free(t);
+        }
+
+        return -1;
+}
+
+
+/******************************************************************************
+ * bloom_window_add_buf  Add a key to the current generation.
+ * ````````````````````
+ * @win   : sliding window filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: nothing.
+ *
+ * NOTES
+ * Without a background thread, each add zeroes the next LAZY_WORDS words
+ * of the spare slot, so a period of ROUND(m)/LAZY_WORDS adds or more gets
+ * it done before the next rotation. That is a handful of stores to lines
+ * the probes are about to miss on anyway.
+ *
+ * CAVEAT
+ * Adds, rotations and checks are not safe to call from several threads
+ * at once; the background thread is the one exception.
+ *
+ ******************************************************************************/
+void bloom_window_add_buf(struct bloom_window_t *win, const void *key, size_t len)
+{
+        uint64_t h1, h2;
+        size_t pos, end;
+        int n;
+
+        if (win->clearing != NO_SLOT && !win->worker) {
+                end = win->cleared + LAZY_WORDS;
+                if (end >= ROUND(win->m)) {
+                        window_clear(win, win->clearing, win->cleared, ROUND(win->m));
+                        win->clearing = NO_SLOT;
+                } else {
+                        window_clear(win, win->clearing, win->cleared, end);
+                        win->cleared = end;
+                }
+        }
+
+        bloom_hash_pair(key, len, win->seed, &h1, &h2);
+
+        for (n=0; n<win->k; n++, h1+=h2) {
+                pos = bloom_reduce64(h1, win->m, win->mask);
+                win->a[pos / WORD_BIT * win->slots + win->cur] |= 1ULL << (pos % WORD_BIT);
+        }
+}
+
+void bloom_window_add(struct bloom_window_t *win, const char *s)
+{
+        bloom_window_add_buf(win, s, strlen(s));
+}
+
+
+/******************************************************************************
+ * bloom_window_check_buf  Determine if a key is in any live generation.
+ * ``````````````````````
+ * @win   : sliding window filter
+ * @key   : bytes of the key; need not be NUL-terminated
+ * @len   : length of the key in bytes
+ * Returns: false if the key was not added within the window, otherwise
+ *          true.
+ *
+ * NOTES
+ * This is the OR of the generations: each probe passes if its bit is set
+ * in any of them. It could also be asked "all k bits in any one of them",
+ * which is stricter, but the OR is what a single filter holding all the
+ * keys of the window would answer.
+ *
+ ******************************************************************************/
+bool bloom_window_check_buf(struct bloom_window_t *win, const void *key, size_t len)
+{
+        const uint64_t *w;
+        uint64_t h1, h2, word;
+        size_t pos, s;
+        int n;
+
+        bloom_hash_pair(key, len, win->seed, &h1, &h2);
+
+        for (n=0; n<win->k; n++, h1+=h2) {
+                pos = bloom_reduce64(h1, win->m, win->mask);
+                w   = win->a + pos / WORD_BIT * win->slots;
+
+                for (word=0, s=0; s<win->slots; s++)
+                        word |= __atomic_load_n(&w[s], __ATOMIC_RELAXED) & win->live[s];
+
+                if (!((word >> (pos % WORD_BIT)) & 1))
+                        return false;
+        }
+
+        return true;
+}
+
+bool bloom_window_check(struct bloom_window_t *win, const char *s)
+{
+        return bloom_window_check_buf(win, s, strlen(s));
+}